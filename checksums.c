@@ -0,0 +1,201 @@
+/*
+ * checksums.c
+ *	  Enable or disable data checksums along with a control file edit
+ *	  (--data-checksums).
+ *
+ * Enabling works like pg_checksums --enable: every page of every relation
+ * fork gets pd_checksum set, new pages excepted, and pg_control is written
+ * only after all files are synced.  The pages are rewritten by the relscan
+ * worker pool, so large segments are split into ranges across workers
+ * rather than handled one file per thread.  Disabling needs no page writes,
+ * the server ignores pd_checksum then.
+ *
+ * Verifying (--verify-checksums) reads the same pages and fails the edit
+ * before pg_control is touched if any checksum does not match.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include "catalog/pg_control.h"
+#include "common/logging.h"
+#include "portability/instr_time.h"
+#include "storage/bufpage.h"
+#include "storage/checksum.h"
+#include "storage/checksum_impl.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+#include "relscan.h"
+
+static bool write_checksum(RelScan *scan, int worker, const RelFile *file,
+						   BlockNumber blkno, char *page);
+static bool verify_checksum(RelScan *scan, int worker, const RelFile *file,
+							BlockNumber blkno, char *page);
+
+/* Serializes the reports of bad blocks from the workers */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Check that ctl, as read, describes a cleanly shut down cluster, which
+ * scanning its pages for what (e.g. "verify data checksums") requires.
+ */
+void
+check_cluster_shut_down(const PgControl *ctl, const char *what)
+{
+	uint64		state = pgcontrol_get_value(ctl, "state");
+
+	if (state != DB_SHUTDOWNED && state != DB_SHUTDOWNED_IN_RECOVERY)
+		pg_fatal("cluster must be shut down to %s", what);
+}
+
+
+/*
+ * Check that data checksums of ctl, as read, can be turned on (enable) or
+ * off, and that the server is not running.
+ */
+void
+check_data_checksums(const PgControl *ctl, bool enable)
+{
+	uint64		version = pgcontrol_get_value(ctl, "data_checksum_version");
+
+	check_cluster_shut_down(ctl, "change data checksums");
+	if (enable && version > 0)
+		pg_fatal("data checksums are already enabled in cluster");
+	if (!enable && version == 0)
+		pg_fatal("data checksums are already disabled in cluster");
+}
+
+
+/*
+ * Write the checksum of every page under datadir, with jobs workers per
+ * device and the read policy and limits of io.
+ */
+void
+write_data_checksums(const char *datadir, int jobs, ScanIO *io)
+{
+	RelScan		scan;
+	instr_time	start;
+	instr_time	duration;
+	uint64	   *written;
+	uint64		nwritten = 0;
+	int			nworkers;
+	int			i;
+
+	if (!relscan_collect(&scan, datadir, false))
+		pg_fatal("%s", scan.errmsg);
+
+	scan.nworkers = jobs;
+	nworkers = relscan_nworkers(&scan);
+	written = pg_malloc0(sizeof(uint64) * nworkers);
+	scan.page_fn = write_checksum;
+	scan.arg = written;
+	scan.write_back = true;
+	scan.io = io;
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (!relscan_run(&scan))
+		pg_fatal("%s", scan.errmsg);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	for (i = 0; i < nworkers; i++)
+		nwritten += written[i];
+	pg_log_info("wrote checksums to " UINT64_FORMAT " of " UINT64_FORMAT " blocks in %d files in %.1f s",
+				nwritten, scan.blocks_total, scan.nfiles,
+				INSTR_TIME_GET_DOUBLE(duration));
+
+	pg_free(written);
+	relscan_free(&scan);
+}
+
+
+/*
+ * Verify the checksum of every page under datadir, with jobs workers per
+ * device and the read policy and limits of io.  Every bad block is reported.
+ * Returns false if there were any.
+ */
+bool
+verify_data_checksums(const char *datadir, int jobs, ScanIO *io)
+{
+	RelScan		scan;
+	instr_time	start;
+	instr_time	duration;
+	uint64	   *bad;
+	uint64		nbad = 0;
+	int			nworkers;
+	int			i;
+
+	if (!relscan_collect(&scan, datadir, false))
+		pg_fatal("%s", scan.errmsg);
+
+	scan.nworkers = jobs;
+	nworkers = relscan_nworkers(&scan);
+	bad = pg_malloc0(sizeof(uint64) * nworkers);
+	scan.page_fn = verify_checksum;
+	scan.arg = bad;
+	scan.io = io;
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (!relscan_run(&scan))
+		pg_fatal("%s", scan.errmsg);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	for (i = 0; i < nworkers; i++)
+		nbad += bad[i];
+	pg_log_info("verified checksums of " UINT64_FORMAT " blocks in %d files in %.1f s, " UINT64_FORMAT " bad",
+				scan.blocks_total, scan.nfiles, INSTR_TIME_GET_DOUBLE(duration),
+				nbad);
+
+	pg_free(bad);
+	relscan_free(&scan);
+	return nbad == 0;
+}
+
+
+static bool
+verify_checksum(RelScan *scan, int worker, const RelFile *file,
+				BlockNumber blkno, char *page)
+{
+	PageHeader	header = (PageHeader) page;
+	uint16		checksum;
+
+	if (PageIsNew(page))
+		return false;
+
+	checksum = pg_checksum_page(page, blkno);
+	if (header->pd_checksum != checksum)
+	{
+		((uint64 *) scan->arg)[worker]++;
+		pthread_mutex_lock(&report_lock);
+		pg_log_error("checksum verification failed in file \"%s\", block %u: calculated checksum %X but block contains %X",
+					 file->path, blkno % RELSEG_SIZE, checksum, header->pd_checksum);
+		pthread_mutex_unlock(&report_lock);
+	}
+	return false;
+}
+
+
+static bool
+write_checksum(RelScan *scan, int worker, const RelFile *file,
+			   BlockNumber blkno, char *page)
+{
+	PageHeader	header = (PageHeader) page;
+	uint16		checksum;
+
+	if (PageIsNew(page))
+		return false;
+
+	checksum = pg_checksum_page(page, blkno);
+	if (header->pd_checksum == checksum)
+		return false;
+
+	header->pd_checksum = checksum;
+	((uint64 *) scan->arg)[worker]++;
+	return true;
+}
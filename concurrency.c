@@ -0,0 +1,389 @@
+/*
+ * concurrency.c
+ *	  Adaptive number of concurrent reads for scans, and the cgroup v2
+ *	  limits that bound it.
+ *
+ * When -j is not given, only "limit" of a scan's worker threads may have a
+ * read in flight at a time.  The limit starts small and is adjusted once
+ * per window of reads, AIMD-style:
+ *
+ *	- while throughput keeps rising by more than CC_GAIN over the best seen,
+ *	  the limit grows by one;
+ *	- once it stops rising and the mean read latency has grown past
+ *	  CC_LATENCY_FACTOR times the lowest seen, more reads in flight only
+ *	  queue up in the device, and the limit is cut by a quarter.
+ *
+ * That settles near the knee of the throughput/latency curve.  The best
+ * throughput decays a little every window, so the limit is raised again
+ * when other load on the device goes away.  When the cgroup's io.max caps
+ * the device and throughput is already close to that cap, the limit is
+ * not raised at all.
+ *
+ * The owner of the controller starts with "limit" threads and starts
+ * another whenever concurrency_grow() says the limit has risen past the
+ * threads it has, so read buffers, which every thread holds for good, are
+ * only allocated up to the highest limit reached rather than the upper
+ * bound.  That bound comes from the cgroup's cpu.max when it is set,
+ * rather than the number of CPUs the host has.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <dirent.h>
+#include <math.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "concurrency.h"
+
+/* Reads in flight at the start */
+#define CC_INITIAL			2
+/* A window ends after this long with at least CC_WINDOW_READS reads */
+#define CC_WINDOW_SECS		0.1
+#define CC_WINDOW_READS		16
+/* Throughput must beat the best by this much to count as rising */
+#define CC_GAIN				1.05
+#define CC_LATENCY_FACTOR	2.0
+/* Per window */
+#define CC_BEST_DECAY		0.98
+
+/* Devices an io.max entry may name for the device of a scan */
+#define CC_MAX_IO_DEVICES	8
+
+static bool cgroup_path(char *path, size_t len);
+static int	io_devices(dev_t dev, char names[][32], int max);
+static int	add_io_device(const char *sysdir, bool whole_disk,
+						  char names[][32], int n, int max);
+
+
+void
+concurrency_init(ScanConcurrency *cc, int max, dev_t dev)
+{
+	memset(cc, 0, sizeof(ScanConcurrency));
+	pthread_mutex_init(&cc->lock, NULL);
+	pthread_cond_init(&cc->cond, NULL);
+	cc->max = Max(max, 1);
+	cc->min = 1;
+	cc->limit = Min(CC_INITIAL, cc->max);
+	cc->workers = cc->limit;
+	cgroup_io_limit(dev, &cc->ceiling_bps, &cc->ceiling_iops);
+	INSTR_TIME_SET_CURRENT(cc->window_start);
+}
+
+
+void
+concurrency_destroy(ScanConcurrency *cc)
+{
+	pthread_cond_destroy(&cc->cond);
+	pthread_mutex_destroy(&cc->lock);
+}
+
+
+/*
+ * Wait until another read may be issued.
+ */
+void
+concurrency_acquire(ScanConcurrency *cc)
+{
+	pthread_mutex_lock(&cc->lock);
+	while (cc->active >= cc->limit)
+		pthread_cond_wait(&cc->cond, &cc->lock);
+	cc->active++;
+	pthread_mutex_unlock(&cc->lock);
+}
+
+
+/*
+ * A read of bytes taking latency seconds has completed.
+ */
+void
+concurrency_release(ScanConcurrency *cc, size_t bytes, double latency)
+{
+	instr_time	now;
+	double		elapsed;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	pthread_mutex_lock(&cc->lock);
+	cc->active--;
+	cc->window_bytes += bytes;
+	cc->window_reads++;
+	cc->window_latency += latency;
+
+	INSTR_TIME_SUBTRACT(now, cc->window_start);
+	elapsed = INSTR_TIME_GET_DOUBLE(now);
+	if (elapsed >= CC_WINDOW_SECS && cc->window_reads >= CC_WINDOW_READS)
+	{
+		double		bps = cc->window_bytes / elapsed;
+		double		iops = cc->window_reads / elapsed;
+		double		mean_latency = cc->window_latency / cc->window_reads;
+		bool		capped;
+
+		if (cc->base_latency == 0 || mean_latency < cc->base_latency)
+			cc->base_latency = mean_latency;
+		capped = (cc->ceiling_bps > 0 && bps >= 0.95 * cc->ceiling_bps) ||
+			(cc->ceiling_iops > 0 && iops >= 0.95 * cc->ceiling_iops);
+
+		if (bps > cc->best_bps * CC_GAIN && !capped)
+		{
+			cc->best_bps = bps;
+			cc->limit = Min(cc->limit + 1, cc->max);
+		}
+		else if (mean_latency > cc->base_latency * CC_LATENCY_FACTOR)
+			cc->limit = Max(cc->limit * 3 / 4, cc->min);
+		cc->best_bps = Max(cc->best_bps, bps) * CC_BEST_DECAY;
+
+		INSTR_TIME_SET_CURRENT(cc->window_start);
+		cc->window_bytes = 0;
+		cc->window_reads = 0;
+		cc->window_latency = 0;
+	}
+
+	pthread_cond_broadcast(&cc->cond);
+	pthread_mutex_unlock(&cc->lock);
+}
+
+
+/*
+ * Whether the owner should start another worker thread, counting it as
+ * started if so.  Threads are never stopped; a limit that drops and rises
+ * again reuses those already there.
+ */
+bool
+concurrency_grow(ScanConcurrency *cc)
+{
+	bool		grow;
+
+	pthread_mutex_lock(&cc->lock);
+	grow = cc->workers < cc->limit;
+	if (grow)
+		cc->workers++;
+	pthread_mutex_unlock(&cc->lock);
+
+	return grow;
+}
+
+
+/*
+ * The directory of our cgroup under /sys/fs/cgroup, from the "0::" line of
+ * /proc/self/cgroup.  False if there is no cgroup v2 hierarchy.
+ */
+static bool
+cgroup_path(char *path, size_t len)
+{
+	FILE	   *f;
+	char		line[MAXPGPATH];
+	bool		found = false;
+
+	if ((f = fopen("/proc/self/cgroup", "r")) == NULL)
+		return false;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (strncmp(line, "0::", 3) == 0)
+		{
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(path, len, "/sys/fs/cgroup%s", line + 3);
+			found = true;
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+
+/*
+ * CPUs our cgroup or any of its ancestors may use according to cpu.max,
+ * rounded up, or 0 if unlimited.
+ */
+int
+cgroup_cpu_limit(void)
+{
+	char		path[MAXPGPATH];
+	double		cpus = 0;
+
+	if (!cgroup_path(path, sizeof(path)))
+		return 0;
+
+	for (;;)
+	{
+		char		file[MAXPGPATH + 16];
+		FILE	   *f;
+		char		quota[32];
+		double		period;
+		char	   *slash;
+
+		snprintf(file, sizeof(file), "%s/cpu.max", path);
+		if ((f = fopen(file, "r")) != NULL)
+		{
+			if (fscanf(f, "%31s %lf", quota, &period) == 2 &&
+				strcmp(quota, "max") != 0 && period > 0)
+			{
+				double		limit = atof(quota) / period;
+
+				if (cpus == 0 || limit < cpus)
+					cpus = limit;
+			}
+			fclose(f);
+		}
+
+		slash = strrchr(path, '/');
+		if (slash == NULL || strcmp(path, "/sys/fs/cgroup") == 0)
+			break;
+		*slash = '\0';
+	}
+
+	return cpus > 0 ? (int) ceil(cpus) : 0;
+}
+
+
+/*
+ * Read bytes and requests per second the io.max of our cgroup or its
+ * ancestors allows on dev; 0 where there is no limit.  io.max names whole
+ * disks, while files live on a partition or a device-mapper device, so the
+ * disks below dev count too, see io_devices().
+ */
+void
+cgroup_io_limit(dev_t dev, double *bps, double *iops)
+{
+	char		path[MAXPGPATH];
+	char		devnames[CC_MAX_IO_DEVICES][32];
+	int			ndevnames;
+
+	*bps = 0;
+	*iops = 0;
+	if (!cgroup_path(path, sizeof(path)))
+		return;
+	ndevnames = io_devices(dev, devnames, CC_MAX_IO_DEVICES);
+
+	for (;;)
+	{
+		char		file[MAXPGPATH + 16];
+		char		line[256];
+		FILE	   *f;
+		char	   *slash;
+
+		snprintf(file, sizeof(file), "%s/io.max", path);
+		if ((f = fopen(file, "r")) != NULL)
+		{
+			while (fgets(line, sizeof(line), f) != NULL)
+			{
+				char	   *tok;
+				char	   *save;
+				int			i;
+
+				tok = strtok_r(line, " \n", &save);
+				if (tok == NULL)
+					continue;
+				for (i = 0; i < ndevnames; i++)
+					if (strcmp(tok, devnames[i]) == 0)
+						break;
+				if (i == ndevnames)
+					continue;
+				while ((tok = strtok_r(NULL, " \n", &save)) != NULL)
+				{
+					double		value;
+
+					if (strncmp(tok, "rbps=", 5) == 0 && strcmp(tok + 5, "max") != 0)
+					{
+						value = atof(tok + 5);
+						if (*bps == 0 || value < *bps)
+							*bps = value;
+					}
+					else if (strncmp(tok, "riops=", 6) == 0 && strcmp(tok + 6, "max") != 0)
+					{
+						value = atof(tok + 6);
+						if (*iops == 0 || value < *iops)
+							*iops = value;
+					}
+				}
+			}
+			fclose(f);
+		}
+
+		slash = strrchr(path, '/');
+		if (slash == NULL || strcmp(path, "/sys/fs/cgroup") == 0)
+			break;
+		*slash = '\0';
+	}
+}
+
+
+/*
+ * "major:minor" of dev and of the whole disks it lives on, as io.max names
+ * them: the disk of a partition, and for a device-mapper or md device the
+ * devices in its slaves directory and their disks.  Returns how many of
+ * max names were filled in.
+ */
+static int
+io_devices(dev_t dev, char names[][32], int max)
+{
+	char		sysdir[MAXPGPATH];
+	char		slavedir[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+	int			n = 0;
+
+	snprintf(names[n++], 32, "%u:%u", major(dev), minor(dev));
+	snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u",
+			 major(dev), minor(dev));
+	n = add_io_device(sysdir, true, names, n, max);
+
+	snprintf(slavedir, sizeof(slavedir), "%s/slaves", sysdir);
+	if ((dir = opendir(slavedir)) == NULL)
+		return n;
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		path[MAXPGPATH];
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", slavedir, de->d_name);
+		n = add_io_device(path, false, names, n, max);
+		n = add_io_device(path, true, names, n, max);
+	}
+	closedir(dir);
+
+	return n;
+}
+
+
+/*
+ * Add the "dev" of the block device at sysdir, or with whole_disk that of
+ * the disk it is a partition of, if it is one.
+ */
+static int
+add_io_device(const char *sysdir, bool whole_disk, char names[][32], int n,
+			  int max)
+{
+	char		path[MAXPGPATH];
+	FILE	   *f;
+
+	if (n >= max)
+		return n;
+	if (whole_disk)
+	{
+		snprintf(path, sizeof(path), "%s/partition", sysdir);
+		if (access(path, F_OK) != 0)
+			return n;
+		snprintf(path, sizeof(path), "%s/../dev", sysdir);
+	}
+	else
+		snprintf(path, sizeof(path), "%s/dev", sysdir);
+
+	if ((f = fopen(path, "r")) == NULL)
+		return n;
+	if (fgets(names[n], 32, f) != NULL)
+	{
+		names[n][strcspn(names[n], "\n")] = '\0';
+		if (names[n][0] != '\0')
+			n++;
+	}
+	fclose(f);
+
+	return n;
+}
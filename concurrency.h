@@ -0,0 +1,51 @@
+/*
+ * concurrency.h
+ *	  Adaptive number of concurrent reads for scans, and the cgroup v2
+ *	  limits that bound it.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef CONCURRENCY_H
+#define CONCURRENCY_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "portability/instr_time.h"
+
+typedef struct ScanConcurrency
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int			min;
+	int			max;
+	int			limit;			/* reads allowed in flight */
+	int			active;			/* reads in flight */
+	int			workers;		/* threads of the owner, see
+								 * concurrency_grow() */
+
+	/* io.max of the device, 0 = none */
+	double		ceiling_bps;
+	double		ceiling_iops;
+
+	/* the current measurement window */
+	instr_time	window_start;
+	uint64		window_bytes;
+	uint64		window_reads;
+	double		window_latency;	/* sum, in seconds */
+
+	double		best_bps;		/* decays so that the knee is re-probed */
+	double		base_latency;	/* lowest mean read latency seen */
+} ScanConcurrency;
+
+extern void concurrency_init(ScanConcurrency *cc, int max, dev_t dev);
+extern void concurrency_destroy(ScanConcurrency *cc);
+extern void concurrency_acquire(ScanConcurrency *cc);
+extern void concurrency_release(ScanConcurrency *cc, size_t bytes,
+								double latency);
+extern bool concurrency_grow(ScanConcurrency *cc);
+
+extern int	cgroup_cpu_limit(void);
+extern void cgroup_io_limit(dev_t dev, double *bps, double *iops);
+
+#endif							/* CONCURRENCY_H */
@@ -0,0 +1,1433 @@
+/*
+ * derive.c
+ *	  Derive safe values for the counters of pg_control from what is on
+ *	  disk (--derive).
+ *
+ * When pg_control is lost or damaged, -x, -m, -o and -l must be set past
+ * anything the cluster has used.  The heap pages of every relation are
+ * scanned for the newest xmin and xmax, the newest multixact in xmax and
+ * the newest page LSN, and the WAL from the redo pointer to its end for the
+ * newest xl_xid and the counters logged by checkpoint and NEXTOID records.
+ * Relation file numbers are taken from the OID counter, so the highest one
+ * found is a lower bound for the next OID.  XIDs and multixacts are ordered
+ * from oldestXid and oldestMulti of pg_control.
+ *
+ * On a large cluster the heap scan takes hours.  It keeps its progress in a
+ * state file, the ranges of the relation files finished so far and the
+ * maxima found in them, rewritten every DERIVE_FLUSH_SECS and when SIGINT
+ * or SIGTERM stops the scan.  --resume continues from there, reading only
+ * the ranges not finished yet.  The state file is removed once the scan is
+ * complete.
+ *
+ * Counters are derived again and again on the same clusters, while most
+ * relation files and WAL segments do not change in between.  A completed
+ * run leaves an index next to the state file with the size, inode and
+ * mtime of every file it read in full and the maxima found in it, and the
+ * next run reads only the files whose identity differs, taking the rest
+ * from the index.  A file modified in the second the run started or later
+ * is left out, as a change within the same second would go unnoticed.  A
+ * WAL segment is only taken from the index if the one after it is too, as
+ * its last record may continue there; the segment holding redo is always
+ * read, its walk starting at redo.
+ *
+ * For triage, --sample reads only a fraction of the heap blocks of every
+ * relation, half of them from its end, and the last few WAL segments, and
+ * estimates how far the maxima of the blocks not read may lie above those
+ * found; see top_bound().  It neither uses nor writes the state file and
+ * the index.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <math.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "access/multixact.h"
+#include "access/transam.h"
+#include "access/xlog_internal.h"
+#include "catalog/pg_control.h"
+#include "common/logging.h"
+#include "common/pg_prng.h"
+#include "portability/instr_time.h"
+#include "storage/bufpage.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+#include "relscan.h"
+#include "walscan.h"
+
+/* How often the state file is rewritten while the scan runs */
+#define DERIVE_FLUSH_SECS	30
+
+#define DERIVE_STATE_HEADER	"pg_control_editor derive state 1"
+#define DERIVE_INDEX_HEADER	"pg_control_editor derive index 1"
+
+/*
+ * --sample keeps the DERIVE_SAMPLE_TOP largest values of each kind, reads
+ * the last DERIVE_SAMPLE_WAL_SEGMENTS of the WAL up to the last segment
+ * written, and adds at least the margins below to the XID and multixact it
+ * estimates.
+ */
+#define DERIVE_SAMPLE_TOP	16
+#define DERIVE_SAMPLE_WAL_SEGMENTS	4
+#define DERIVE_SAMPLE_CONFIDENCE	0.99
+#define DERIVE_SAMPLE_XID_MARGIN	1000000
+#define DERIVE_SAMPLE_MULTI_MARGIN	100000
+
+/* The newest values seen, invalid where none was */
+typedef struct DeriveMaxima
+{
+	TransactionId xid;
+	MultiXactId multi;
+	XLogRecPtr	lsn;
+	Oid			oid;
+	uint64		heap_pages;
+	uint64		before_oldest;	/* XIDs and multis older than the oldest */
+} DeriveMaxima;
+
+/* The largest values seen, largest first */
+typedef struct DeriveTop
+{
+	uint64		values[DERIVE_SAMPLE_TOP];
+	int			n;
+} DeriveTop;
+
+/* Page maxima of a sample; XIDs and multis as distances from the oldest */
+typedef struct DeriveSample
+{
+	DeriveTop	xid;
+	DeriveTop	multi;
+	DeriveTop	lsn;
+} DeriveSample;
+
+/* One file of the index, see load_index() */
+typedef struct DeriveIndexEntry
+{
+	char	   *path;			/* relative to the data directory */
+	bool		is_wal;
+	uint64		size;
+	uint64		ino;
+	int64		mtime;
+	DeriveMaxima maxima;
+	/* the walk over a WAL segment, as in WalScanSegment */
+	XLogRecPtr	first_start;
+	XLogRecPtr	first_prev;
+	XLogRecPtr	last_start;
+	XLogRecPtr	next;
+	uint64		nrecords;
+} DeriveIndexEntry;
+
+/* Per relation file of the heap scan */
+typedef struct DeriveFile
+{
+	DeriveMaxima maxima;
+	BlockNumber blocks_done;	/* in ranges finished by this run */
+	bool		indexed;		/* unchanged since the index was written */
+} DeriveFile;
+
+/* A finished range of a relation file */
+typedef struct DeriveRange
+{
+	char	   *path;			/* relative to the data directory */
+	BlockNumber nblocks;		/* of the file at the time */
+	BlockNumber start;
+	BlockNumber end;
+} DeriveRange;
+
+typedef struct DeriveState
+{
+	const char *datadir;
+	const char *state_file;
+	const char *index_file;
+	uint64		system_identifier;
+	TransactionId oldest_xid;
+	MultiXactId oldest_multi;
+	time_t		started;
+
+	/* the index of an earlier run, sorted by path */
+	DeriveIndexEntry *index;
+	int			nindex;
+
+	/* per file of the heap scan */
+	DeriveFile *files;
+
+	/* per worker, folded into heap when a range is finished */
+	DeriveMaxima *workers;
+	DeriveSample *samples;		/* with --sample, else NULL */
+
+	/* ranges finished by an earlier run, sorted for skip_range() */
+	DeriveRange *resumed;
+	int			nresumed;
+
+	/* protected by lock */
+	pthread_mutex_t lock;
+	DeriveMaxima heap;
+	DeriveMaxima wal;
+	DeriveRange *done;
+	int			ndone;
+	instr_time	last_flush;
+	DeriveIndexEntry *wal_entries;	/* WAL segments for the new index */
+	int			nwal_entries;
+} DeriveState;
+
+static int	run_sample(DeriveState *state, const PgControl *ctl,
+					   double fraction, int jobs, ScanIO *io);
+static RelScanRange *sample_ranges(const RelScan *scan, double fraction,
+								   int *nranges, int *nrelations);
+static void add_sample_blocks(const RelScan *scan, const RelFile **rel,
+							  int nsegs, BlockNumber start, BlockNumber end,
+							  RelScanRange **ranges, int *nranges);
+static void add_sample(DeriveSample *sample, const DeriveMaxima *page_max,
+					   const DeriveState *state);
+static void top_insert(DeriveTop *top, uint64 value);
+static void top_merge(DeriveTop *into, const DeriveTop *from);
+static uint64 top_bound(const DeriveTop *top);
+static int	cmp_relfile(const void *a, const void *b);
+static void derive_wal(DeriveState *state, const PgControl *ctl, int jobs,
+					   int tail_segments, ScanIO *io, XLogRecPtr *end);
+static void note_record(WalScan *scan, int worker, XLogRecPtr lsn,
+						const XLogRecord *record);
+static bool skip_segment(WalScan *scan, XLogSegNo segno, WalScanSegment *seg);
+static void finish_segment(WalScan *scan, int worker, XLogSegNo segno,
+						   const WalScanSegment *seg);
+static DeriveIndexEntry *find_segment(DeriveState *state, WalScan *scan,
+									  XLogSegNo segno, struct stat *st);
+static void add_wal_entry(DeriveState *state, const DeriveIndexEntry *entry);
+static bool note_page(RelScan *scan, int worker, const RelFile *file,
+					  BlockNumber blkno, char *page);
+static void note_page_maxima(const DeriveState *state, DeriveMaxima *m,
+							 char *page);
+static bool skip_range(RelScan *scan, const RelFile *file, BlockNumber start,
+					   BlockNumber end);
+static void finish_range(RelScan *scan, int worker, const RelFile *file,
+						 BlockNumber start, BlockNumber end);
+static void note_xid(DeriveMaxima *m, TransactionId xid, TransactionId oldest);
+static void note_multi(DeriveMaxima *m, MultiXactId multi, MultiXactId oldest);
+static void merge_maxima(DeriveMaxima *into, const DeriveMaxima *from,
+						 const DeriveState *state);
+static const char *relative_path(const DeriveState *state, const char *path);
+static DeriveIndexEntry *find_entry(const DeriveState *state, const char *path,
+									uint64 size, uint64 ino, int64 mtime);
+static void load_state(DeriveState *state);
+static void write_state(DeriveState *state);
+static void load_index(DeriveState *state);
+static void write_index_entry(FILE *f, const DeriveIndexEntry *entry);
+static void write_index(DeriveState *state, const RelScan *scan);
+static FILE *begin_rewrite(const char *path, char *tmp, size_t len);
+static void end_rewrite(FILE *f, const char *tmp, const char *path);
+static int	cmp_range(const void *a, const void *b);
+static int	cmp_entry(const void *a, const void *b);
+static void handle_interrupt(SIGNAL_ARGS);
+
+/* The running scan, for the signal handler */
+static RelScan *volatile interrupted_scan = NULL;
+
+
+/*
+ * Scan datadir and print the newest XID, multixact, OID and LSN in use
+ * with the options that would move pg_control past them.  state_file keeps
+ * the progress of the heap scan, continued from with resume; files that
+ * have not changed since index_file was written are not read.  With sample,
+ * only that fraction of the heap is read and the maxima are estimated.
+ */
+int
+run_derive(const PgControl *ctl, const char *datadir, const char *state_file,
+		   bool resume, const char *index_file, double sample, int jobs,
+		   ScanIO *io)
+{
+	DeriveState state;
+	DeriveMaxima heap;
+	DeriveMaxima total;
+	RelScan		scan;
+	XLogRecPtr	wal_end;
+	XLogRecPtr	lsn;
+	TransactionId next_xid;
+	MultiXactId next_multi;
+	Oid			next_oid;
+	XLogSegNo	next_segno;
+	TimeLineID	tli = pgcontrol_get_value(ctl, "checkPointCopy.ThisTimeLineID");
+	char		walfile[MAXFNAMELEN];
+	instr_time	start;
+	instr_time	duration;
+	int			nworkers;
+	int			nindexed = 0;
+	int			i;
+
+	memset(&state, 0, sizeof(state));
+	state.datadir = datadir;
+	state.state_file = state_file;
+	state.index_file = index_file;
+	state.system_identifier = pgcontrol_get_value(ctl, "system_identifier");
+	state.oldest_xid = pgcontrol_get_value(ctl, "checkPointCopy.oldestXid");
+	state.oldest_multi = pgcontrol_get_value(ctl, "checkPointCopy.oldestMulti");
+	state.started = time(NULL);
+	pthread_mutex_init(&state.lock, NULL);
+
+	if (sample > 0)
+		return run_sample(&state, ctl, sample, jobs, io);
+
+	if (resume)
+		load_state(&state);
+	else if (access(state_file, F_OK) == 0)
+		pg_fatal("state file \"%s\" of an interrupted scan exists; continue it with --resume or remove it",
+				 state_file);
+	load_index(&state);
+
+	INSTR_TIME_SET_CURRENT(start);
+	derive_wal(&state, ctl, jobs, 0, io, &wal_end);
+
+	if (!relscan_collect(&scan, datadir, true))
+		pg_fatal("%s", scan.errmsg);
+	scan.nworkers = jobs;
+	nworkers = relscan_nworkers(&scan);
+	state.workers = pg_malloc0(sizeof(DeriveMaxima) * nworkers);
+	scan.page_fn = note_page;
+	scan.skip_fn = skip_range;
+	scan.range_done_fn = finish_range;
+	scan.arg = &state;
+	scan.io = io;
+
+	state.files = pg_malloc0(sizeof(DeriveFile) * Max(scan.nfiles, 1));
+	for (i = 0; i < scan.nfiles; i++)
+	{
+		RelFile    *file = &scan.files[i];
+		DeriveIndexEntry *entry;
+
+		entry = find_entry(&state, relative_path(&state, file->path),
+						   file->size, file->ino, file->mtime);
+		if (entry != NULL && !entry->is_wal)
+		{
+			state.files[i].maxima = entry->maxima;
+			state.files[i].indexed = true;
+			nindexed++;
+		}
+
+		/* Relation file numbers come from the OID counter */
+		state.files[i].maxima.oid = Max(state.files[i].maxima.oid,
+										file->relfilenode);
+		state.heap.oid = Max(state.heap.oid, file->relfilenode);
+	}
+
+	INSTR_TIME_SET_CURRENT(state.last_flush);
+	interrupted_scan = &scan;
+	pqsignal(SIGINT, handle_interrupt);
+	pqsignal(SIGTERM, handle_interrupt);
+
+	if (!relscan_run(&scan))
+	{
+		pqsignal(SIGINT, SIG_DFL);
+		pqsignal(SIGTERM, SIG_DFL);
+		pthread_mutex_lock(&state.lock);
+		write_state(&state);
+		pthread_mutex_unlock(&state.lock);
+		if (scan.failed)
+			pg_fatal("%s", scan.errmsg);
+		pg_log_error("scan interrupted after " UINT64_FORMAT " of " UINT64_FORMAT " blocks; continue it with --resume",
+					 scan.blocks_done, scan.blocks_total);
+		exit(1);
+	}
+	pqsignal(SIGINT, SIG_DFL);
+	pqsignal(SIGTERM, SIG_DFL);
+	interrupted_scan = NULL;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	/* What this run and the resumed one read, and the unchanged files */
+	heap = state.heap;
+	for (i = 0; i < scan.nfiles; i++)
+		if (state.files[i].indexed)
+			merge_maxima(&heap, &state.files[i].maxima, &state);
+	total = heap;
+	merge_maxima(&total, &state.wal, &state);
+
+	/* The next values are one past the newest, skipping the special ones */
+	next_xid = TransactionIdIsValid(total.xid) ? total.xid + 1 : state.oldest_xid;
+	if (!TransactionIdIsNormal(next_xid))
+		next_xid = FirstNormalTransactionId;
+	next_multi = MultiXactIdIsValid(total.multi) ? total.multi + 1 : state.oldest_multi;
+	if (next_multi < FirstMultiXactId)
+		next_multi = FirstMultiXactId;
+	next_oid = Max(total.oid + 1, FirstNormalObjectId);
+
+	/* New WAL must start past every page LSN and the end of the old WAL */
+	lsn = Max(total.lsn, wal_end);
+	lsn = Max(lsn, (XLogRecPtr) pgcontrol_get_value(ctl, "checkPoint"));
+	next_segno = lsn / ctl->wal_segsize + 1;
+	XLogFileName(walfile, tli, next_segno, ctl->wal_segsize);
+
+	printf("heap pages          " UINT64_FORMAT " in %d files (" UINT64_FORMAT " blocks, %d files unchanged) in %.1f s\n",
+		   heap.heap_pages, scan.nfiles, scan.blocks_total, nindexed,
+		   INSTR_TIME_GET_DOUBLE(duration));
+	printf("newest XID          heap %u, WAL %u\n", heap.xid, state.wal.xid);
+	printf("newest multixact    heap %u, WAL %u\n", heap.multi, state.wal.multi);
+	printf("newest OID          relation files %u, WAL %u\n", heap.oid, state.wal.oid);
+	printf("newest page LSN     %X/%X\n", LSN_FORMAT_ARGS(heap.lsn));
+	printf("end of WAL          %X/%X\n", LSN_FORMAT_ARGS(wal_end));
+	printf("options             -x %u -m %u,%u -o %u -l %s\n",
+		   next_xid, next_multi, state.oldest_multi, next_oid, walfile);
+
+	if (total.before_oldest > 0)
+		pg_log_warning(UINT64_FORMAT " XIDs or multixacts are older than oldestXid %u or oldestMulti %u; pg_control's oldest values are not to be trusted",
+					   total.before_oldest, state.oldest_xid, state.oldest_multi);
+
+	write_index(&state, &scan);
+	if (unlink(state_file) != 0 && errno != ENOENT)
+		pg_log_warning("could not remove file \"%s\": %m", state_file);
+
+	pg_free(state.workers);
+	pg_free(state.files);
+	relscan_free(&scan);
+	return 0;
+}
+
+
+/*
+ * Estimate the maxima from a sample of fraction of the heap blocks and the
+ * tail of pg_wal, and print them with the options that would move
+ * pg_control past them with a margin.
+ */
+static int
+run_sample(DeriveState *state, const PgControl *ctl, double fraction,
+		   int jobs, ScanIO *io)
+{
+	RelScan		scan;
+	RelScanRange *ranges;
+	DeriveSample sample;
+	DeriveMaxima heap;
+	XLogRecPtr	wal_end;
+	XLogRecPtr	lsn;
+	uint64		xid_max;
+	uint64		xid_bound;
+	uint64		xid_margin;
+	uint64		multi_max;
+	uint64		multi_bound;
+	uint64		multi_margin;
+	TransactionId next_xid;
+	MultiXactId next_multi;
+	Oid			next_oid;
+	TimeLineID	tli = pgcontrol_get_value(ctl, "checkPointCopy.ThisTimeLineID");
+	char		walfile[MAXFNAMELEN];
+	instr_time	start;
+	instr_time	duration;
+	int			nranges;
+	int			nrelations;
+	int			nworkers;
+	int			i;
+
+	INSTR_TIME_SET_CURRENT(start);
+	derive_wal(state, ctl, jobs, DERIVE_SAMPLE_WAL_SEGMENTS, io, &wal_end);
+
+	if (!relscan_collect(&scan, state->datadir, true))
+		pg_fatal("%s", scan.errmsg);
+	scan.nworkers = jobs;
+	nworkers = relscan_nworkers(&scan);
+	state->workers = pg_malloc0(sizeof(DeriveMaxima) * nworkers);
+	state->samples = pg_malloc0(sizeof(DeriveSample) * nworkers);
+	scan.page_fn = note_page;
+	scan.arg = state;
+	scan.io = io;
+
+	for (i = 0; i < scan.nfiles; i++)
+		state->heap.oid = Max(state->heap.oid, scan.files[i].relfilenode);
+
+	ranges = sample_ranges(&scan, fraction, &nranges, &nrelations);
+	if (!relscan_run_ranges(&scan, ranges, nranges))
+		pg_fatal("%s", scan.errmsg);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	heap = state->heap;
+	memset(&sample, 0, sizeof(sample));
+	for (i = 0; i < nworkers; i++)
+	{
+		merge_maxima(&heap, &state->workers[i], state);
+		top_merge(&sample.xid, &state->samples[i].xid);
+		top_merge(&sample.multi, &state->samples[i].multi);
+		top_merge(&sample.lsn, &state->samples[i].lsn);
+	}
+
+	/*
+	 * The margin is what the bound adds to the sample, but no less than a
+	 * floor: a sample that hit many pages with the same newest value says
+	 * little about pages it did not hit.  The WAL tail is exact.
+	 */
+	xid_max = sample.xid.n > 0 ? sample.xid.values[0] : 0;
+	xid_bound = top_bound(&sample.xid);
+	xid_margin = Max(xid_bound - xid_max, DERIVE_SAMPLE_XID_MARGIN);
+	if (TransactionIdIsValid(state->wal.xid))
+		xid_max = Max(xid_max, (uint64) (state->wal.xid - state->oldest_xid));
+	next_xid = state->oldest_xid + (TransactionId) Min(xid_max + xid_margin + 1,
+													   (uint64) PG_INT32_MAX);
+	if (!TransactionIdIsNormal(next_xid))
+		next_xid = FirstNormalTransactionId;
+
+	multi_max = sample.multi.n > 0 ? sample.multi.values[0] : 0;
+	multi_bound = top_bound(&sample.multi);
+	multi_margin = Max(multi_bound - multi_max, DERIVE_SAMPLE_MULTI_MARGIN);
+	if (MultiXactIdIsValid(state->wal.multi))
+		multi_max = Max(multi_max, (uint64) (state->wal.multi - state->oldest_multi));
+	next_multi = state->oldest_multi + (MultiXactId) Min(multi_max + multi_margin + 1,
+														 (uint64) PG_INT32_MAX);
+	if (next_multi < FirstMultiXactId)
+		next_multi = FirstMultiXactId;
+
+	next_oid = Max(Max(heap.oid, state->wal.oid) + 1, FirstNormalObjectId);
+
+	lsn = Max(top_bound(&sample.lsn), wal_end);
+	lsn = Max(lsn, (XLogRecPtr) pgcontrol_get_value(ctl, "checkPoint"));
+	XLogFileName(walfile, tli, lsn / ctl->wal_segsize + 1, ctl->wal_segsize);
+
+	printf("sampled pages       " UINT64_FORMAT " of %d relations (" UINT64_FORMAT " heap) in %.1f s\n",
+		   scan.blocks_total, nrelations, heap.heap_pages,
+		   INSTR_TIME_GET_DOUBLE(duration));
+	printf("newest XID          sample %u, %.0f%% bound %u, WAL tail %u\n",
+		   state->oldest_xid + (TransactionId) (sample.xid.n > 0 ? sample.xid.values[0] : 0),
+		   DERIVE_SAMPLE_CONFIDENCE * 100,
+		   state->oldest_xid + (TransactionId) Min(xid_bound, (uint64) PG_INT32_MAX),
+		   state->wal.xid);
+	printf("newest multixact    sample %u, %.0f%% bound %u, WAL tail %u\n",
+		   state->oldest_multi + (MultiXactId) (sample.multi.n > 0 ? sample.multi.values[0] : 0),
+		   DERIVE_SAMPLE_CONFIDENCE * 100,
+		   state->oldest_multi + (MultiXactId) Min(multi_bound, (uint64) PG_INT32_MAX),
+		   state->wal.multi);
+	printf("newest OID          relation files %u, WAL tail %u\n", heap.oid, state->wal.oid);
+	printf("newest page LSN     sample %X/%X, %.0f%% bound %X/%X\n",
+		   LSN_FORMAT_ARGS(heap.lsn), DERIVE_SAMPLE_CONFIDENCE * 100,
+		   LSN_FORMAT_ARGS(top_bound(&sample.lsn)));
+	printf("end of WAL          %X/%X\n", LSN_FORMAT_ARGS(wal_end));
+	printf("safety margin       " UINT64_FORMAT " XIDs, " UINT64_FORMAT " multixacts\n",
+		   xid_margin, multi_margin);
+	printf("options             -x %u -m %u,%u -o %u -l %s\n",
+		   next_xid, next_multi, state->oldest_multi, next_oid, walfile);
+
+	if (sample.xid.n < 2)
+		pg_log_warning("too few heap pages sampled for a bound; the margin is the minimum");
+	if (heap.before_oldest > 0 || state->wal.before_oldest > 0)
+		pg_log_warning("some XIDs or multixacts are older than oldestXid %u or oldestMulti %u; pg_control's oldest values are not to be trusted",
+					   state->oldest_xid, state->oldest_multi);
+
+	pg_free(ranges);
+	pg_free(state->workers);
+	pg_free(state->samples);
+	relscan_free(&scan);
+	return 0;
+}
+
+
+/*
+ * Choose the blocks to read, per relation: about fraction of its blocks,
+ * at least one.  Half of them are its last blocks, where new tuples and new
+ * versions of updated ones go first; the other half is stratified over the
+ * rest, one random block from each of as many equal strata.
+ */
+static RelScanRange *
+sample_ranges(const RelScan *scan, double fraction, int *nranges,
+			  int *nrelations)
+{
+	const RelFile **files = pg_malloc(sizeof(RelFile *) * Max(scan->nfiles, 1));
+	RelScanRange *ranges = NULL;
+	pg_prng_state prng;
+	int			first;
+	int			last;
+	int			i;
+
+	pg_prng_seed(&prng, (uint64) time(NULL));
+	*nranges = 0;
+	*nrelations = 0;
+
+	/* The segments of a relation next to each other, in order */
+	for (i = 0; i < scan->nfiles; i++)
+		files[i] = &scan->files[i];
+	qsort(files, scan->nfiles, sizeof(RelFile *), cmp_relfile);
+
+	for (first = 0; first < scan->nfiles; first = last)
+	{
+		BlockNumber nblocks = 0;
+		BlockNumber nsample;
+		BlockNumber ntail;
+		BlockNumber nstrata;
+		BlockNumber rest;
+		BlockNumber j;
+
+		for (last = first; last < scan->nfiles &&
+			 files[last]->tablespace == files[first]->tablespace &&
+			 files[last]->dboid == files[first]->dboid &&
+			 files[last]->relfilenode == files[first]->relfilenode; last++)
+			nblocks = files[last]->segno * RELSEG_SIZE + files[last]->nblocks;
+		if (nblocks == 0)
+			continue;
+		(*nrelations)++;
+
+		nsample = (BlockNumber) Min(ceil(fraction * nblocks), nblocks);
+		nsample = Max(nsample, 1);
+		ntail = (nsample + 1) / 2;
+		nstrata = nsample - ntail;
+		rest = nblocks - ntail;
+
+		for (j = 0; j < nstrata; j++)
+		{
+			BlockNumber lo = (BlockNumber) ((uint64) rest * j / nstrata);
+			BlockNumber hi = (BlockNumber) ((uint64) rest * (j + 1) / nstrata);
+			BlockNumber blkno;
+
+			if (hi <= lo)
+				continue;
+			blkno = (BlockNumber) pg_prng_uint64_range(&prng, lo, hi - 1);
+			add_sample_blocks(scan, &files[first], last - first, blkno,
+							  blkno + 1, &ranges, nranges);
+		}
+		add_sample_blocks(scan, &files[first], last - first, rest, nblocks,
+						  &ranges, nranges);
+	}
+
+	pg_free(files);
+	return ranges;
+}
+
+
+/*
+ * Add blocks start to end of a relation, whose segments are rel, as ranges
+ * of its segment files.  Blocks in missing segments are left out.
+ */
+static void
+add_sample_blocks(const RelScan *scan, const RelFile **rel, int nsegs,
+				  BlockNumber start, BlockNumber end, RelScanRange **ranges,
+				  int *nranges)
+{
+	int			i;
+
+	for (i = 0; i < nsegs; i++)
+	{
+		BlockNumber segstart = rel[i]->segno * RELSEG_SIZE;
+		BlockNumber from = Max(start, segstart);
+		BlockNumber to = Min(end, segstart + rel[i]->nblocks);
+		RelScanRange *range;
+
+		if (from >= to)
+			continue;
+		if (*nranges % 1024 == 0)
+			*ranges = pg_realloc(*ranges, sizeof(RelScanRange) * (*nranges + 1024));
+		range = &(*ranges)[(*nranges)++];
+		range->file = rel[i] - scan->files;
+		range->start = from - segstart;
+		range->end = to - segstart;
+	}
+}
+
+
+static void
+add_sample(DeriveSample *sample, const DeriveMaxima *page_max,
+		   const DeriveState *state)
+{
+	if (TransactionIdIsValid(page_max->xid))
+		top_insert(&sample->xid, page_max->xid - state->oldest_xid);
+	if (MultiXactIdIsValid(page_max->multi))
+		top_insert(&sample->multi, page_max->multi - state->oldest_multi);
+	top_insert(&sample->lsn, page_max->lsn);
+}
+
+
+static void
+top_insert(DeriveTop *top, uint64 value)
+{
+	int			i;
+
+	if (top->n == DERIVE_SAMPLE_TOP && value <= top->values[top->n - 1])
+		return;
+	if (top->n < DERIVE_SAMPLE_TOP)
+		top->n++;
+	for (i = top->n - 1; i > 0 && top->values[i - 1] < value; i--)
+		top->values[i] = top->values[i - 1];
+	top->values[i] = value;
+}
+
+
+static void
+top_merge(DeriveTop *into, const DeriveTop *from)
+{
+	int			i;
+
+	for (i = 0; i < from->n; i++)
+		top_insert(into, from->values[i]);
+}
+
+
+/*
+ * An upper bound, at DERIVE_SAMPLE_CONFIDENCE, for the largest value of the
+ * population a random sample was drawn from.  Near the top, the gaps
+ * between the largest values of a sample are roughly exponential, with the
+ * mean of the gaps between the top few, and the population's largest value
+ * lies above the sample's by less than -ln(1 - confidence) of those with
+ * that confidence.  With fewer than two values, the largest is all there is.
+ */
+static uint64
+top_bound(const DeriveTop *top)
+{
+	double		gap;
+
+	if (top->n < 2)
+		return top->n == 1 ? top->values[0] : 0;
+	gap = (double) (top->values[0] - top->values[top->n - 1]) / (top->n - 1);
+	return top->values[0] + (uint64) ceil(gap * -log(1 - DERIVE_SAMPLE_CONFIDENCE));
+}
+
+
+static int
+cmp_relfile(const void *a, const void *b)
+{
+	const RelFile *fa = *(const RelFile *const *) a;
+	const RelFile *fb = *(const RelFile *const *) b;
+
+	if (fa->tablespace != fb->tablespace)
+		return fa->tablespace < fb->tablespace ? -1 : 1;
+	if (fa->dboid != fb->dboid)
+		return fa->dboid < fb->dboid ? -1 : 1;
+	if (fa->relfilenode != fb->relfilenode)
+		return fa->relfilenode < fb->relfilenode ? -1 : 1;
+	return fa->segno < fb->segno ? -1 : fa->segno > fb->segno ? 1 : 0;
+}
+
+
+/*
+ * Scan the WAL from redo, or its last tail_segments, to its end into
+ * state->wal, and find its end.
+ */
+static void
+derive_wal(DeriveState *state, const PgControl *ctl, int jobs,
+		   int tail_segments, ScanIO *io, XLogRecPtr *end)
+{
+	WalScan		scan;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.pgdata = state->datadir;
+	scan.segsize = ctl->wal_segsize;
+	scan.tli = pgcontrol_get_value(ctl, "checkPointCopy.ThisTimeLineID");
+	scan.start = pgcontrol_get_value(ctl, "checkPointCopy.redo");
+	scan.nworkers = jobs;
+	scan.tail_segments = tail_segments;
+	scan.io = io;
+	scan.record_fn = note_record;
+	scan.skip_fn = skip_segment;
+	scan.segment_done_fn = finish_segment;
+	scan.arg = state;
+
+	state->workers = pg_malloc0(sizeof(DeriveMaxima) * jobs);
+	walscan_run(&scan);
+	pg_free(state->workers);
+	state->workers = NULL;
+
+	if (tail_segments > 0 && scan.nrecords == 0)
+		pg_log_warning("no WAL records found in the last %d segments up to %X/%X; the estimate rests on the sampled pages alone",
+					   tail_segments, LSN_FORMAT_ARGS(scan.end));
+
+	*end = scan.end;
+}
+
+
+/*
+ * Records past the end of the valid WAL count as well; a higher bound is
+ * only safer.
+ */
+static void
+note_record(WalScan *scan, int worker, XLogRecPtr lsn, const XLogRecord *record)
+{
+	DeriveState *state = (DeriveState *) scan->arg;
+	DeriveMaxima *m = &state->workers[worker];
+	const char *end = (const char *) record + record->xl_tot_len;
+	uint8		info = record->xl_info & ~XLR_INFO_MASK;
+
+	note_xid(m, record->xl_xid, state->oldest_xid);
+
+	if (record->xl_rmid != RM_XLOG_ID)
+		return;
+
+	/* The main data is the last part of a record */
+	if ((info == XLOG_CHECKPOINT_SHUTDOWN || info == XLOG_CHECKPOINT_ONLINE) &&
+		record->xl_tot_len >= SizeOfXLogRecord + sizeof(CheckPoint))
+	{
+		CheckPoint	checkpoint;
+
+		memcpy(&checkpoint, end - sizeof(CheckPoint), sizeof(CheckPoint));
+		note_xid(m, XidFromFullTransactionId(checkpoint.nextXid) - 1,
+				 state->oldest_xid);
+		note_multi(m, checkpoint.nextMulti - 1, state->oldest_multi);
+		if (OidIsValid(checkpoint.nextOid))
+			m->oid = Max(m->oid, checkpoint.nextOid - 1);
+	}
+	else if (info == XLOG_NEXTOID &&
+			 record->xl_tot_len >= SizeOfXLogRecord + sizeof(Oid))
+	{
+		Oid			next_oid;
+
+		memcpy(&next_oid, end - sizeof(Oid), sizeof(Oid));
+		if (OidIsValid(next_oid))
+			m->oid = Max(m->oid, next_oid - 1);
+	}
+}
+
+
+/*
+ * Take a segment from the index if neither it nor the next one has changed.
+ */
+static bool
+skip_segment(WalScan *scan, XLogSegNo segno, WalScanSegment *seg)
+{
+	DeriveState *state = (DeriveState *) scan->arg;
+	DeriveIndexEntry *entry;
+	struct stat st;
+
+	/* The walk of the first segment starts at redo, not its first record */
+	if (segno == scan->first_segno || state->nindex == 0)
+		return false;
+	if ((entry = find_segment(state, scan, segno, &st)) == NULL ||
+		find_segment(state, scan, segno + 1, &st) == NULL)
+		return false;
+
+	seg->first_start = entry->first_start;
+	seg->first_prev = entry->first_prev;
+	seg->last_start = entry->last_start;
+	seg->next = entry->next;
+	seg->nrecords = entry->nrecords;
+	seg->stop = WAL_READ_OK;
+
+	pthread_mutex_lock(&state->lock);
+	merge_maxima(&state->wal, &entry->maxima, state);
+	add_wal_entry(state, entry);
+	pthread_mutex_unlock(&state->lock);
+	return true;
+}
+
+
+/*
+ * Fold what the worker found in a segment into the WAL maxima, and keep it
+ * for the index if the walk got through the whole segment.
+ */
+static void
+finish_segment(WalScan *scan, int worker, XLogSegNo segno,
+			   const WalScanSegment *seg)
+{
+	DeriveState *state = (DeriveState *) scan->arg;
+	DeriveMaxima *m = &state->workers[worker];
+	DeriveIndexEntry entry;
+	char		fname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	struct stat st;
+	bool		keep;
+
+	XLogFileName(fname, scan->tli, segno, scan->segsize);
+	snprintf(path, sizeof(path), "%s/" XLOGDIR "/%s", state->datadir, fname);
+	keep = seg->stop == WAL_READ_OK && segno != scan->first_segno &&
+		stat(path, &st) == 0 && st.st_mtime < state->started;
+
+	pthread_mutex_lock(&state->lock);
+	merge_maxima(&state->wal, m, state);
+	if (keep)
+	{
+		memset(&entry, 0, sizeof(entry));
+		entry.path = path + strlen(state->datadir) + 1;
+		entry.is_wal = true;
+		entry.size = st.st_size;
+		entry.ino = st.st_ino;
+		entry.mtime = st.st_mtime;
+		entry.maxima = *m;
+		entry.first_start = seg->first_start;
+		entry.first_prev = seg->first_prev;
+		entry.last_start = seg->last_start;
+		entry.next = seg->next;
+		entry.nrecords = seg->nrecords;
+		add_wal_entry(state, &entry);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	memset(m, 0, sizeof(DeriveMaxima));
+}
+
+
+/*
+ * The index entry of a WAL segment in pg_wal whose identity is unchanged,
+ * or NULL.
+ */
+static DeriveIndexEntry *
+find_segment(DeriveState *state, WalScan *scan, XLogSegNo segno,
+			 struct stat *st)
+{
+	DeriveIndexEntry *entry;
+	char		fname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+
+	XLogFileName(fname, scan->tli, segno, scan->segsize);
+	snprintf(path, sizeof(path), "%s/" XLOGDIR "/%s", state->datadir, fname);
+	if (stat(path, st) != 0)
+		return NULL;
+	entry = find_entry(state, path + strlen(state->datadir) + 1,
+					   st->st_size, st->st_ino, st->st_mtime);
+	return entry != NULL && entry->is_wal ? entry : NULL;
+}
+
+
+/*
+ * Keep a WAL segment for the next index.  The caller holds state->lock.
+ */
+static void
+add_wal_entry(DeriveState *state, const DeriveIndexEntry *entry)
+{
+	DeriveIndexEntry *copy;
+
+	if (state->nwal_entries % 1024 == 0)
+		state->wal_entries = pg_realloc(state->wal_entries,
+										sizeof(DeriveIndexEntry) * (state->nwal_entries + 1024));
+	copy = &state->wal_entries[state->nwal_entries++];
+	*copy = *entry;
+	copy->path = pg_strdup(entry->path);
+}
+
+
+static bool
+note_page(RelScan *scan, int worker, const RelFile *file, BlockNumber blkno,
+		  char *page)
+{
+	DeriveState *state = (DeriveState *) scan->arg;
+	DeriveMaxima page_max;
+
+	if (PageIsNew(page))
+		return false;
+
+	if (state->samples == NULL)
+	{
+		note_page_maxima(state, &state->workers[worker], page);
+		return false;
+	}
+
+	/* A sample needs the maxima of every page */
+	memset(&page_max, 0, sizeof(page_max));
+	note_page_maxima(state, &page_max, page);
+	merge_maxima(&state->workers[worker], &page_max, state);
+	add_sample(&state->samples[worker], &page_max, state);
+	return false;
+}
+
+
+/*
+ * Every page counts for the LSN; heap pages, the ones without special
+ * space, for their tuple headers.
+ */
+static void
+note_page_maxima(const DeriveState *state, DeriveMaxima *m, char *page)
+{
+	PageHeader	header = (PageHeader) page;
+	OffsetNumber maxoff;
+	OffsetNumber off;
+
+	m->lsn = Max(m->lsn, PageGetLSN(page));
+
+	if (header->pd_special != BLCKSZ ||
+		header->pd_lower < SizeOfPageHeaderData ||
+		header->pd_lower > header->pd_upper ||
+		header->pd_upper > BLCKSZ)
+		return;
+	m->heap_pages++;
+
+	note_xid(m, header->pd_prune_xid, state->oldest_xid);
+
+	maxoff = PageGetMaxOffsetNumber(page);
+	for (off = FirstOffsetNumber; off <= maxoff; off++)
+	{
+		ItemId		itemid = PageGetItemId(page, off);
+		HeapTupleHeader tuple;
+
+		if (!ItemIdIsNormal(itemid) ||
+			ItemIdGetLength(itemid) < SizeofHeapTupleHeader ||
+			ItemIdGetOffset(itemid) + ItemIdGetLength(itemid) > BLCKSZ)
+			continue;
+		tuple = (HeapTupleHeader) PageGetItem(page, itemid);
+
+		if (!HeapTupleHeaderXminFrozen(tuple))
+			note_xid(m, HeapTupleHeaderGetRawXmin(tuple), state->oldest_xid);
+		if (tuple->t_infomask & HEAP_XMAX_IS_MULTI)
+			note_multi(m, HeapTupleHeaderGetRawXmax(tuple), state->oldest_multi);
+		else
+			note_xid(m, HeapTupleHeaderGetRawXmax(tuple), state->oldest_xid);
+	}
+}
+
+
+static bool
+skip_range(RelScan *scan, const RelFile *file, BlockNumber start,
+		   BlockNumber end)
+{
+	DeriveState *state = (DeriveState *) scan->arg;
+	DeriveRange key;
+	DeriveRange *found;
+
+	if (state->files[file - scan->files].indexed)
+		return true;
+	if (state->nresumed == 0)
+		return false;
+
+	key.path = (char *) relative_path(state, file->path);
+	key.start = start;
+	found = bsearch(&key, state->resumed, state->nresumed,
+					sizeof(DeriveRange), cmp_range);
+
+	/* A file that has changed size since is read again */
+	return found != NULL && found->end == end && found->nblocks == file->nblocks;
+}
+
+
+/*
+ * Fold the worker's maxima, which cover only finished ranges, into the
+ * running total and that of the file, and rewrite the state file if it is
+ * due.
+ */
+static void
+finish_range(RelScan *scan, int worker, const RelFile *file,
+			 BlockNumber start, BlockNumber end)
+{
+	DeriveState *state = (DeriveState *) scan->arg;
+	DeriveFile *dfile = &state->files[file - scan->files];
+	DeriveRange *range;
+	instr_time	now;
+
+	pthread_mutex_lock(&state->lock);
+	merge_maxima(&state->heap, &state->workers[worker], state);
+	merge_maxima(&dfile->maxima, &state->workers[worker], state);
+	dfile->blocks_done += end - start;
+	memset(&state->workers[worker], 0, sizeof(DeriveMaxima));
+
+	if (state->ndone % 1024 == 0)
+		state->done = pg_realloc(state->done,
+								 sizeof(DeriveRange) * (state->ndone + 1024));
+	range = &state->done[state->ndone++];
+	range->path = pg_strdup(relative_path(state, file->path));
+	range->nblocks = file->nblocks;
+	range->start = start;
+	range->end = end;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, state->last_flush);
+	if (INSTR_TIME_GET_DOUBLE(now) >= DERIVE_FLUSH_SECS)
+	{
+		write_state(state);
+		INSTR_TIME_SET_CURRENT(state->last_flush);
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+
+/*
+ * XIDs compare by their distance from oldest; one that seems to be older
+ * than that is counted, not taken.
+ */
+static void
+note_xid(DeriveMaxima *m, TransactionId xid, TransactionId oldest)
+{
+	if (!TransactionIdIsNormal(xid))
+		return;
+	if (xid - oldest >= (1U << 31))
+		m->before_oldest++;
+	else if (!TransactionIdIsValid(m->xid) || xid - oldest > m->xid - oldest)
+		m->xid = xid;
+}
+
+
+static void
+note_multi(DeriveMaxima *m, MultiXactId multi, MultiXactId oldest)
+{
+	if (!MultiXactIdIsValid(multi))
+		return;
+	if (multi - oldest >= (1U << 31))
+		m->before_oldest++;
+	else if (!MultiXactIdIsValid(m->multi) || multi - oldest > m->multi - oldest)
+		m->multi = multi;
+}
+
+
+static void
+merge_maxima(DeriveMaxima *into, const DeriveMaxima *from,
+			 const DeriveState *state)
+{
+	note_xid(into, from->xid, state->oldest_xid);
+	note_multi(into, from->multi, state->oldest_multi);
+	into->lsn = Max(into->lsn, from->lsn);
+	into->oid = Max(into->oid, from->oid);
+	into->heap_pages += from->heap_pages;
+	into->before_oldest += from->before_oldest;
+}
+
+
+static const char *
+relative_path(const DeriveState *state, const char *path)
+{
+	size_t		len = strlen(state->datadir);
+
+	if (strncmp(path, state->datadir, len) == 0 && path[len] == '/')
+		return path + len + 1;
+	return path;
+}
+
+
+/*
+ * The index entry of path if its identity is the same, or NULL.
+ */
+static DeriveIndexEntry *
+find_entry(const DeriveState *state, const char *path, uint64 size,
+		   uint64 ino, int64 mtime)
+{
+	DeriveIndexEntry key;
+	DeriveIndexEntry *entry;
+
+	if (state->nindex == 0)
+		return NULL;
+	key.path = (char *) path;
+	entry = bsearch(&key, state->index, state->nindex,
+					sizeof(DeriveIndexEntry), cmp_entry);
+	if (entry == NULL || entry->size != size || entry->ino != ino ||
+		entry->mtime != mtime)
+		return NULL;
+	return entry;
+}
+
+
+/*
+ * Read the state file of an interrupted scan of the same cluster.
+ */
+static void
+load_state(DeriveState *state)
+{
+	FILE	   *f;
+	char		line[MAXPGPATH + 64];
+	int			lineno = 0;
+
+	if ((f = fopen(state->state_file, "r")) == NULL)
+		pg_fatal("could not open file \"%s\": %m", state->state_file);
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		uint64		value;
+		uint32		hi;
+		uint32		lo;
+		int			pathpos;
+		DeriveRange range;
+
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (lineno == 1)
+		{
+			if (strcmp(line, DERIVE_STATE_HEADER) != 0)
+				pg_fatal("file \"%s\" is not a derive state file", state->state_file);
+		}
+		else if (sscanf(line, "system_identifier " UINT64_FORMAT, &value) == 1)
+		{
+			if (value != state->system_identifier)
+				pg_fatal("state file \"%s\" belongs to another cluster (system identifier " UINT64_FORMAT ")",
+						 state->state_file, value);
+		}
+		else if (sscanf(line, "xid " UINT64_FORMAT, &value) == 1)
+			state->heap.xid = (TransactionId) value;
+		else if (sscanf(line, "multi " UINT64_FORMAT, &value) == 1)
+			state->heap.multi = (MultiXactId) value;
+		else if (sscanf(line, "oid " UINT64_FORMAT, &value) == 1)
+			state->heap.oid = (Oid) value;
+		else if (sscanf(line, "lsn %X/%X", &hi, &lo) == 2)
+			state->heap.lsn = ((uint64) hi << 32) | lo;
+		else if (sscanf(line, "heap_pages " UINT64_FORMAT, &value) == 1)
+			state->heap.heap_pages = value;
+		else if (sscanf(line, "before_oldest " UINT64_FORMAT, &value) == 1)
+			state->heap.before_oldest = value;
+		else if (sscanf(line, "range %u %u %u %n", &range.nblocks, &range.start,
+						&range.end, &pathpos) == 3 && line[pathpos] != '\0')
+		{
+			if (state->nresumed % 1024 == 0)
+				state->resumed = pg_realloc(state->resumed,
+											sizeof(DeriveRange) * (state->nresumed + 1024));
+			range.path = pg_strdup(line + pathpos);
+			state->resumed[state->nresumed++] = range;
+		}
+		else
+			pg_fatal("invalid line %d in file \"%s\"", lineno, state->state_file);
+	}
+	if (ferror(f))
+		pg_fatal("could not read file \"%s\": %m", state->state_file);
+	if (lineno == 0)
+		pg_fatal("file \"%s\" is not a derive state file", state->state_file);
+	fclose(f);
+
+	qsort(state->resumed, state->nresumed, sizeof(DeriveRange), cmp_range);
+	pg_log_info("resuming with %d finished ranges from \"%s\"",
+				state->nresumed, state->state_file);
+}
+
+
+/*
+ * Replace the state file with the finished ranges and their maxima.  The
+ * caller holds state->lock.
+ */
+static void
+write_state(DeriveState *state)
+{
+	char		tmp[MAXPGPATH];
+	FILE	   *f = begin_rewrite(state->state_file, tmp, sizeof(tmp));
+	int			i;
+
+	fprintf(f, "%s\n", DERIVE_STATE_HEADER);
+	fprintf(f, "system_identifier " UINT64_FORMAT "\n", state->system_identifier);
+	fprintf(f, "xid %u\n", state->heap.xid);
+	fprintf(f, "multi %u\n", state->heap.multi);
+	fprintf(f, "oid %u\n", state->heap.oid);
+	fprintf(f, "lsn %X/%X\n", LSN_FORMAT_ARGS(state->heap.lsn));
+	fprintf(f, "heap_pages " UINT64_FORMAT "\n", state->heap.heap_pages);
+	fprintf(f, "before_oldest " UINT64_FORMAT "\n", state->heap.before_oldest);
+	for (i = 0; i < state->nresumed; i++)
+		fprintf(f, "range %u %u %u %s\n", state->resumed[i].nblocks,
+				state->resumed[i].start, state->resumed[i].end,
+				state->resumed[i].path);
+	for (i = 0; i < state->ndone; i++)
+		fprintf(f, "range %u %u %u %s\n", state->done[i].nblocks,
+				state->done[i].start, state->done[i].end, state->done[i].path);
+
+	end_rewrite(f, tmp, state->state_file);
+}
+
+
+/*
+ * Read the index of an earlier run.  It is only a cache: if it is missing,
+ * unreadable or of another cluster, every file is read.
+ *
+ * After a header and the system identifier, every line is a relation file
+ * ("rel") or WAL segment ("wal"): size, inode, mtime, the newest XID,
+ * multixact, page LSN and OID, heap pages and values older than the oldest,
+ * for WAL segments the first_start, first_prev, last_start, next and
+ * nrecords of the walk, and the path.
+ */
+static void
+load_index(DeriveState *state)
+{
+	FILE	   *f;
+	char		line[MAXPGPATH + 256];
+	int			lineno = 0;
+	bool		valid = true;
+
+	if ((f = fopen(state->index_file, "r")) == NULL)
+	{
+		if (errno != ENOENT)
+			pg_log_warning("could not open file \"%s\": %m", state->index_file);
+		return;
+	}
+
+	while (valid && fgets(line, sizeof(line), f) != NULL)
+	{
+		DeriveIndexEntry entry;
+		char		kind[4];
+		uint64		sysid;
+		int			pos = 0;
+		char	   *p;
+
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (lineno == 1)
+		{
+			valid = strcmp(line, DERIVE_INDEX_HEADER) == 0;
+			continue;
+		}
+		if (lineno == 2)
+		{
+			if (sscanf(line, "system_identifier " UINT64_FORMAT, &sysid) != 1)
+				valid = false;
+			else if (sysid != state->system_identifier)
+			{
+				pg_log_warning("index \"%s\" belongs to another cluster, ignoring it",
+							   state->index_file);
+				fclose(f);
+				return;
+			}
+			continue;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		if (sscanf(line, "%3s " UINT64_FORMAT " " UINT64_FORMAT " " INT64_FORMAT " %u %u " UINT64_FORMAT " %u " UINT64_FORMAT " " UINT64_FORMAT " %n",
+				   kind, &entry.size, &entry.ino, &entry.mtime,
+				   &entry.maxima.xid, &entry.maxima.multi, &entry.maxima.lsn,
+				   &entry.maxima.oid, &entry.maxima.heap_pages,
+				   &entry.maxima.before_oldest, &pos) != 10 || pos == 0)
+		{
+			valid = false;
+			break;
+		}
+		p = line + pos;
+
+		if (strcmp(kind, "wal") == 0)
+		{
+			pos = 0;
+			entry.is_wal = true;
+			if (sscanf(p, UINT64_FORMAT " " UINT64_FORMAT " " UINT64_FORMAT " " UINT64_FORMAT " " UINT64_FORMAT " %n",
+					   &entry.first_start, &entry.first_prev,
+					   &entry.last_start, &entry.next, &entry.nrecords,
+					   &pos) != 5 || pos == 0)
+			{
+				valid = false;
+				break;
+			}
+			p += pos;
+		}
+		else if (strcmp(kind, "rel") != 0)
+			valid = false;
+		if (*p == '\0')
+			valid = false;
+		if (!valid)
+			break;
+
+		if (state->nindex % 1024 == 0)
+			state->index = pg_realloc(state->index,
+									  sizeof(DeriveIndexEntry) * (state->nindex + 1024));
+		entry.path = pg_strdup(p);
+		state->index[state->nindex++] = entry;
+	}
+	if (ferror(f))
+		valid = false;
+	fclose(f);
+
+	if (!valid)
+	{
+		pg_log_warning("invalid line %d in index \"%s\", ignoring it",
+					   lineno, state->index_file);
+		state->nindex = 0;
+		return;
+	}
+
+	qsort(state->index, state->nindex, sizeof(DeriveIndexEntry), cmp_entry);
+	pg_log_info("read %d files from index \"%s\"", state->nindex,
+				state->index_file);
+}
+
+
+static void
+write_index_entry(FILE *f, const DeriveIndexEntry *entry)
+{
+	fprintf(f, "%s " UINT64_FORMAT " " UINT64_FORMAT " " INT64_FORMAT " %u %u " UINT64_FORMAT " %u " UINT64_FORMAT " " UINT64_FORMAT " ",
+			entry->is_wal ? "wal" : "rel", entry->size, entry->ino,
+			entry->mtime, entry->maxima.xid, entry->maxima.multi,
+			entry->maxima.lsn, entry->maxima.oid, entry->maxima.heap_pages,
+			entry->maxima.before_oldest);
+	if (entry->is_wal)
+		fprintf(f, UINT64_FORMAT " " UINT64_FORMAT " " UINT64_FORMAT " " UINT64_FORMAT " " UINT64_FORMAT " ",
+				entry->first_start, entry->first_prev, entry->last_start,
+				entry->next, entry->nrecords);
+	fprintf(f, "%s\n", entry->path);
+}
+
+
+/*
+ * Replace the index with the files of a completed run: those taken from
+ * the old index, and those read in full that have not been modified since
+ * the run started.
+ */
+static void
+write_index(DeriveState *state, const RelScan *scan)
+{
+	char		tmp[MAXPGPATH];
+	FILE	   *f = begin_rewrite(state->index_file, tmp, sizeof(tmp));
+	int			nwritten = 0;
+	int			i;
+
+	fprintf(f, "%s\n", DERIVE_INDEX_HEADER);
+	fprintf(f, "system_identifier " UINT64_FORMAT "\n", state->system_identifier);
+
+	for (i = 0; i < scan->nfiles; i++)
+	{
+		const RelFile *file = &scan->files[i];
+		const DeriveFile *dfile = &state->files[i];
+		DeriveIndexEntry entry;
+
+		if (!dfile->indexed &&
+			(dfile->blocks_done < file->nblocks || file->mtime >= state->started))
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.path = (char *) relative_path(state, file->path);
+		entry.size = file->size;
+		entry.ino = file->ino;
+		entry.mtime = file->mtime;
+		entry.maxima = dfile->maxima;
+		write_index_entry(f, &entry);
+		nwritten++;
+	}
+	for (i = 0; i < state->nwal_entries; i++)
+		write_index_entry(f, &state->wal_entries[i]);
+
+	end_rewrite(f, tmp, state->index_file);
+	pg_log_info("wrote %d relation files and %d WAL segments to index \"%s\"",
+				nwritten, state->nwal_entries, state->index_file);
+}
+
+
+/*
+ * Files are replaced by writing a temporary file next to them, syncing it
+ * and renaming it over the old one.
+ */
+static FILE *
+begin_rewrite(const char *path, char *tmp, size_t len)
+{
+	FILE	   *f;
+
+	snprintf(tmp, len, "%s.tmp", path);
+	if ((f = fopen(tmp, "w")) == NULL)
+		pg_fatal("could not open file \"%s\": %m", tmp);
+	return f;
+}
+
+
+static void
+end_rewrite(FILE *f, const char *tmp, const char *path)
+{
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		pg_fatal("could not write file \"%s\": %m", tmp);
+	if (fclose(f) != 0)
+		pg_fatal("could not close file \"%s\": %m", tmp);
+	if (rename(tmp, path) != 0)
+		pg_fatal("could not rename file \"%s\" to \"%s\": %m", tmp, path);
+}
+
+
+static int
+cmp_range(const void *a, const void *b)
+{
+	const DeriveRange *ra = (const DeriveRange *) a;
+	const DeriveRange *rb = (const DeriveRange *) b;
+	int			c = strcmp(ra->path, rb->path);
+
+	if (c != 0)
+		return c;
+	return ra->start < rb->start ? -1 : ra->start > rb->start ? 1 : 0;
+}
+
+
+static int
+cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const DeriveIndexEntry *) a)->path,
+				  ((const DeriveIndexEntry *) b)->path);
+}
+
+
+/*
+ * Stop the workers; run_derive() writes the state file once they have
+ * returned.
+ */
+static void
+handle_interrupt(SIGNAL_ARGS)
+{
+	if (interrupted_scan != NULL)
+		interrupted_scan->cancel = true;
+}
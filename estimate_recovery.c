@@ -0,0 +1,635 @@
+/*
+ * estimate_recovery.c
+ *	  Predict how long crash recovery will take (--estimate-recovery).
+ *
+ * The WAL from checkPointCopy.redo to its end is scanned in parallel like
+ * --verify-wal does, and every record is counted by resource manager along
+ * with its full-page images and the distinct blocks it touches.  Replay is
+ * single-threaded, so its time is modelled as a sum:
+ *
+ *	  WAL bytes * wal_byte_ns		reading the WAL
+ *	  records * record_ns			decoding and redoing each record
+ *	  FPI bytes * fpi_byte_ns		restoring full-page images
+ *	  distinct blocks * block_read_ns	reading each block once, cold
+ *
+ * --estimate-recovery=calibrate measures the I/O and copy coefficients on
+ * this host, against the data directory's own WAL and relation files, and
+ * writes them to --recovery-model for later estimates.  record_ns, the cost
+ * of the redo routines themselves, cannot be measured without a server; it
+ * keeps its default unless edited in the model file, e.g. after fitting it
+ * to an observed recovery.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access/rmgr.h"
+#include "access/xlog_internal.h"
+#include "common/hashfn.h"
+#include "common/logging.h"
+#include "common/pg_prng.h"
+#include "portability/instr_time.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+#include "relscan.h"
+#include "walscan.h"
+
+/* Replay cost coefficients, in nanoseconds */
+typedef struct RecoveryModel
+{
+	double		wal_byte_ns;
+	double		record_ns;
+	double		fpi_byte_ns;
+	double		block_read_ns;
+} RecoveryModel;
+
+/* Used when no model file is given: fast local SSD, nothing cached */
+static const RecoveryModel default_model = {
+	.wal_byte_ns = 1.0,
+	.record_ns = 2000.0,
+	.fpi_byte_ns = 0.2,
+	.block_read_ns = 100000.0,
+};
+
+/* How many samples calibration takes */
+#define CALIBRATE_WAL_SEGMENTS	16
+#define CALIBRATE_BLOCK_READS	2000
+#define CALIBRATE_PAGE_COPIES	100000
+
+static const char *const rmgr_names[RM_MAX_BUILTIN_ID + 1] = {
+#define PG_RMGR(symname,name,redo,desc,identify,startup,cleanup,mask,decode) name,
+#include "access/rmgrlist.h"
+#undef PG_RMGR
+};
+
+typedef struct BlockEntry
+{
+	WalBlockTag tag;
+	XLogRecPtr	first_lsn;		/* earliest record touching the block */
+	char		status;
+} BlockEntry;
+
+#define SH_PREFIX			blockset
+#define SH_ELEMENT_TYPE		BlockEntry
+#define SH_KEY_TYPE			WalBlockTag
+#define SH_KEY				tag
+#define SH_HASH_KEY(tb, key) \
+	hash_bytes((const unsigned char *) &(key), sizeof(WalBlockTag))
+#define SH_EQUAL(tb, a, b)	(memcmp(&(a), &(b), sizeof(WalBlockTag)) == 0)
+#define SH_SCOPE			static inline
+#define SH_RAW_ALLOCATOR	pg_malloc0
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/* The records of one resource manager in one segment */
+typedef struct RmgrCounts
+{
+	int			rmid;
+	uint64		records;
+	uint64		record_bytes;
+	uint64		fpi_bytes;
+} RmgrCounts;
+
+/*
+ * The records of one segment, kept until the scan has found where the WAL
+ * ends, as segments past a break in the chain are walked too.
+ */
+typedef struct SegmentCounts
+{
+	XLogSegNo	segno;
+	uint64		fpis;
+	uint64		malformed;
+	int			nrmgrs;
+	RmgrCounts	rmgrs[FLEXIBLE_ARRAY_MEMBER];
+} SegmentCounts;
+
+/*
+ * What one worker saw: the segment it is walking in the arrays, the ones
+ * it has walked in segments.  Merged when the scan is done.
+ */
+typedef struct RecoveryCounts
+{
+	uint64		records[RM_MAX_ID + 1];
+	uint64		record_bytes[RM_MAX_ID + 1];
+	uint64		fpi_bytes[RM_MAX_ID + 1];
+	uint64		fpis;
+	uint64		malformed;
+	SegmentCounts **segments;
+	int			nsegments;
+	int			maxsegments;
+	blockset_hash *blocks;
+} RecoveryCounts;
+
+static bool read_model(const char *path, RecoveryModel *model);
+static void write_model(const char *path, const RecoveryModel *model);
+static void count_record(WalScan *scan, int worker, XLogRecPtr lsn,
+						 const XLogRecord *record);
+static void count_segment(WalScan *scan, int worker, XLogSegNo segno,
+						  const WalScanSegment *seg);
+static int	calibrate(const char *datadir, const char *model_path);
+static bool calibrate_wal(const char *datadir, double *wal_byte_ns);
+static bool calibrate_block_reads(const char *datadir, double *block_read_ns);
+static double calibrate_page_copy(void);
+
+
+/*
+ * With calibrate, measure the model coefficients and write them to
+ * model_path (stdout if NULL).  Otherwise estimate the recovery time of
+ * datadir with the model read from model_path, or the default one.
+ */
+int
+run_estimate_recovery(const PgControl *ctl, const char *datadir,
+					  const char *archive, int jobs, ScanIO *io,
+					  bool calibrate_only, const char *model_path)
+{
+	WalScan		scan;
+	RecoveryModel model = default_model;
+	RecoveryCounts *counts;
+	RecoveryCounts *total;
+	blockset_iterator iter;
+	BlockEntry *entry;
+	uint64		wal_bytes;
+	uint64		fpi_bytes = 0;
+	uint64		nblocks = 0;
+	double		wal_s,
+				record_s,
+				fpi_s,
+				block_s;
+	int			i;
+	int			j;
+	int			k;
+	int			rmid;
+
+	if (calibrate_only)
+		return calibrate(datadir, model_path);
+
+	if (model_path != NULL && !read_model(model_path, &model))
+		exit(1);
+
+	counts = pg_malloc0(sizeof(RecoveryCounts) * jobs);
+	for (i = 0; i < jobs; i++)
+		counts[i].blocks = blockset_create(1024, NULL);
+
+	memset(&scan, 0, sizeof(scan));
+	scan.pgdata = datadir;
+	scan.archive = archive;
+	scan.segsize = ctl->wal_segsize;
+	scan.tli = pgcontrol_get_value(ctl, "checkPointCopy.ThisTimeLineID");
+	scan.start = pgcontrol_get_value(ctl, "checkPointCopy.redo");
+	scan.nworkers = jobs;
+	scan.io = io;
+	scan.record_fn = count_record;
+	scan.segment_done_fn = count_segment;
+	scan.arg = counts;
+	walscan_run(&scan);
+
+	/*
+	 * Fold everything into the first worker's counts, whose arrays are all
+	 * zero again after its last segment.  Only what lies before the end of
+	 * the WAL would be replayed.
+	 */
+	total = &counts[0];
+	for (i = 0; i < jobs; i++)
+	{
+		for (j = 0; j < counts[i].nsegments; j++)
+		{
+			SegmentCounts *segcounts = counts[i].segments[j];
+
+			if (scan.segments[segcounts->segno - scan.first_segno].in_wal)
+			{
+				for (k = 0; k < segcounts->nrmgrs; k++)
+				{
+					RmgrCounts *rmgr = &segcounts->rmgrs[k];
+
+					total->records[rmgr->rmid] += rmgr->records;
+					total->record_bytes[rmgr->rmid] += rmgr->record_bytes;
+					total->fpi_bytes[rmgr->rmid] += rmgr->fpi_bytes;
+				}
+				total->fpis += segcounts->fpis;
+				total->malformed += segcounts->malformed;
+			}
+			pg_free(segcounts);
+		}
+		if (counts[i].segments != NULL)
+			pg_free(counts[i].segments);
+
+		if (i == 0)
+			continue;
+		blockset_start_iterate(counts[i].blocks, &iter);
+		while ((entry = blockset_iterate(counts[i].blocks, &iter)) != NULL)
+		{
+			BlockEntry *merged;
+			bool		found;
+
+			merged = blockset_insert(total->blocks, entry->tag, &found);
+			if (!found || entry->first_lsn < merged->first_lsn)
+				merged->first_lsn = entry->first_lsn;
+		}
+		blockset_destroy(counts[i].blocks);
+	}
+	blockset_start_iterate(total->blocks, &iter);
+	while ((entry = blockset_iterate(total->blocks, &iter)) != NULL)
+	{
+		if (entry->first_lsn < scan.end)
+			nblocks++;
+	}
+	wal_bytes = scan.end - scan.start;
+
+	printf("%-20s %12s %14s %14s\n", "rmgr", "records", "bytes", "fpi bytes");
+	for (rmid = 0; rmid <= RM_MAX_ID; rmid++)
+	{
+		char		custom[32];
+		const char *name;
+
+		if (total->records[rmid] == 0)
+			continue;
+		if (rmid <= RM_MAX_BUILTIN_ID)
+			name = rmgr_names[rmid];
+		else
+		{
+			snprintf(custom, sizeof(custom), "custom%d", rmid);
+			name = custom;
+		}
+		printf("%-20s %12" INT64_MODIFIER "u %14" INT64_MODIFIER "u %14" INT64_MODIFIER "u\n",
+			   name, total->records[rmid], total->record_bytes[rmid],
+			   total->fpi_bytes[rmid]);
+		fpi_bytes += total->fpi_bytes[rmid];
+	}
+	if (total->malformed > 0)
+		pg_log_warning(UINT64_FORMAT " records have malformed block references and were counted without them",
+					   total->malformed);
+
+	wal_s = wal_bytes * model.wal_byte_ns / 1e9;
+	record_s = scan.nrecords * model.record_ns / 1e9;
+	fpi_s = fpi_bytes * model.fpi_byte_ns / 1e9;
+	block_s = nblocks * model.block_read_ns / 1e9;
+
+	printf("\n");
+	printf("redo                %X/%X\n", LSN_FORMAT_ARGS(scan.start));
+	printf("end of WAL          %X/%X\n", LSN_FORMAT_ARGS(scan.end));
+	printf("WAL                 " UINT64_FORMAT " bytes, %.1f s\n", wal_bytes, wal_s);
+	printf("records             " UINT64_FORMAT ", %.1f s\n", scan.nrecords, record_s);
+	printf("full-page images    " UINT64_FORMAT ", " UINT64_FORMAT " bytes, %.1f s\n",
+		   total->fpis, fpi_bytes, fpi_s);
+	printf("distinct blocks     " UINT64_FORMAT ", %.1f s\n", nblocks, block_s);
+	printf("estimated recovery  %.1f s\n", wal_s + record_s + fpi_s + block_s);
+
+	blockset_destroy(total->blocks);
+	pg_free(counts);
+	pg_free(scan.segments);
+	return 0;
+}
+
+
+static void
+count_record(WalScan *scan, int worker, XLogRecPtr lsn, const XLogRecord *record)
+{
+	RecoveryCounts *counts = &((RecoveryCounts *) scan->arg)[worker];
+	WalBlockRef blocks[XLR_MAX_BLOCK_ID + 1];
+	BlockEntry *entry;
+	int			nblocks;
+	int			i;
+
+	counts->records[record->xl_rmid]++;
+	counts->record_bytes[record->xl_rmid] += record->xl_tot_len;
+
+	nblocks = walreader_decode_blocks(record, blocks);
+	if (nblocks < 0)
+	{
+		counts->malformed++;
+		return;
+	}
+	for (i = 0; i < nblocks; i++)
+	{
+		WalBlockTag tag;
+		bool		found;
+
+		if (blocks[i].has_image)
+		{
+			counts->fpis++;
+			counts->fpi_bytes[record->xl_rmid] += blocks[i].image_len;
+		}
+
+		memset(&tag, 0, sizeof(tag));
+		tag.rlocator = blocks[i].rlocator;
+		tag.forknum = blocks[i].forknum;
+		tag.blkno = blocks[i].blkno;
+		entry = blockset_insert(counts->blocks, tag, &found);
+		if (!found || lsn < entry->first_lsn)
+			entry->first_lsn = lsn;
+	}
+}
+
+
+/*
+ * Move the counts of the segment a worker has walked out of its arrays,
+ * keeping only the resource managers seen.
+ */
+static void
+count_segment(WalScan *scan, int worker, XLogSegNo segno,
+			  const WalScanSegment *seg)
+{
+	RecoveryCounts *counts = &((RecoveryCounts *) scan->arg)[worker];
+	SegmentCounts *segcounts;
+	int			nrmgrs = 0;
+	int			rmid;
+
+	for (rmid = 0; rmid <= RM_MAX_ID; rmid++)
+	{
+		if (counts->records[rmid] > 0)
+			nrmgrs++;
+	}
+
+	segcounts = pg_malloc(offsetof(SegmentCounts, rmgrs) +
+						  sizeof(RmgrCounts) * nrmgrs);
+	segcounts->segno = segno;
+	segcounts->fpis = counts->fpis;
+	segcounts->malformed = counts->malformed;
+	segcounts->nrmgrs = 0;
+	for (rmid = 0; rmid <= RM_MAX_ID; rmid++)
+	{
+		RmgrCounts *rmgr;
+
+		if (counts->records[rmid] == 0)
+			continue;
+		rmgr = &segcounts->rmgrs[segcounts->nrmgrs++];
+		rmgr->rmid = rmid;
+		rmgr->records = counts->records[rmid];
+		rmgr->record_bytes = counts->record_bytes[rmid];
+		rmgr->fpi_bytes = counts->fpi_bytes[rmid];
+	}
+
+	memset(counts->records, 0, sizeof(counts->records));
+	memset(counts->record_bytes, 0, sizeof(counts->record_bytes));
+	memset(counts->fpi_bytes, 0, sizeof(counts->fpi_bytes));
+	counts->fpis = 0;
+	counts->malformed = 0;
+
+	if (counts->nsegments == counts->maxsegments)
+	{
+		counts->maxsegments = Max(counts->maxsegments * 2, 16);
+		counts->segments = pg_realloc(counts->segments,
+									  sizeof(SegmentCounts *) * counts->maxsegments);
+	}
+	counts->segments[counts->nsegments++] = segcounts;
+}
+
+
+/*
+ * Read a model file of "name = value" lines.  Names not given keep their
+ * default.
+ */
+static bool
+read_model(const char *path, RecoveryModel *model)
+{
+	FILE	   *f;
+	char		line[256];
+	int			lineno = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+	{
+		pg_log_error("could not open file \"%s\": %m", path);
+		return false;
+	}
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char		name[64];
+		double		value;
+		char	   *p = line;
+
+		lineno++;
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		if (sscanf(p, "%63[a-z_] = %lf", name, &value) != 2 || value < 0)
+		{
+			pg_log_error("invalid line %d in file \"%s\"", lineno, path);
+			fclose(f);
+			return false;
+		}
+		if (strcmp(name, "wal_byte_ns") == 0)
+			model->wal_byte_ns = value;
+		else if (strcmp(name, "record_ns") == 0)
+			model->record_ns = value;
+		else if (strcmp(name, "fpi_byte_ns") == 0)
+			model->fpi_byte_ns = value;
+		else if (strcmp(name, "block_read_ns") == 0)
+			model->block_read_ns = value;
+		else
+		{
+			pg_log_error("unrecognized parameter \"%s\" in file \"%s\"", name, path);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+
+static void
+write_model(const char *path, const RecoveryModel *model)
+{
+	FILE	   *f = stdout;
+
+	if (path != NULL && (f = fopen(path, "w")) == NULL)
+		pg_fatal("could not open file \"%s\" for writing: %m", path);
+
+	fprintf(f, "# recovery model, from pg_control_editor --estimate-recovery=calibrate\n");
+	fprintf(f, "wal_byte_ns = %.4f\n", model->wal_byte_ns);
+	fprintf(f, "record_ns = %.1f\n", model->record_ns);
+	fprintf(f, "fpi_byte_ns = %.4f\n", model->fpi_byte_ns);
+	fprintf(f, "block_read_ns = %.1f\n", model->block_read_ns);
+
+	if (path != NULL && fclose(f) != 0)
+		pg_fatal("could not write file \"%s\": %m", path);
+}
+
+
+static int
+calibrate(const char *datadir, const char *model_path)
+{
+	RecoveryModel model = default_model;
+
+	/* Keep record_ns from an existing model, it is not measured here */
+	if (model_path != NULL && access(model_path, F_OK) == 0 &&
+		!read_model(model_path, &model))
+		exit(1);
+
+	if (!calibrate_wal(datadir, &model.wal_byte_ns))
+		pg_log_warning("no WAL segments to read, keeping wal_byte_ns at %.4f",
+					   model.wal_byte_ns);
+	if (!calibrate_block_reads(datadir, &model.block_read_ns))
+		pg_log_warning("no relation blocks to read, keeping block_read_ns at %.1f",
+					   model.block_read_ns);
+	model.fpi_byte_ns = calibrate_page_copy();
+
+	write_model(model_path, &model);
+	return 0;
+}
+
+
+/*
+ * Read up to CALIBRATE_WAL_SEGMENTS segments of pg_wal sequentially, as
+ * the startup process does, after asking the kernel to drop them from the
+ * page cache.
+ */
+static bool
+calibrate_wal(const char *datadir, double *wal_byte_ns)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+	char	   *buf = pg_malloc(1024 * 1024);
+	uint64		bytes = 0;
+	int			nsegments = 0;
+	instr_time	start;
+	instr_time	end;
+	instr_time	duration;
+
+	snprintf(path, sizeof(path), "%s/%s", datadir, XLOGDIR);
+	if ((dir = opendir(path)) == NULL)
+		pg_fatal("could not open directory \"%s\": %m", path);
+
+	INSTR_TIME_SET_ZERO(duration);
+	while (nsegments < CALIBRATE_WAL_SEGMENTS && (de = readdir(dir)) != NULL)
+	{
+		char		segpath[MAXPGPATH];
+		int			fd;
+		ssize_t		rc;
+
+		if (!IsXLogFileName(de->d_name))
+			continue;
+		snprintf(segpath, sizeof(segpath), "%s/%s", path, de->d_name);
+		if ((fd = open(segpath, O_RDONLY | PG_BINARY, 0)) < 0)
+			pg_fatal("could not open file \"%s\": %m", segpath);
+		(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+		INSTR_TIME_SET_CURRENT(start);
+		while ((rc = read(fd, buf, 1024 * 1024)) > 0)
+			bytes += rc;
+		if (rc < 0)
+			pg_fatal("could not read file \"%s\": %m", segpath);
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(duration, end, start);
+		close(fd);
+		nsegments++;
+	}
+	closedir(dir);
+	pg_free(buf);
+
+	if (bytes == 0)
+		return false;
+	*wal_byte_ns = INSTR_TIME_GET_DOUBLE(duration) * 1e9 / bytes;
+	return true;
+}
+
+
+/*
+ * Time single-block reads at random places in the relation files, each
+ * dropped from the page cache first, like the misses of replay.
+ */
+static bool
+calibrate_block_reads(const char *datadir, double *block_read_ns)
+{
+	RelScan		scan;
+	PGAlignedBlock page;
+	pg_prng_state prng;
+	instr_time	duration;
+	int			nreads = 0;
+	int			nonempty = 0;
+	int			i;
+
+	memset(&scan, 0, sizeof(scan));
+	if (!relscan_collect(&scan, datadir, true))
+		pg_fatal("%s", scan.errmsg);
+	for (i = 0; i < scan.nfiles; i++)
+		if (scan.files[i].nblocks > 0)
+			nonempty++;
+	if (nonempty == 0)
+	{
+		relscan_free(&scan);
+		return false;
+	}
+
+	pg_prng_seed(&prng, (uint64) time(NULL));
+	INSTR_TIME_SET_ZERO(duration);
+	while (nreads < CALIBRATE_BLOCK_READS)
+	{
+		const RelFile *file = &scan.files[pg_prng_uint64_range(&prng, 0, scan.nfiles - 1)];
+		off_t		offset;
+		instr_time	start;
+		instr_time	end;
+		int			fd;
+
+		if (file->nblocks == 0)
+			continue;
+		offset = (off_t) pg_prng_uint64_range(&prng, 0, file->nblocks - 1) * BLCKSZ;
+
+		if ((fd = open(file->path, O_RDONLY | PG_BINARY, 0)) < 0)
+			pg_fatal("could not open file \"%s\": %m", file->path);
+		(void) posix_fadvise(fd, offset, BLCKSZ, POSIX_FADV_DONTNEED);
+
+		INSTR_TIME_SET_CURRENT(start);
+		if (pg_pread(fd, page.data, BLCKSZ, offset) != BLCKSZ)
+			pg_fatal("could not read file \"%s\": %m", file->path);
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(duration, end, start);
+
+		close(fd);
+		nreads++;
+	}
+	relscan_free(&scan);
+
+	*block_read_ns = INSTR_TIME_GET_DOUBLE(duration) * 1e9 / nreads;
+	return true;
+}
+
+
+/*
+ * Restoring a full-page image is mostly a copy into a buffer that is not
+ * in the CPU cache; copy from and to a region much larger than it.
+ */
+static double
+calibrate_page_copy(void)
+{
+	size_t		region = (size_t) 64 * 1024 * 1024;
+	int			pages = region / BLCKSZ;
+	char	   *src = pg_malloc(region);
+	char	   *dst = pg_malloc(region);
+	instr_time	start;
+	instr_time	duration;
+	int			i;
+
+	memset(src, 0x5a, region);
+	memset(dst, 0, region);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < CALIBRATE_PAGE_COPIES; i++)
+		memcpy(dst + (size_t) ((i * 7919) % pages) * BLCKSZ,
+			   src + (size_t) (i % pages) * BLCKSZ, BLCKSZ);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	/* Keep the copies from being optimized away */
+	if (dst[0] == 1)
+		pg_log_info("unexpected page contents");
+
+	pg_free(src);
+	pg_free(dst);
+	return INSTR_TIME_GET_DOUBLE(duration) * 1e9 /
+		((double) CALIBRATE_PAGE_COPIES * BLCKSZ);
+}
@@ -0,0 +1,170 @@
+#!/bin/sh
+#
+# fleet_bench.sh
+#	  Scaling sweep of pg_control_editor, run by "make fleet-bench".
+#
+# For every storage location, measures
+#
+#   single     the read/modify/write cycle of pg_control_bench with
+#              BENCH_JOBS concurrent workers, without and with fsync
+#   inventory  --inventory over synthetic fleets of BENCH_CLUSTERS data
+#              directories, split into BENCH_QUEUE_DEPTHS shards read
+#              concurrently
+#
+# and appends one CSV row per run to $BENCH_OUTPUT_DIR/results.csv.  If
+# gnuplot is installed, throughput and p99 latency curves are drawn next
+# to it.  Every edit and read is synchronous, so for the single path the
+# number of jobs is also the I/O queue depth.
+#
+# BENCH_STORAGE is a list of LABEL=DIRECTORY pairs; mount the file systems
+# to compare (tmpfs, ext4, XFS, overlayfs, ...) and point one entry at each.
+# Each run works in a fresh bench.XXXXXX directory made below the given
+# one and removes only that, so nothing already there is touched.
+#
+# Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+
+set -e
+
+BENCH_STORAGE=${BENCH_STORAGE:-"tmpfs=/dev/shm/pg_control_fleet disk=$PWD/bench_data/fleet"}
+BENCH_JOBS=${BENCH_JOBS:-"1 2 4 8 16 32"}
+BENCH_CLUSTERS=${BENCH_CLUSTERS:-"1 100 1000 10000 100000"}
+BENCH_QUEUE_DEPTHS=${BENCH_QUEUE_DEPTHS:-"1 4 16"}
+BENCH_ITERATIONS=${BENCH_ITERATIONS:-2000}
+BENCH_OUTPUT_DIR=${BENCH_OUTPUT_DIR:-$PWD/bench_output}
+
+bindir=$(dirname "$0")
+csv=$BENCH_OUTPUT_DIR/results.csv
+
+mkdir -p "$BENCH_OUTPUT_DIR"
+echo "path,storage,sync,clusters,jobs,ops_per_sec,p50_us,p99_us" > "$csv"
+
+# json_value JSON KEY: print a numeric member of a one-line JSON object
+json_value()
+{
+	echo "$1" | sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p" | head -n 1
+}
+
+now()
+{
+	date +%s.%N
+}
+
+for storage in $BENCH_STORAGE
+do
+	label=${storage%%=*}
+	mkdir -p "${storage#*=}"
+	dir=$(mktemp -d "${storage#*=}/bench.XXXXXX")
+
+	# Single-file path
+	for sync in off on
+	do
+		for jobs in $BENCH_JOBS
+		do
+			syncflag=
+			[ "$sync" = on ] && syncflag=-s
+			result=$("$bindir/pg_control_bench" -t "$dir/single" -n "$BENCH_ITERATIONS" \
+				-j "$jobs" -L "$label" $syncflag)
+			echo "single,$label,$sync,$jobs,$jobs,$(json_value "$result" ops_per_sec),$(json_value "$result" p50_us),$(json_value "$result" p99_us)" >> "$csv"
+			rm -rf "$dir/single"
+		done
+	done
+
+	# Many-file path: grow one fleet, copying a single template pg_control
+	"$bindir/pg_control_bench" -t "$dir/template" -n 1 > /dev/null
+	built=0
+	for clusters in $BENCH_CLUSTERS
+	do
+		while [ $built -lt "$clusters" ]
+		do
+			mkdir -p "$dir/fleet/$built/global"
+			cp "$dir/template/global/pg_control" "$dir/fleet/$built/global/"
+			built=$((built + 1))
+		done
+
+		for qd in $BENCH_QUEUE_DEPTHS
+		do
+			rm -f "$dir"/shard.* "$dir"/stats.*
+			i=0
+			while [ $i -lt "$clusters" ]
+			do
+				echo "$dir/fleet/$i" >> "$dir/shard.$((i % qd))"
+				i=$((i + 1))
+			done
+
+			start=$(now)
+			for shard in "$dir"/shard.*
+			do
+				"$bindir/pg_control_editor" --inventory --stats=json < "$shard" \
+					> /dev/null 2> "$dir/stats.${shard##*.}" &
+			done
+			wait
+			end=$(now)
+
+			# The slowest shard's quantiles stand for the run
+			p50=0
+			p99=0
+			for stats in "$dir"/stats.*
+			do
+				line=$(tail -n 1 "$stats")
+				p50=$(echo "$p50 $(json_value "$line" p50_ns)" | awk '{ print ($2 / 1000 > $1) ? $2 / 1000 : $1 }')
+				p99=$(echo "$p99 $(json_value "$line" p99_ns)" | awk '{ print ($2 / 1000 > $1) ? $2 / 1000 : $1 }')
+			done
+			ops=$(echo "$clusters $start $end" | awk '{ printf "%.1f", $1 / ($3 - $2) }')
+			echo "inventory,$label,n/a,$clusters,$qd,$ops,$p50,$p99" >> "$csv"
+		done
+	done
+
+	rm -rf "$dir"
+done
+
+echo "results written to $csv"
+
+if ! command -v gnuplot > /dev/null
+then
+	echo "gnuplot not found, skipping plots"
+	exit 0
+fi
+
+storages=
+for storage in $BENCH_STORAGE
+do
+	storages="$storages ${storage%%=*}"
+done
+qd1=$(echo "$BENCH_QUEUE_DEPTHS" | awk '{ print $1 }')
+
+gnuplot <<EOF
+set datafile separator ","
+set terminal pngcairo size 1000,600
+set key outside
+set grid
+
+set output "$BENCH_OUTPUT_DIR/single_throughput.png"
+set title "pg_control edits: throughput by concurrent jobs"
+set xlabel "jobs"
+set ylabel "edits/s"
+set logscale x 2
+plot for [s in "$storages"] for [y in "off on"] \
+	"< grep '^single,'.s.','.y.',' $csv" using 5:6 with linespoints title s." sync=".y
+
+set output "$BENCH_OUTPUT_DIR/single_p99.png"
+set title "pg_control edits: p99 latency by concurrent jobs"
+set ylabel "p99 (us)"
+plot for [s in "$storages"] for [y in "off on"] \
+	"< grep '^single,'.s.','.y.',' $csv" using 5:8 with linespoints title s." sync=".y
+
+set output "$BENCH_OUTPUT_DIR/inventory_throughput.png"
+set title "--inventory: throughput by fleet size (queue depth $qd1)"
+set xlabel "clusters"
+set ylabel "clusters/s"
+set logscale x 10
+plot for [s in "$storages"] \
+	"< grep '^inventory,'.s.',' $csv | awk -F, '\$5 == $qd1'" using 4:6 with linespoints title s
+
+set output "$BENCH_OUTPUT_DIR/inventory_p99.png"
+set title "--inventory: p99 read latency by fleet size (queue depth $qd1)"
+set ylabel "p99 (us)"
+plot for [s in "$storages"] \
+	"< grep '^inventory,'.s.',' $csv | awk -F, '\$5 == $qd1'" using 4:8 with linespoints title s
+EOF
+
+echo "plots written to $BENCH_OUTPUT_DIR"
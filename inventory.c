@@ -0,0 +1,331 @@
+/*
+ * inventory.c
+ *	  Read pg_control of many data directories and print every field as
+ *	  CSV or newline-delimited JSON (--inventory).
+ *
+ * Each pg_control is a single 8kB read, so files are read one after the
+ * other; on a warm cache that is dominated by open() and well under a
+ * second for ten thousand clusters.  Control files of every layout known
+ * to pgcontrol_layout.c can be mixed in one run.  With --stats=json the
+ * latency of each read is folded into a histogram that is printed to
+ * stderr at the end, keeping stdout for the inventory itself.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "common/logging.h"
+#include "common/string.h"
+#include "lib/stringinfo.h"
+#include "portability/instr_time.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+
+typedef enum InventoryFormat
+{
+	INVENTORY_CSV,
+	INVENTORY_NDJSON
+} InventoryFormat;
+
+/* Output columns: the union of the fields of every known layout */
+static const char **columns = NULL;
+static int	ncolumns = 0;
+
+/* Per-directory read latency, with --stats=json */
+static LatencyHistogram *read_latency = NULL;
+
+static void build_columns(void);
+static void inventory_one(PgControl *ctl, const char *datadir,
+						  InventoryFormat format, StringInfo out);
+static void inventory_pattern(PgControl *ctl, const char *pattern,
+							  InventoryFormat format, StringInfo out);
+static void append_csv(StringInfo out, const char *value);
+
+
+int
+run_inventory(char **datadirs, int ndatadirs, const char *format_name,
+			  bool stats)
+{
+	InventoryFormat format = INVENTORY_CSV;
+	PgControl  *ctl;
+	StringInfoData out;
+	int			i;
+	instr_time	start;
+	instr_time	duration;
+
+	if (format_name == NULL || strcmp(format_name, "csv") == 0)
+		format = INVENTORY_CSV;
+	else if (strcmp(format_name, "ndjson") == 0)
+		format = INVENTORY_NDJSON;
+	else
+		pg_fatal("unrecognized output format \"%s\"", format_name);
+
+	build_columns();
+	ctl = pg_malloc0(sizeof(PgControl));
+	if (stats)
+		read_latency = pg_malloc0(sizeof(LatencyHistogram));
+	INSTR_TIME_SET_CURRENT(start);
+	initStringInfo(&out);
+
+	if (format == INVENTORY_CSV)
+	{
+		appendStringInfoString(&out, "datadir,status,error");
+		for (i = 0; i < ncolumns; i++)
+		{
+			appendStringInfoChar(&out, ',');
+			append_csv(&out, columns[i]);
+		}
+		appendStringInfoChar(&out, '\n');
+	}
+
+	if (ndatadirs > 0)
+	{
+		for (i = 0; i < ndatadirs; i++)
+			inventory_pattern(ctl, datadirs[i], format, &out);
+	}
+	else
+	{
+		StringInfoData line;
+
+		initStringInfo(&line);
+		while (pg_get_line_buf(stdin, &line))
+		{
+			pg_strip_crlf(line.data);
+			if (line.data[0] != '\0')
+				inventory_pattern(ctl, line.data, format, &out);
+		}
+		pfree(line.data);
+	}
+
+	fwrite(out.data, 1, out.len, stdout);
+	pg_free(ctl);
+
+	if (fflush(stdout) != 0)
+		pg_fatal("could not write output: %m");
+
+	if (stats)
+	{
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		resetStringInfo(&out);
+		appendStringInfo(&out, "{\"datadirs\": " UINT64_FORMAT
+						 ", \"total_ns\": " UINT64_FORMAT ", ",
+						 read_latency->count,
+						 (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0));
+		histogram_append_json(&out, "read", read_latency);
+		appendStringInfoString(&out, "}\n");
+		fwrite(out.data, 1, out.len, stderr);
+		pg_free(read_latency);
+		read_latency = NULL;
+	}
+	pfree(out.data);
+	return 0;
+}
+
+
+static void
+build_columns(void)
+{
+	const PgControlLayout *layout;
+	int			i;
+	int			j;
+
+	for (i = 0; (layout = pgcontrol_get_layout(i)) != NULL; i++)
+	{
+		for (j = 0; j < layout->nfields; j++)
+		{
+			const char *name = layout->fields[j].name;
+			int			k;
+
+			for (k = 0; k < ncolumns; k++)
+			{
+				if (strcmp(columns[k], name) == 0)
+					break;
+			}
+			if (k < ncolumns)
+				continue;
+
+			columns = pg_realloc(columns, sizeof(char *) * (ncolumns + 1));
+			columns[ncolumns++] = name;
+		}
+	}
+}
+
+
+/*
+ * Expand a glob pattern (plain names match themselves) and report each
+ * match that is a directory or does not exist.  Output is buffered and
+ * written in large chunks.
+ */
+static void
+inventory_pattern(PgControl *ctl, const char *pattern,
+				  InventoryFormat format, StringInfo out)
+{
+	glob_t		g;
+	size_t		i;
+
+	if (glob(pattern, GLOB_NOCHECK, NULL, &g) != 0)
+		pg_fatal("could not expand \"%s\"", pattern);
+
+	for (i = 0; i < g.gl_pathc; i++)
+	{
+		struct stat st;
+
+		/* Files matched by the pattern are not data directories */
+		if (stat(g.gl_pathv[i], &st) == 0 && !S_ISDIR(st.st_mode))
+			continue;
+
+		inventory_one(ctl, g.gl_pathv[i], format, out);
+
+		if (out->len > 1024 * 1024)
+		{
+			fwrite(out->data, 1, out->len, stdout);
+			resetStringInfo(out);
+		}
+	}
+	globfree(&g);
+}
+
+
+static void
+inventory_one(PgControl *ctl, const char *datadir, InventoryFormat format,
+			  StringInfo out)
+{
+	const char *status;
+	bool		ok;
+	int			i;
+	instr_time	start;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(start);
+	ok = pgcontrol_read(ctl, datadir);
+	if (read_latency != NULL)
+	{
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		histogram_add(read_latency,
+					  (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0));
+	}
+	if (!ok)
+		status = "error";
+	else if (!ctl->crc_ok)
+		status = "invalid_crc";
+	else
+		status = "ok";
+
+	if (format == INVENTORY_CSV)
+	{
+		append_csv(out, datadir);
+		appendStringInfo(out, ",%s,", status);
+		append_csv(out, ok ? "" : ctl->errmsg);
+	}
+	else
+	{
+		appendStringInfoString(out, "{\"datadir\": ");
+		append_json_string(out, datadir);
+		appendStringInfo(out, ", \"status\": \"%s\"", status);
+		if (!ok)
+		{
+			appendStringInfoString(out, ", \"error\": ");
+			append_json_string(out, ctl->errmsg);
+		}
+	}
+
+	for (i = 0; i < ncolumns; i++)
+	{
+		const PgControlField *field = NULL;
+		char		value[128];
+
+		if (ok)
+			field = pgcontrol_find_field(ctl->layout, columns[i]);
+
+		if (format == INVENTORY_CSV)
+		{
+			appendStringInfoChar(out, ',');
+			if (field != NULL)
+			{
+				pgcontrol_format_field(ctl, field, value, sizeof(value));
+				append_csv(out, value);
+			}
+			continue;
+		}
+
+		if (field == NULL)
+			continue;
+
+		pgcontrol_format_field(ctl, field, value, sizeof(value));
+		appendStringInfo(out, ", \"%s\": ", columns[i]);
+		switch (field->type)
+		{
+			case PGCF_BOOL:
+				appendStringInfoString(out, strcmp(value, "on") == 0 ? "true" : "false");
+				break;
+			case PGCF_INT32:
+			case PGCF_UINT32:
+			case PGCF_UINT64:
+			case PGCF_INT64:
+			case PGCF_DOUBLE:
+				appendStringInfoString(out, value);
+				break;
+			case PGCF_LSN:
+			case PGCF_FXID:
+			case PGCF_BYTES:
+				append_json_string(out, value);
+				break;
+		}
+	}
+
+	appendStringInfoString(out, format == INVENTORY_CSV ? "\n" : "}\n");
+}
+
+
+static void
+append_csv(StringInfo out, const char *value)
+{
+	const char *p;
+
+	if (strpbrk(value, ",\"\r\n") == NULL)
+	{
+		appendStringInfoString(out, value);
+		return;
+	}
+
+	appendStringInfoChar(out, '"');
+	for (p = value; *p; p++)
+	{
+		if (*p == '"')
+			appendStringInfoChar(out, '"');
+		appendStringInfoChar(out, *p);
+	}
+	appendStringInfoChar(out, '"');
+}
+
+
+/*
+ * Append value as a JSON string literal.
+ */
+void
+append_json_string(StringInfo out, const char *value)
+{
+	const char *p;
+
+	appendStringInfoChar(out, '"');
+	for (p = value; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+			appendStringInfo(out, "\\%c", *p);
+		else if ((unsigned char) *p < 0x20)
+			appendStringInfo(out, "\\u%04x", (unsigned char) *p);
+		else
+			appendStringInfoChar(out, *p);
+	}
+	appendStringInfoChar(out, '"');
+}
@@ -0,0 +1,231 @@
+/*
+ * manifest.c
+ *	  Keep backup_manifest consistent with an edited pg_control.
+ *
+ * Only the global/pg_control entry and the trailing manifest checksum are
+ * rewritten.  The manifest is streamed line by line through SHA-256, so no
+ * data file is read and large manifests are not held in memory.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/checksum_helper.h"
+#include "common/cryptohash.h"
+#include "common/file_utils.h"
+#include "common/logging.h"
+#include "common/sha2.h"
+#include "common/string.h"
+#include "catalog/pg_control.h"
+#include "lib/stringinfo.h"
+
+#include "pg_control_editor.h"
+
+#define MANIFEST_FILE_NAME		"backup_manifest"
+#define MANIFEST_CHECKSUM_KEY	"\"Manifest-Checksum\""
+#define CONTROL_ENTRY_KEY		"\"Path\": \"" XLOG_CONTROL_FILE "\""
+
+static void rewrite_control_entry(StringInfo line, const char *pgdata_out);
+static void hex_string(const uint8 *bytes, int len, char *out);
+
+
+/*
+ * Rewrite the pg_control entry of the backup manifest found in pgdata_out,
+ * or failing that in pgdata_in (which may be NULL), into pgdata_out.
+ * Does nothing if neither directory has a manifest.
+ */
+void
+update_backup_manifest(const char *pgdata_in, const char *pgdata_out)
+{
+	char		manifest_in[MAXPGPATH];
+	char		manifest_out[MAXPGPATH];
+	char		manifest_tmp[MAXPGPATH];
+	FILE	   *in;
+	FILE	   *out;
+	StringInfoData line;
+	pg_cryptohash_ctx *ctx;
+	uint8		digest[PG_SHA256_DIGEST_LENGTH];
+	char		digest_hex[PG_SHA256_DIGEST_LENGTH * 2 + 1];
+	bool		found_entry = false;
+	bool		found_checksum = false;
+
+	snprintf(manifest_out, sizeof(manifest_out), "%s/%s",
+			 pgdata_out, MANIFEST_FILE_NAME);
+	snprintf(manifest_tmp, sizeof(manifest_tmp), "%s/%s.tmp",
+			 pgdata_out, MANIFEST_FILE_NAME);
+
+	if (access(manifest_out, F_OK) == 0)
+		strlcpy(manifest_in, manifest_out, sizeof(manifest_in));
+	else if (pgdata_in != NULL)
+	{
+		snprintf(manifest_in, sizeof(manifest_in), "%s/%s",
+				 pgdata_in, MANIFEST_FILE_NAME);
+		if (access(manifest_in, F_OK) != 0)
+			return;
+	}
+	else
+		return;
+
+	if ((in = fopen(manifest_in, "r")) == NULL)
+		pg_fatal("could not open file \"%s\" for reading: %m", manifest_in);
+	if ((out = fopen(manifest_tmp, "w")) == NULL)
+		pg_fatal("could not open file \"%s\" for writing: %m", manifest_tmp);
+
+	ctx = pg_cryptohash_create(PG_SHA256);
+	if (ctx == NULL || pg_cryptohash_init(ctx) < 0)
+		pg_fatal("could not initialize checksum of manifest");
+
+	initStringInfo(&line);
+	while (pg_get_line_buf(in, &line))
+	{
+		/* The checksum covers everything before its own line */
+		if (strncmp(line.data, MANIFEST_CHECKSUM_KEY,
+					strlen(MANIFEST_CHECKSUM_KEY)) == 0)
+		{
+			found_checksum = true;
+			break;
+		}
+
+		if (!found_entry && strstr(line.data, CONTROL_ENTRY_KEY) != NULL)
+		{
+			rewrite_control_entry(&line, pgdata_out);
+			found_entry = true;
+		}
+
+		if (fwrite(line.data, 1, line.len, out) != line.len)
+			pg_fatal("could not write file \"%s\": %m", manifest_tmp);
+		if (pg_cryptohash_update(ctx, (uint8 *) line.data, line.len) < 0)
+			pg_fatal("could not update checksum of manifest");
+	}
+	if (ferror(in))
+		pg_fatal("could not read file \"%s\": %m", manifest_in);
+	fclose(in);
+
+	if (!found_checksum || !found_entry)
+	{
+		fclose(out);
+		unlink(manifest_tmp);
+		pfree(line.data);
+		pg_cryptohash_free(ctx);
+		pg_log_warning("\"%s\" has no %s, leaving it unchanged",
+					   manifest_in,
+					   found_checksum ? "entry for " XLOG_CONTROL_FILE : "manifest checksum");
+		return;
+	}
+
+	if (pg_cryptohash_final(ctx, digest, sizeof(digest)) < 0)
+		pg_fatal("could not finalize checksum of manifest");
+	pg_cryptohash_free(ctx);
+	hex_string(digest, sizeof(digest), digest_hex);
+
+	fprintf(out, "%s: \"%s\"}\n", MANIFEST_CHECKSUM_KEY, digest_hex);
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+		pg_fatal("could not write file \"%s\": %m", manifest_tmp);
+	if (fclose(out) != 0)
+		pg_fatal("could not close file \"%s\": %m", manifest_tmp);
+	pfree(line.data);
+
+	if (rename(manifest_tmp, manifest_out) != 0)
+		pg_fatal("could not rename file \"%s\" to \"%s\": %m",
+				 manifest_tmp, manifest_out);
+
+	/* Make the rename itself durable; fsync_fname() reports any failure */
+	if (fsync_fname(pgdata_out, true) != 0)
+		exit(1);
+}
+
+
+/*
+ * Replace the manifest line describing pg_control with one matching the
+ * file just written to pgdata_out.  Whatever surrounds the JSON object on
+ * the line (list separators) is kept, as is the checksum algorithm.
+ */
+static void
+rewrite_control_entry(StringInfo line, const char *pgdata_out)
+{
+	char		path[MAXPGPATH];
+	char		buffer[PG_CONTROL_FILE_SIZE];
+	char		algorithm[32] = "NONE";
+	char		timestamp[128];
+	char		checksum_hex[PG_CHECKSUM_MAX_LENGTH * 2 + 1];
+	uint8		checksum[PG_CHECKSUM_MAX_LENGTH];
+	int			checksum_len;
+	pg_checksum_type type;
+	pg_checksum_context cctx;
+	struct stat st;
+	struct tm	tm;
+	char	   *start;
+	char	   *end;
+	char	   *alg;
+	int			fd;
+	int			len;
+	StringInfoData buf;
+
+	start = strchr(line->data, '{');
+	end = strrchr(line->data, '}');
+	if (start == NULL || end == NULL || end < start)
+		pg_fatal("could not parse manifest entry for \"%s\"", XLOG_CONTROL_FILE);
+
+	alg = strstr(line->data, "\"Checksum-Algorithm\": \"");
+	if (alg != NULL)
+	{
+		alg += strlen("\"Checksum-Algorithm\": \"");
+		len = strcspn(alg, "\"");
+		snprintf(algorithm, sizeof(algorithm), "%.*s", len, alg);
+	}
+	if (!pg_checksum_parse_type(algorithm, &type))
+		pg_fatal("unrecognized checksum algorithm \"%s\" in manifest", algorithm);
+
+	snprintf(path, sizeof(path), "%s/%s", pgdata_out, XLOG_CONTROL_FILE);
+	if ((fd = open(path, O_RDONLY | PG_BINARY, 0)) < 0)
+		pg_fatal("could not open file \"%s\" for reading: %m", path);
+	if (fstat(fd, &st) != 0)
+		pg_fatal("could not stat file \"%s\": %m", path);
+	len = read(fd, buffer, sizeof(buffer));
+	if (len < 0)
+		pg_fatal("could not read file \"%s\": %m", path);
+	close(fd);
+
+	if (pg_checksum_init(&cctx, type) < 0 ||
+		pg_checksum_update(&cctx, (uint8 *) buffer, len) < 0 ||
+		(checksum_len = pg_checksum_final(&cctx, checksum)) < 0)
+		pg_fatal("could not compute checksum of file \"%s\"", path);
+	hex_string(checksum, checksum_len, checksum_hex);
+
+	gmtime_r(&st.st_mtime, &tm);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S GMT", &tm);
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, line->data, start - line->data);
+	appendStringInfo(&buf,
+					 "{ \"Path\": \"%s\", \"Size\": %d, \"Last-Modified\": \"%s\"",
+					 XLOG_CONTROL_FILE, len, timestamp);
+	if (type != CHECKSUM_TYPE_NONE)
+		appendStringInfo(&buf,
+						 ", \"Checksum-Algorithm\": \"%s\", \"Checksum\": \"%s\"",
+						 algorithm, checksum_hex);
+	appendStringInfo(&buf, " }%s", end + 1);
+
+	resetStringInfo(line);
+	appendBinaryStringInfo(line, buf.data, buf.len);
+	pfree(buf.data);
+}
+
+
+static void
+hex_string(const uint8 *bytes, int len, char *out)
+{
+	int			i;
+
+	for (i = 0; i < len; i++)
+		sprintf(out + i * 2, "%02x", bytes[i]);
+	out[len * 2] = '\0';
+}
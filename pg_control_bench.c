@@ -0,0 +1,391 @@
+/*
+ * pg_control_bench.c
+ *	  Micro-benchmark of the read -> validate -> apply -> write cycle of
+ *	  libpgcontrol, run by "make bench".
+ *
+ * The target directory gets a synthetic pg_control if it has none.  Each
+ * iteration reads it, bumps nextOid and writes it back, optionally with
+ * fsync (--sync) or with the page cache of the file dropped before the
+ * read (--cold).  Results are printed as JSON; --output saves them as a
+ * baseline and --baseline compares against a saved one, failing when
+ * throughput or p99 latency regressed beyond --threshold percent.
+ *
+ * With --jobs, that many forked workers each edit their own directory
+ * under the target concurrently; latencies of all workers are pooled.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "access/transam.h"
+#include "access/xlog_internal.h"
+#include "common/logging.h"
+#include "getopt_long.h"
+#include "portability/instr_time.h"
+
+#include "pgcontrol.h"
+
+static const char *progname;
+
+static void usage(void);
+static uint64 run_edits(const char *target, int iterations, bool do_sync,
+					   bool cold, uint64 *latency_ns);
+static void make_control_file(const char *datadir);
+static void drop_cache(const char *datadir);
+static int	cmp_uint64(const void *a, const void *b);
+static double baseline_value(const char *json, const char *key);
+
+
+int
+main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"target", required_argument, NULL, 't'},
+		{"iterations", required_argument, NULL, 'n'},
+		{"label", required_argument, NULL, 'L'},
+		{"sync", no_argument, NULL, 's'},
+		{"cold", no_argument, NULL, 'c'},
+		{"output", required_argument, NULL, 'o'},
+		{"baseline", required_argument, NULL, 'b'},
+		{"threshold", required_argument, NULL, 'T'},
+		{"jobs", required_argument, NULL, 'j'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *target = NULL;
+	const char *label = "default";
+	const char *output = NULL;
+	const char *baseline = NULL;
+	int			iterations = 10000;
+	int			jobs = 1;
+	double		threshold = 10.0;
+	bool		do_sync = false;
+	bool		cold = false;
+	int			c;
+	int			i;
+	uint64	   *latency_ns;
+	uint64	   *syscalls;
+	uint64		total_syscalls = 0;
+	int64		nsamples;
+	instr_time	bench_start;
+	instr_time	bench_duration;
+	double		seconds;
+	double		ops_per_sec;
+	uint64		p50;
+	uint64		p99;
+	char		result[1024];
+	int			status = 0;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	while ((c = getopt_long(argc, argv, "t:n:L:sco:b:T:j:", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 't':
+				target = optarg;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'L':
+				label = optarg;
+				break;
+			case 's':
+				do_sync = true;
+				break;
+			case 'c':
+				cold = true;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'b':
+				baseline = optarg;
+				break;
+			case 'T':
+				threshold = atof(optarg);
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (target == NULL || iterations <= 0 || jobs <= 0)
+	{
+		usage();
+		exit(1);
+	}
+
+	/* Shared with the workers, which fill in their own slices */
+	nsamples = (int64) iterations * jobs;
+	latency_ns = mmap(NULL, sizeof(uint64) * (nsamples + jobs),
+					  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latency_ns == MAP_FAILED)
+		pg_fatal("could not allocate shared memory: %m");
+	syscalls = latency_ns + nsamples;
+
+	if (jobs == 1)
+	{
+		make_control_file(target);
+		INSTR_TIME_SET_CURRENT(bench_start);
+		syscalls[0] = run_edits(target, iterations, do_sync, cold, latency_ns);
+	}
+	else
+	{
+		pid_t	   *workers = pg_malloc(sizeof(pid_t) * jobs);
+		char		path[MAXPGPATH];
+
+		if (mkdir(target, 0700) != 0 && errno != EEXIST)
+			pg_fatal("could not create directory \"%s\": %m", target);
+		for (i = 0; i < jobs; i++)
+		{
+			snprintf(path, sizeof(path), "%s/worker%d", target, i);
+			make_control_file(path);
+		}
+
+		fflush(NULL);
+		INSTR_TIME_SET_CURRENT(bench_start);
+		for (i = 0; i < jobs; i++)
+		{
+			workers[i] = fork();
+			if (workers[i] < 0)
+				pg_fatal("could not fork: %m");
+			if (workers[i] == 0)
+			{
+				snprintf(path, sizeof(path), "%s/worker%d", target, i);
+				syscalls[i] = run_edits(path, iterations, do_sync, cold,
+										latency_ns + (int64) i * iterations);
+				exit(0);
+			}
+		}
+		for (i = 0; i < jobs; i++)
+		{
+			int			wstatus;
+
+			if (waitpid(workers[i], &wstatus, 0) < 0)
+				pg_fatal("could not wait for worker: %m");
+			if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+				pg_fatal("worker %d failed", i);
+		}
+		pg_free(workers);
+	}
+	INSTR_TIME_SET_CURRENT(bench_duration);
+	INSTR_TIME_SUBTRACT(bench_duration, bench_start);
+
+	for (i = 0; i < jobs; i++)
+		total_syscalls += syscalls[i];
+
+	seconds = INSTR_TIME_GET_DOUBLE(bench_duration);
+	ops_per_sec = nsamples / seconds;
+	qsort(latency_ns, nsamples, sizeof(uint64), cmp_uint64);
+	p50 = latency_ns[(int64) (nsamples * 0.50)];
+	p99 = latency_ns[Min((int64) (nsamples * 0.99), nsamples - 1)];
+
+	snprintf(result, sizeof(result),
+			 "{\"label\": \"%s\", \"target\": \"%s\", \"iterations\": %d, \"jobs\": %d, "
+			 "\"sync\": %s, \"cold\": %s, \"ops_per_sec\": %.1f, "
+			 "\"p50_us\": %.2f, \"p99_us\": %.2f, \"syscalls_per_op\": %.2f}\n",
+			 label, target, iterations, jobs,
+			 do_sync ? "true" : "false", cold ? "true" : "false",
+			 ops_per_sec, p50 / 1000.0, p99 / 1000.0,
+			 (double) total_syscalls / nsamples);
+	fputs(result, stdout);
+
+	if (output != NULL)
+	{
+		FILE	   *f = fopen(output, "w");
+
+		if (f == NULL || fputs(result, f) == EOF || fclose(f) != 0)
+			pg_fatal("could not write file \"%s\": %m", output);
+	}
+
+	if (baseline != NULL)
+	{
+		FILE	   *f = fopen(baseline, "r");
+		char		saved[1024];
+		size_t		len;
+
+		if (f == NULL)
+			pg_log_info("no baseline \"%s\", nothing to compare", baseline);
+		else
+		{
+			double		base_ops;
+			double		base_p99;
+
+			len = fread(saved, 1, sizeof(saved) - 1, f);
+			saved[len] = '\0';
+			fclose(f);
+
+			base_ops = baseline_value(saved, "ops_per_sec");
+			base_p99 = baseline_value(saved, "p99_us");
+
+			if (base_ops > 0 && ops_per_sec < base_ops * (1 - threshold / 100))
+			{
+				pg_log_error("%s: throughput regressed: %.1f ops/s, baseline %.1f",
+							 label, ops_per_sec, base_ops);
+				status = 1;
+			}
+			if (base_p99 > 0 && p99 / 1000.0 > base_p99 * (1 + threshold / 100))
+			{
+				pg_log_error("%s: p99 latency regressed: %.2f us, baseline %.2f",
+							 label, p99 / 1000.0, base_p99);
+				status = 1;
+			}
+		}
+	}
+
+	munmap(latency_ns, sizeof(uint64) * (nsamples + jobs));
+	return status;
+}
+
+
+static void
+usage(void)
+{
+	printf(_("%s benchmarks pg_control read/modify/write.\n\n"), progname);
+	printf(_("Usage:\n"));
+	printf(_("  %s --target=DIR [OPTION]...\n\n"), progname);
+	printf(_("Options:\n"));
+	printf(_("  -t, --target=DIR        directory to edit; created with a synthetic\n"
+			 "                          pg_control if it has none\n"));
+	printf(_("  -n, --iterations=N      number of edits (default 10000)\n"));
+	printf(_("  -L, --label=NAME        name of this run in the output\n"));
+	printf(_("  -s, --sync              fsync every write\n"));
+	printf(_("  -c, --cold              drop the file from the page cache before each read\n"));
+	printf(_("  -o, --output=FILE       save the result as a JSON baseline\n"));
+	printf(_("  -b, --baseline=FILE     compare against a saved baseline\n"));
+	printf(_("  -T, --threshold=PCT     allowed regression in percent (default 10)\n"));
+	printf(_("  -j, --jobs=N            concurrent workers, each on DIR/workerN (default 1)\n"));
+}
+
+
+/*
+ * Edit target iterations times, storing each latency.  Returns the number
+ * of system calls made.
+ */
+static uint64
+run_edits(const char *target, int iterations, bool do_sync, bool cold,
+		  uint64 *latency_ns)
+{
+	PgControl  *ctl = pg_malloc0(sizeof(PgControl));
+	PgControlEdits edits;
+	uint64		syscalls = 0;
+	int			i;
+
+	pgcontrol_edits_init(&edits);
+
+	for (i = 0; i < iterations; i++)
+	{
+		instr_time	start;
+		instr_time	duration;
+		int			phase;
+
+		if (cold)
+			drop_cache(target);
+
+		pgcontrol_stats_reset(ctl);
+		INSTR_TIME_SET_CURRENT(start);
+
+		if (!pgcontrol_read(ctl, target))
+			pg_fatal("%s", ctl->errmsg);
+		edits.next_oid = FirstNormalObjectId + i;
+		if (!pgcontrol_apply(ctl, &edits))
+			pg_fatal("%s", ctl->errmsg);
+		if (!pgcontrol_write(ctl, target, do_sync))
+			pg_fatal("%s", ctl->errmsg);
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		latency_ns[i] = (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0);
+
+		for (phase = 0; phase < PGCONTROL_NUM_PHASES; phase++)
+		{
+			if (phase != PGCONTROL_PHASE_VALIDATE && phase != PGCONTROL_PHASE_APPLY)
+				syscalls += ctl->stats.phase_calls[phase];
+		}
+	}
+
+	pg_free(ctl);
+	return syscalls;
+}
+
+
+/*
+ * Give the target a valid pg_control of the compiled-in version unless it
+ * already has one.
+ */
+static void
+make_control_file(const char *datadir)
+{
+	PgControl  *ctl = pg_malloc0(sizeof(PgControl));
+	char		image[PG_CONTROL_FILE_SIZE];
+
+	if (pgcontrol_read(ctl, datadir))
+	{
+		pg_free(ctl);
+		return;
+	}
+
+	memset(image, 0, sizeof(image));
+	((ControlFileData *) image)->pg_control_version = PG_CONTROL_VERSION;
+	((ControlFileData *) image)->xlog_seg_size = DEFAULT_XLOG_SEG_SIZE;
+	((ControlFileData *) image)->checkPointCopy.nextOid = FirstNormalObjectId;
+
+	if (!pgcontrol_parse(ctl, image, sizeof(image)) ||
+		!pgcontrol_write(ctl, datadir, true))
+		pg_fatal("%s", ctl->errmsg);
+	pg_free(ctl);
+}
+
+
+static void
+drop_cache(const char *datadir)
+{
+	char		path[MAXPGPATH];
+	int			fd;
+
+	snprintf(path, sizeof(path), "%s/%s", datadir, XLOG_CONTROL_FILE);
+	if ((fd = open(path, O_RDONLY | PG_BINARY, 0)) < 0)
+		pg_fatal("could not open file \"%s\": %m", path);
+	/* Dirty pages are not dropped, so write them back first */
+	if (fdatasync(fd) != 0)
+		pg_fatal("could not fsync file \"%s\": %m", path);
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+
+static int
+cmp_uint64(const void *a, const void *b)
+{
+	uint64		x = *(const uint64 *) a;
+	uint64		y = *(const uint64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+static double
+baseline_value(const char *json, const char *key)
+{
+	char		pattern[64];
+	const char *p;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+	p = strstr(json, pattern);
+	return p != NULL ? atof(p + strlen(pattern)) : 0;
+}
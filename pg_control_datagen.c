@@ -0,0 +1,919 @@
+/*
+ * pg_control_datagen.c
+ *	  Write a synthetic data directory for benchmarking the scanning modes
+ *	  of pg_control_editor without running a server.
+ *
+ * The result has a valid pg_control, heap relations in base/5 whose
+ * tuples carry XIDs and multixacts drawn from a configurable distribution
+ * (with a configurable fraction of frozen pages and matching VM forks),
+ * pg_xact and pg_multixact SLRU segments covering every ID in use, and WAL
+ * segments of valid pages holding a checkpoint record followed by XLOG_NOOP
+ * records, all with correct CRCs.  Page checksums are set with -k.
+ * Relations are written by --jobs forked workers while the parent writes
+ * the SLRUs.  The same --seed always produces the same page contents.
+ *
+ * The catalog is not generated, so the server cannot start on the result.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access/heaptoast.h"
+#include "access/htup_details.h"
+#include "access/rmgr.h"
+#include "access/transam.h"
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xlogrecord.h"
+#include "catalog/catversion.h"
+#include "catalog/pg_control.h"
+#include "common/logging.h"
+#include "common/pg_prng.h"
+#include "fe_utils/option_utils.h"
+#include "getopt_long.h"
+#include "storage/bufpage.h"
+#include "storage/checksum.h"
+#include "storage/checksum_impl.h"
+#include "storage/large_object.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+
+/* Database all relations are put in; 5 is "postgres" */
+#define DATAGEN_DBOID			5
+
+/* Pages buffered per write() */
+#define DATAGEN_CHUNK_PAGES		128
+
+/* From visibilitymap.c */
+#define VM_MAPSIZE				(BLCKSZ - MAXALIGN(SizeOfPageHeaderData))
+#define VM_HEAPBLOCKS_PER_PAGE	(VM_MAPSIZE * 4)
+
+
+typedef enum XidDistribution
+{
+	XID_UNIFORM,				/* xmin uniform over the whole range */
+	XID_ASCENDING				/* xmin grows with the block number */
+} XidDistribution;
+
+typedef struct DatagenOptions
+{
+	const char *datadir;
+	int			nrelations;
+	int64		relation_blocks;
+	TransactionId xid_min;
+	TransactionId xid_max;
+	XidDistribution distribution;
+	double		frozen_fraction;
+	double		multi_fraction;
+	MultiXactId nmultis;
+	int			wal_segments;
+	int			wal_record_size;
+	int			wal_segsize;
+	bool		checksums;
+	bool		commit_ts;
+	int			jobs;
+	uint64		seed;
+} DatagenOptions;
+
+static const char *progname;
+static DatagenOptions opts;
+
+/* Position of the WAL writer */
+static XLogRecPtr wal_insert;
+static XLogRecPtr wal_prev;
+static char *wal_segment;		/* current segment image */
+static XLogSegNo wal_segno;
+static uint64 sysid;
+
+static void usage(void);
+static double parse_fraction(const char *arg, const char *optname);
+static void make_directories(void);
+static void write_relation(int relno, XLogRecPtr max_lsn);
+static void fill_heap_page(Page page, BlockNumber blkno, pg_prng_state *prng,
+						   bool frozen, XLogRecPtr max_lsn);
+static void write_slrus(void);
+static XLogRecPtr write_wal(CheckPoint *checkpoint);
+static void wal_append(const char *data, uint32 len);
+static void wal_start_page(uint32 rem_len);
+static void wal_flush_segment(void);
+static void write_control_file(CheckPoint *checkpoint, XLogRecPtr checkpoint_lsn);
+static void write_file(const char *path, const char *data, size_t len);
+
+
+int
+main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"pgdata", required_argument, NULL, 'D'},
+		{"relations", required_argument, NULL, 'r'},
+		{"relation-size", required_argument, NULL, 's'},
+		{"xid-range", required_argument, NULL, 'x'},
+		{"xid-distribution", required_argument, NULL, 1},
+		{"frozen-fraction", required_argument, NULL, 'f'},
+		{"multixact-fraction", required_argument, NULL, 'm'},
+		{"multixacts", required_argument, NULL, 2},
+		{"wal-segments", required_argument, NULL, 'w'},
+		{"wal-record-size", required_argument, NULL, 3},
+		{"wal-segsize", required_argument, NULL, 4},
+		{"data-checksums", no_argument, NULL, 'k'},
+		{"commit-timestamps", no_argument, NULL, 'c'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"seed", required_argument, NULL, 5},
+		{NULL, 0, NULL, 0}
+	};
+	int			c;
+	int			i;
+	int			n;
+	int			mb;
+	pid_t	   *workers;
+	CheckPoint	checkpoint;
+	XLogRecPtr	checkpoint_lsn;
+	char	   *endptr;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	if (argc > 1 &&
+		(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0))
+	{
+		usage();
+		exit(0);
+	}
+
+	opts.nrelations = 10;
+	opts.relation_blocks = 16 * 1024 * 1024 / BLCKSZ;
+	opts.xid_min = FirstNormalTransactionId;
+	opts.xid_max = 1000000;
+	opts.distribution = XID_UNIFORM;
+	opts.frozen_fraction = 0.5;
+	opts.multi_fraction = 0.01;
+	opts.nmultis = 1000;
+	opts.wal_segments = 2;
+	opts.wal_record_size = 200;
+	opts.wal_segsize = DEFAULT_XLOG_SEG_SIZE;
+	opts.jobs = 1;
+	opts.seed = 0;
+
+	while ((c = getopt_long(argc, argv, "D:r:s:x:f:m:w:kcj:", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+				opts.datadir = optarg;
+				break;
+			case 'r':
+				if (!option_parse_int(optarg, "-r/--relations", 0, INT_MAX,
+									  &opts.nrelations))
+					exit(1);
+				break;
+			case 's':
+				if (!option_parse_int(optarg, "-s/--relation-size", 0, INT_MAX,
+									  &mb))
+					exit(1);
+				opts.relation_blocks = (int64) mb * 1024 * 1024 / BLCKSZ;
+				break;
+			case 'x':
+				errno = 0;
+				opts.xid_min = strtoul(optarg, &endptr, 0);
+				if (endptr == optarg || *endptr != ',' || errno != 0)
+					pg_fatal("invalid argument for option %s", "-x");
+				optarg = endptr + 1;
+				opts.xid_max = strtoul(optarg, &endptr, 0);
+				if (endptr == optarg || *endptr != '\0' || errno != 0)
+					pg_fatal("invalid argument for option %s", "-x");
+				break;
+			case 1:
+				if (strcmp(optarg, "uniform") == 0)
+					opts.distribution = XID_UNIFORM;
+				else if (strcmp(optarg, "ascending") == 0)
+					opts.distribution = XID_ASCENDING;
+				else
+					pg_fatal("invalid argument for option %s", "--xid-distribution");
+				break;
+			case 'f':
+				opts.frozen_fraction = parse_fraction(optarg, "-f/--frozen-fraction");
+				break;
+			case 'm':
+				opts.multi_fraction = parse_fraction(optarg, "-m/--multixact-fraction");
+				break;
+			case 2:
+				if (!option_parse_int(optarg, "--multixacts", 1, INT_MAX, &n))
+					exit(1);
+				opts.nmultis = n;
+				break;
+			case 'w':
+				if (!option_parse_int(optarg, "-w/--wal-segments", 1, INT_MAX,
+									  &opts.wal_segments))
+					exit(1);
+				break;
+			case 3:
+				if (!option_parse_int(optarg, "--wal-record-size", 0,
+									  XLOG_BLCKSZ * 4, &opts.wal_record_size))
+					exit(1);
+				break;
+			case 4:
+				if (!option_parse_int(optarg, "--wal-segsize", 1, 1024, &mb))
+					exit(1);
+				opts.wal_segsize = mb * 1024 * 1024;
+				if (!IsValidWalSegSize(opts.wal_segsize))
+					pg_fatal("argument of %s must be a power of two between 1 and 1024", "--wal-segsize");
+				break;
+			case 'k':
+				opts.checksums = true;
+				break;
+			case 'c':
+				opts.commit_ts = true;
+				break;
+			case 'j':
+				if (!option_parse_int(optarg, "-j/--jobs", 1, INT_MAX, &opts.jobs))
+					exit(1);
+				break;
+			case 5:
+				errno = 0;
+				opts.seed = strtou64(optarg, &endptr, 0);
+				if (endptr == optarg || *endptr != '\0' || errno != 0)
+					pg_fatal("invalid argument for option %s", "--seed");
+				break;
+			default:
+				pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+				exit(1);
+		}
+	}
+
+	if (opts.datadir == NULL)
+	{
+		pg_log_error("no data directory specified");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
+	if (!TransactionIdIsNormal(opts.xid_min) || opts.xid_max < opts.xid_min)
+		pg_fatal("XID range must be normal XIDs with minimum <= maximum");
+
+	sysid = ((uint64) time(NULL) << 32) | (uint32) getpid();
+
+	make_directories();
+
+	/*
+	 * The WAL is laid out first so the pages can be given LSNs that do not
+	 * pass the checkpoint.
+	 */
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	checkpoint_lsn = write_wal(&checkpoint);
+
+	fflush(NULL);
+	workers = pg_malloc(sizeof(pid_t) * opts.jobs);
+	for (i = 0; i < opts.jobs; i++)
+	{
+		workers[i] = fork();
+		if (workers[i] < 0)
+			pg_fatal("could not fork: %m");
+		if (workers[i] == 0)
+		{
+			int			relno;
+
+			for (relno = i; relno < opts.nrelations; relno += opts.jobs)
+				write_relation(relno, checkpoint_lsn);
+			exit(0);
+		}
+	}
+
+	write_slrus();
+	write_control_file(&checkpoint, checkpoint_lsn);
+
+	for (i = 0; i < opts.jobs; i++)
+	{
+		int			status;
+
+		if (waitpid(workers[i], &status, 0) < 0)
+			pg_fatal("could not wait for worker: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			pg_fatal("worker %d failed", i);
+	}
+
+	return 0;
+}
+
+
+static void
+usage(void)
+{
+	printf(_("%s writes a synthetic PostgreSQL data directory for benchmarks.\n\n"), progname);
+	printf(_("Usage:\n"));
+	printf(_("  %s -D DATADIR [OPTION]...\n\n"), progname);
+	printf(_("Options:\n"));
+	printf(_("  -D, --pgdata=DATADIR             directory to create\n"));
+	printf(_("  -r, --relations=N                number of heap relations (default 10)\n"));
+	printf(_("  -s, --relation-size=MB           size of each relation (default 16)\n"));
+	printf(_("  -x, --xid-range=MIN,MAX          XIDs of unfrozen tuples (default 3,1000000)\n"));
+	printf(_("      --xid-distribution=uniform|ascending\n"
+			 "                                   how xmin is spread over a relation\n"));
+	printf(_("  -f, --frozen-fraction=F          fraction of frozen pages (default 0.5)\n"));
+	printf(_("  -m, --multixact-fraction=F       fraction of tuples locked by a multixact\n"
+			 "                                   (default 0.01)\n"));
+	printf(_("      --multixacts=N               multixacts in use (default 1000)\n"));
+	printf(_("  -w, --wal-segments=N             WAL segments after the checkpoint (default 2)\n"));
+	printf(_("      --wal-record-size=BYTES      payload of each XLOG_NOOP record (default 200)\n"));
+	printf(_("      --wal-segsize=MB             WAL segment size (default 16)\n"));
+	printf(_("  -k, --data-checksums             set page checksums\n"));
+	printf(_("  -c, --commit-timestamps          write pg_commit_ts, as with track_commit_timestamp\n"));
+	printf(_("  -j, --jobs=N                     relation writers (default 1)\n"));
+	printf(_("      --seed=N                     random seed (default 0)\n"));
+}
+
+
+/*
+ * Parse the argument of a fraction option, which must lie in [0, 1].
+ */
+static double
+parse_fraction(const char *arg, const char *optname)
+{
+	char	   *endptr;
+	double		val;
+
+	errno = 0;
+	val = strtod(arg, &endptr);
+	if (endptr == arg || *endptr != '\0' || errno != 0)
+		pg_fatal("invalid value \"%s\" for option %s", arg, optname);
+	if (!(val >= 0 && val <= 1))
+		pg_fatal("%s must be in range %d..%d", optname, 0, 1);
+	return val;
+}
+
+
+static void
+make_directories(void)
+{
+	static const char *const subdirs[] = {
+		"global", "base", "pg_wal", "pg_wal/archive_status", "pg_xact",
+		"pg_multixact", "pg_multixact/offsets", "pg_multixact/members",
+		"pg_commit_ts", "pg_subtrans", "pg_twophase", "pg_notify",
+		"pg_serial", "pg_snapshots", "pg_stat", "pg_stat_tmp",
+		"pg_replslot", "pg_tblspc", "pg_logical", "pg_logical/snapshots",
+		"pg_logical/mappings", "pg_dynshmem"
+	};
+	char		path[MAXPGPATH];
+	int			i;
+
+	if (mkdir(opts.datadir, 0700) != 0)
+		pg_fatal("could not create directory \"%s\": %m", opts.datadir);
+
+	for (i = 0; i < lengthof(subdirs); i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", opts.datadir, subdirs[i]);
+		if (mkdir(path, 0700) != 0)
+			pg_fatal("could not create directory \"%s\": %m", path);
+	}
+	snprintf(path, sizeof(path), "%s/base/%u", opts.datadir, DATAGEN_DBOID);
+	if (mkdir(path, 0700) != 0)
+		pg_fatal("could not create directory \"%s\": %m", path);
+
+	snprintf(path, sizeof(path), "%s/PG_VERSION", opts.datadir);
+	write_file(path, PG_MAJORVERSION "\n", strlen(PG_MAJORVERSION "\n"));
+}
+
+
+/*
+ * Write the main fork, split into RELSEG_SIZE segments, and the VM fork of
+ * relation number relno.
+ */
+static void
+write_relation(int relno, XLogRecPtr max_lsn)
+{
+	Oid			relfilenode = FirstNormalObjectId + relno;
+	pg_prng_state prng;
+	char	   *chunk = pg_malloc(BLCKSZ * DATAGEN_CHUNK_PAGES);
+	int64		nvmpages = (opts.relation_blocks + VM_HEAPBLOCKS_PER_PAGE - 1) / VM_HEAPBLOCKS_PER_PAGE;
+	char	   *vm = pg_malloc0(Max(nvmpages, 1) * BLCKSZ);
+	int			fd = -1;
+	char		path[MAXPGPATH];
+	BlockNumber blkno;
+	int			nbuffered = 0;
+	int64		i;
+
+	pg_prng_seed(&prng, opts.seed ^ ((uint64) relfilenode << 32));
+
+	for (blkno = 0; blkno < opts.relation_blocks; blkno++)
+	{
+		bool		frozen = pg_prng_double(&prng) < opts.frozen_fraction;
+
+		if (blkno % RELSEG_SIZE == 0)
+		{
+			BlockNumber segno = blkno / RELSEG_SIZE;
+
+			if (fd >= 0 && close(fd) != 0)
+				pg_fatal("could not close file \"%s\": %m", path);
+			if (segno == 0)
+				snprintf(path, sizeof(path), "%s/base/%u/%u",
+						 opts.datadir, DATAGEN_DBOID, relfilenode);
+			else
+				snprintf(path, sizeof(path), "%s/base/%u/%u.%u",
+						 opts.datadir, DATAGEN_DBOID, relfilenode, segno);
+			if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY, 0600)) < 0)
+				pg_fatal("could not create file \"%s\": %m", path);
+#ifdef HAVE_POSIX_FALLOCATE
+			(void) posix_fallocate(fd, 0,
+								   (off_t) Min(opts.relation_blocks - blkno, RELSEG_SIZE) * BLCKSZ);
+#endif
+		}
+
+		fill_heap_page(chunk + nbuffered * BLCKSZ, blkno, &prng, frozen, max_lsn);
+		if (frozen)
+		{
+			uint8	   *map = (uint8 *) PageGetContents(vm + (blkno / VM_HEAPBLOCKS_PER_PAGE) * BLCKSZ);
+			uint32		bit = blkno % VM_HEAPBLOCKS_PER_PAGE;
+
+			/* all-visible and all-frozen bits */
+			map[bit / 4] |= 0x03 << ((bit % 4) * 2);
+		}
+
+		if (++nbuffered == DATAGEN_CHUNK_PAGES ||
+			blkno + 1 == opts.relation_blocks ||
+			(blkno + 1) % RELSEG_SIZE == 0)
+		{
+			if (write(fd, chunk, nbuffered * BLCKSZ) != nbuffered * BLCKSZ)
+				pg_fatal("could not write file \"%s\": %m", path);
+			nbuffered = 0;
+		}
+	}
+	if (fd >= 0 && close(fd) != 0)
+		pg_fatal("could not close file \"%s\": %m", path);
+
+	if (opts.relation_blocks > 0)
+	{
+		for (i = 0; i < nvmpages; i++)
+		{
+			PageHeader	phdr = (PageHeader) (vm + i * BLCKSZ);
+
+			phdr->pd_lower = SizeOfPageHeaderData;
+			phdr->pd_upper = BLCKSZ;
+			phdr->pd_special = BLCKSZ;
+			PageSetPageSizeAndVersion((Page) phdr, BLCKSZ, PG_PAGE_LAYOUT_VERSION);
+			PageSetLSN((Page) phdr, max_lsn);
+			if (opts.checksums)
+				phdr->pd_checksum = pg_checksum_page((char *) phdr, i);
+		}
+		snprintf(path, sizeof(path), "%s/base/%u/%u_vm",
+				 opts.datadir, DATAGEN_DBOID, relfilenode);
+		write_file(path, vm, nvmpages * BLCKSZ);
+	}
+
+	pg_free(vm);
+	pg_free(chunk);
+}
+
+
+/*
+ * Fill one heap page with as many single-int8 tuples as fit.
+ */
+static void
+fill_heap_page(Page page, BlockNumber blkno, pg_prng_state *prng, bool frozen,
+			   XLogRecPtr max_lsn)
+{
+	PageHeader	phdr = (PageHeader) page;
+	Size		tuplen = MAXALIGN(SizeofHeapTupleHeader) + sizeof(int64);
+	Size		aligned = MAXALIGN(tuplen);
+	int			ntuples = (BLCKSZ - SizeOfPageHeaderData) / (aligned + sizeof(ItemIdData));
+	uint32		xid_span = opts.xid_max - opts.xid_min + 1;
+	int			i;
+
+	memset(page, 0, BLCKSZ);
+	phdr->pd_lower = SizeOfPageHeaderData + ntuples * sizeof(ItemIdData);
+	phdr->pd_upper = BLCKSZ - ntuples * aligned;
+	phdr->pd_special = BLCKSZ;
+	PageSetPageSizeAndVersion(page, BLCKSZ, PG_PAGE_LAYOUT_VERSION);
+	if (frozen)
+		phdr->pd_flags |= PD_ALL_VISIBLE;
+	PageSetLSN(page, max_lsn - (pg_prng_uint64(prng) % (max_lsn / 2)));
+
+	for (i = 0; i < ntuples; i++)
+	{
+		uint16		off = phdr->pd_upper + i * aligned;
+		HeapTupleHeader tup = (HeapTupleHeader) (page + off);
+		TransactionId xmin;
+		int64		value = ((int64) blkno << 16) | i;
+
+		ItemIdSetNormal(&phdr->pd_linp[i], off, tuplen);
+
+		if (opts.distribution == XID_ASCENDING && opts.relation_blocks > 0)
+			xmin = opts.xid_min +
+				(uint32) ((double) xid_span * blkno / opts.relation_blocks) +
+				(uint32) (pg_prng_uint64(prng) % Max(xid_span / Max(opts.relation_blocks, 1), 1));
+		else
+			xmin = opts.xid_min + (uint32) (pg_prng_uint64(prng) % xid_span);
+		if (xmin > opts.xid_max)
+			xmin = opts.xid_max;
+
+		tup->t_choice.t_heap.t_xmin = xmin;
+		tup->t_infomask = frozen ? HEAP_XMIN_FROZEN : HEAP_XMIN_COMMITTED;
+		if (!frozen && pg_prng_double(prng) < opts.multi_fraction)
+		{
+			tup->t_choice.t_heap.t_xmax =
+				FirstMultiXactId + (MultiXactId) (pg_prng_uint64(prng) % opts.nmultis);
+			tup->t_infomask |= HEAP_XMAX_IS_MULTI | HEAP_XMAX_LOCK_ONLY |
+				HEAP_XMAX_KEYSHR_LOCK;
+		}
+		else
+			tup->t_infomask |= HEAP_XMAX_INVALID;
+		ItemPointerSet(&tup->t_ctid, blkno, i + 1);
+		tup->t_infomask2 = 1;
+		tup->t_hoff = MAXALIGN(SizeofHeapTupleHeader);
+		memcpy((char *) tup + tup->t_hoff, &value, sizeof(value));
+	}
+
+	if (opts.checksums)
+		phdr->pd_checksum = pg_checksum_page(page, blkno);
+}
+
+
+/*
+ * pg_xact with every XID from the oldest up to the next one committed,
+ * multixacts 1..nmultis each with one key-share member, and with -c a
+ * commit timestamp of one millisecond past 2000-01-01 per XID.
+ */
+static void
+write_slrus(void)
+{
+	char	   *segment = pg_malloc(BLCKSZ * SLRU_PAGES_PER_SEGMENT);
+	char		path[MAXPGPATH];
+	TransactionId next_xid = opts.xid_max + 1;
+	int64		seg;
+	int64		last_seg;
+	MultiXactId multi;
+
+	/* pg_xact: two status bits per XID, 0x01 = committed */
+	last_seg = (next_xid / CLOG_XACTS_PER_PAGE) / SLRU_PAGES_PER_SEGMENT;
+	memset(segment, 0x55, BLCKSZ * SLRU_PAGES_PER_SEGMENT);
+	for (seg = (opts.xid_min / CLOG_XACTS_PER_PAGE) / SLRU_PAGES_PER_SEGMENT;
+		 seg <= last_seg; seg++)
+	{
+		int			npages = SLRU_PAGES_PER_SEGMENT;
+
+		if (seg == last_seg)
+			npages = (next_xid / CLOG_XACTS_PER_PAGE) % SLRU_PAGES_PER_SEGMENT + 1;
+		snprintf(path, sizeof(path), "%s/pg_xact/%04X", opts.datadir, (unsigned int) seg);
+		write_file(path, segment, (size_t) npages * BLCKSZ);
+	}
+
+	if (opts.commit_ts)
+	{
+		last_seg = (opts.xid_max / COMMIT_TS_XACTS_PER_PAGE) / SLRU_PAGES_PER_SEGMENT;
+		for (seg = (opts.xid_min / COMMIT_TS_XACTS_PER_PAGE) / SLRU_PAGES_PER_SEGMENT;
+			 seg <= last_seg; seg++)
+		{
+			int64		first = seg * SLRU_PAGES_PER_SEGMENT * COMMIT_TS_XACTS_PER_PAGE;
+			int			npages = SLRU_PAGES_PER_SEGMENT;
+			int64		i;
+
+			memset(segment, 0, BLCKSZ * SLRU_PAGES_PER_SEGMENT);
+			for (i = 0; i < SLRU_PAGES_PER_SEGMENT * COMMIT_TS_XACTS_PER_PAGE; i++)
+			{
+				TransactionId xid = first + i;
+				TimestampTz ts = (TimestampTz) xid * 1000;
+				char	   *entry;
+
+				if (xid < opts.xid_min || xid > opts.xid_max)
+					continue;
+				entry = segment + (i / COMMIT_TS_XACTS_PER_PAGE) * BLCKSZ +
+					(i % COMMIT_TS_XACTS_PER_PAGE) * COMMIT_TS_ENTRY_SIZE;
+				/* origin is InvalidRepOriginId, already zero */
+				memcpy(entry, &ts, sizeof(ts));
+			}
+			if (seg == last_seg)
+				npages = (opts.xid_max / COMMIT_TS_XACTS_PER_PAGE) % SLRU_PAGES_PER_SEGMENT + 1;
+			snprintf(path, sizeof(path), "%s/pg_commit_ts/%04X", opts.datadir, (unsigned int) seg);
+			write_file(path, segment, (size_t) npages * BLCKSZ);
+		}
+	}
+
+	/* pg_multixact/offsets: multixact m starts at member offset m */
+	last_seg = ((opts.nmultis + 1) / MULTIXACT_OFFSETS_PER_PAGE) / SLRU_PAGES_PER_SEGMENT;
+	for (seg = 0; seg <= last_seg; seg++)
+	{
+		MultiXactOffset *offsets = (MultiXactOffset *) segment;
+		int64		first = seg * SLRU_PAGES_PER_SEGMENT * MULTIXACT_OFFSETS_PER_PAGE;
+		int			npages = SLRU_PAGES_PER_SEGMENT;
+		int64		i;
+
+		memset(segment, 0, BLCKSZ * SLRU_PAGES_PER_SEGMENT);
+		for (i = 0; i < SLRU_PAGES_PER_SEGMENT * MULTIXACT_OFFSETS_PER_PAGE; i++)
+		{
+			multi = first + i;
+			if (multi >= FirstMultiXactId && multi <= opts.nmultis)
+				offsets[i] = multi;
+		}
+		if (seg == last_seg)
+			npages = ((opts.nmultis + 1) / MULTIXACT_OFFSETS_PER_PAGE) % SLRU_PAGES_PER_SEGMENT + 1;
+		snprintf(path, sizeof(path), "%s/pg_multixact/offsets/%04X",
+				 opts.datadir, (unsigned int) seg);
+		write_file(path, segment, (size_t) npages * BLCKSZ);
+	}
+
+	/* pg_multixact/members: groups of four flag bytes and four XIDs */
+	last_seg = ((opts.nmultis + 1) / MULTIXACT_MEMBERS_PER_PAGE) / SLRU_PAGES_PER_SEGMENT;
+	for (seg = 0; seg <= last_seg; seg++)
+	{
+		int64		first = seg * SLRU_PAGES_PER_SEGMENT * MULTIXACT_MEMBERS_PER_PAGE;
+		int			npages = SLRU_PAGES_PER_SEGMENT;
+		int64		i;
+
+		memset(segment, 0, BLCKSZ * SLRU_PAGES_PER_SEGMENT);
+		for (i = 0; i < SLRU_PAGES_PER_SEGMENT * MULTIXACT_MEMBERS_PER_PAGE; i++)
+		{
+			MultiXactOffset offset = first + i;
+			int			page = i / MULTIXACT_MEMBERS_PER_PAGE;
+			int			member = i % MULTIXACT_MEMBERS_PER_PAGE;
+			char	   *group;
+			TransactionId xid;
+
+			if (offset < 1 || offset > opts.nmultis)
+				continue;
+			group = segment + page * BLCKSZ +
+				(member / MULTIXACT_MEMBERS_PER_GROUP) * MULTIXACT_GROUP_SIZE;
+			/* status byte 0 is MultiXactStatusForKeyShare */
+			group[member % MULTIXACT_MEMBERS_PER_GROUP] = 0;
+			xid = opts.xid_min + offset % (opts.xid_max - opts.xid_min + 1);
+			memcpy(group + MULTIXACT_MEMBERS_PER_GROUP +
+				   (member % MULTIXACT_MEMBERS_PER_GROUP) * sizeof(TransactionId),
+				   &xid, sizeof(xid));
+		}
+		if (seg == last_seg)
+			npages = ((opts.nmultis + 1) / MULTIXACT_MEMBERS_PER_PAGE) % SLRU_PAGES_PER_SEGMENT + 1;
+		snprintf(path, sizeof(path), "%s/pg_multixact/members/%04X",
+				 opts.datadir, (unsigned int) seg);
+		write_file(path, segment, (size_t) npages * BLCKSZ);
+	}
+
+	pg_free(segment);
+}
+
+
+/*
+ * Write the WAL: an online checkpoint record at the start of segment 1
+ * whose redo pointer is itself, then XLOG_NOOP records until the requested
+ * number of segments is full.  Returns the checkpoint location and fills
+ * in its contents.
+ */
+static XLogRecPtr
+write_wal(CheckPoint *checkpoint)
+{
+	char	   *record = pg_malloc(SizeOfXLogRecord + 5 + Max(sizeof(CheckPoint), opts.wal_record_size));
+	XLogRecPtr	checkpoint_lsn;
+	XLogRecPtr	wal_end;
+	uint32		payload;
+	uint32		total;
+
+	wal_segment = pg_malloc0(opts.wal_segsize);
+	wal_segno = 1;
+	XLogSegNoOffsetToRecPtr(wal_segno, 0, opts.wal_segsize, wal_insert);
+	wal_prev = InvalidXLogRecPtr;
+	wal_start_page(0);
+
+	checkpoint_lsn = wal_insert;
+	checkpoint->redo = checkpoint_lsn;
+	checkpoint->ThisTimeLineID = 1;
+	checkpoint->PrevTimeLineID = 1;
+	checkpoint->fullPageWrites = true;
+#if PG_CONTROL_VERSION >= 1700
+	checkpoint->wal_level = WAL_LEVEL_REPLICA;
+#endif
+	checkpoint->nextXid = FullTransactionIdFromEpochAndXid(0, opts.xid_max + 1);
+	checkpoint->nextOid = FirstNormalObjectId + opts.nrelations;
+	checkpoint->nextMulti = FirstMultiXactId + opts.nmultis;
+	checkpoint->nextMultiOffset = 1 + opts.nmultis;
+	checkpoint->oldestXid = opts.xid_min;
+	checkpoint->oldestXidDB = DATAGEN_DBOID;
+	checkpoint->oldestMulti = FirstMultiXactId;
+	checkpoint->oldestMultiDB = DATAGEN_DBOID;
+	checkpoint->time = (pg_time_t) time(NULL);
+	checkpoint->oldestActiveXid = opts.xid_max + 1;
+	if (opts.commit_ts)
+	{
+		checkpoint->oldestCommitTsXid = opts.xid_min;
+		checkpoint->newestCommitTsXid = opts.xid_max;
+	}
+
+	XLogSegNoOffsetToRecPtr(opts.wal_segments + 1, 0, opts.wal_segsize, wal_end);
+
+	for (payload = sizeof(CheckPoint);; payload = opts.wal_record_size)
+	{
+		XLogRecord *rec = (XLogRecord *) record;
+		char	   *p = record + SizeOfXLogRecord;
+		pg_crc32c	crc;
+
+		if (payload <= UINT8_MAX)
+		{
+			*p++ = (char) XLR_BLOCK_ID_DATA_SHORT;
+			*p++ = (uint8) payload;
+		}
+		else
+		{
+			*p++ = (char) XLR_BLOCK_ID_DATA_LONG;
+			memcpy(p, &payload, sizeof(uint32));
+			p += sizeof(uint32);
+		}
+		if (wal_insert == checkpoint_lsn)
+			memcpy(p, checkpoint, sizeof(CheckPoint));
+		else
+			memset(p, 0, payload);
+		total = (p - record) + payload;
+
+		/* Stop when the record would not fit before the end */
+		if (wal_insert + total + XLOG_BLCKSZ > wal_end)
+			break;
+
+		rec->xl_tot_len = total;
+		rec->xl_xid = InvalidTransactionId;
+		rec->xl_prev = wal_prev;
+		rec->xl_info = (wal_insert == checkpoint_lsn) ? XLOG_CHECKPOINT_ONLINE : XLOG_NOOP;
+		rec->xl_rmid = RM_XLOG_ID;
+		rec->xl_crc = 0;
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, record + SizeOfXLogRecord, total - SizeOfXLogRecord);
+		COMP_CRC32C(crc, record, offsetof(XLogRecord, xl_crc));
+		FIN_CRC32C(crc);
+		rec->xl_crc = crc;
+
+		wal_prev = wal_insert;
+		wal_append(record, total);
+
+		/* Records start MAXALIGNed, and never right at a page boundary */
+		wal_insert = MAXALIGN64(wal_insert);
+		if (wal_insert % XLOG_BLCKSZ == 0)
+			wal_start_page(0);
+	}
+
+	wal_flush_segment();
+	pg_free(wal_segment);
+	pg_free(record);
+
+	return checkpoint_lsn;
+}
+
+
+/*
+ * Copy record bytes at wal_insert, starting continuation pages as needed.
+ */
+static void
+wal_append(const char *data, uint32 len)
+{
+	while (len > 0)
+	{
+		uint32		pageoff = wal_insert % XLOG_BLCKSZ;
+		uint32		chunk;
+
+		if (pageoff == 0)
+		{
+			wal_start_page(len);
+			pageoff = wal_insert % XLOG_BLCKSZ;
+		}
+
+		chunk = Min(len, XLOG_BLCKSZ - pageoff);
+		memcpy(wal_segment + XLogSegmentOffset(wal_insert, opts.wal_segsize),
+			   data, chunk);
+		wal_insert += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+
+/*
+ * Write the page header at wal_insert, which is at a page boundary, moving
+ * to the next segment first if the current one is full.  rem_len is the
+ * part of a record continuing onto this page.
+ */
+static void
+wal_start_page(uint32 rem_len)
+{
+	XLogPageHeader page;
+	uint32		segoff = XLogSegmentOffset(wal_insert, opts.wal_segsize);
+
+	if (segoff == 0)
+	{
+		XLogSegNo	segno;
+
+		XLByteToSeg(wal_insert, segno, opts.wal_segsize);
+		if (segno != wal_segno)
+		{
+			wal_flush_segment();
+			memset(wal_segment, 0, opts.wal_segsize);
+			wal_segno = segno;
+		}
+	}
+
+	page = (XLogPageHeader) (wal_segment + segoff);
+	page->xlp_magic = XLOG_PAGE_MAGIC;
+	page->xlp_info = XLP_BKP_REMOVABLE;
+	page->xlp_tli = 1;
+	page->xlp_pageaddr = wal_insert;
+	page->xlp_rem_len = rem_len;
+	if (rem_len > 0)
+		page->xlp_info |= XLP_FIRST_IS_CONTRECORD;
+
+	if (segoff == 0)
+	{
+		XLogLongPageHeader longpage = (XLogLongPageHeader) page;
+
+		page->xlp_info |= XLP_LONG_HEADER;
+		longpage->xlp_sysid = sysid;
+		longpage->xlp_seg_size = opts.wal_segsize;
+		longpage->xlp_xlog_blcksz = XLOG_BLCKSZ;
+		wal_insert += SizeOfXLogLongPHD;
+	}
+	else
+		wal_insert += SizeOfXLogShortPHD;
+
+	/* Continuation data starts right after the header, MAXALIGNed */
+	wal_insert = MAXALIGN64(wal_insert);
+}
+
+
+static void
+wal_flush_segment(void)
+{
+	char		fname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+
+	XLogFileName(fname, 1, wal_segno, opts.wal_segsize);
+	snprintf(path, sizeof(path), "%s/%s/%s", opts.datadir, XLOGDIR, fname);
+	write_file(path, wal_segment, opts.wal_segsize);
+}
+
+
+static void
+write_control_file(CheckPoint *checkpoint, XLogRecPtr checkpoint_lsn)
+{
+	PgControl  *ctl = pgcontrol_create();
+	char		image[PG_CONTROL_FILE_SIZE];
+	ControlFileData *cf = (ControlFileData *) image;
+
+	memset(image, 0, sizeof(image));
+	cf->system_identifier = sysid;
+	cf->pg_control_version = PG_CONTROL_VERSION;
+	cf->catalog_version_no = CATALOG_VERSION_NO;
+	cf->state = DB_IN_PRODUCTION;
+	cf->time = checkpoint->time;
+	cf->checkPoint = checkpoint_lsn;
+	cf->checkPointCopy = *checkpoint;
+	cf->unloggedLSN = FirstNormalUnloggedLSN;
+	cf->wal_level = WAL_LEVEL_REPLICA;
+	cf->MaxConnections = 100;
+	cf->max_worker_processes = 8;
+	cf->max_wal_senders = 10;
+	cf->max_prepared_xacts = 0;
+	cf->max_locks_per_xact = 64;
+	cf->track_commit_timestamp = opts.commit_ts;
+	cf->maxAlign = MAXIMUM_ALIGNOF;
+	cf->floatFormat = FLOATFORMAT_VALUE;
+	cf->blcksz = BLCKSZ;
+	cf->relseg_size = RELSEG_SIZE;
+	cf->xlog_blcksz = XLOG_BLCKSZ;
+	cf->xlog_seg_size = opts.wal_segsize;
+	cf->nameDataLen = NAMEDATALEN;
+	cf->indexMaxKeys = INDEX_MAX_KEYS;
+	cf->toast_max_chunk_size = TOAST_MAX_CHUNK_SIZE;
+	cf->loblksize = LOBLKSIZE;
+	cf->float8ByVal = FLOAT8PASSBYVAL;
+	cf->data_checksum_version = opts.checksums ? PG_DATA_CHECKSUM_VERSION : 0;
+
+	if (!pgcontrol_parse(ctl, image, sizeof(image)) ||
+		!pgcontrol_write(ctl, opts.datadir, true))
+		pg_fatal("%s", ctl->errmsg);
+	pgcontrol_destroy(ctl);
+}
+
+
+static void
+write_file(const char *path, const char *data, size_t len)
+{
+	int			fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY, 0600)) < 0)
+		pg_fatal("could not create file \"%s\": %m", path);
+	while (len > 0)
+	{
+		ssize_t		rc = write(fd, data, Min(len, 1024 * 1024));
+
+		if (rc <= 0)
+		{
+			if (rc == 0)
+				errno = ENOSPC;
+			pg_fatal("could not write file \"%s\": %m", path);
+		}
+		data += rc;
+		len -= rc;
+	}
+	if (close(fd) != 0)
+		pg_fatal("could not close file \"%s\": %m", path);
+}
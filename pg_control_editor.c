@@ -5,8 +5,6 @@
 
 #define FRONTEND 1
 
-#define PG_CONTROL_FILE_PATH_SIZE		8192
-
 #include "postgres.h"
 
 #include <dirent.h>
@@ -21,35 +19,190 @@
 #include "pg_getopt.h"
 
 #include "common/logging.h"
-#include "common/controldata_utils.h"
 #include "access/xlog_internal.h"
 #include "access/multixact.h"
 
+#include "portability/instr_time.h"
+#include "storage/bufpage.h"
+
+#include "concurrency.h"
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+
 static void usage(void);
-static bool read_controlfile(const char*);
-static void	make_datadir_out_if_not_exists(const char*);
+static void collect_edits(PgControlEdits *edits);
+static void edit_control_buffer(char *buffer, size_t len);
+static void reset_options(void);
+static void parse_options(int argc, char *argv[]);
+static int	run_command(void);
+static int	run_edit(void);
+static int	run_verify(void);
+static int	run_request(int argc, char *argv[]);
+static int	default_jobs(void);
+static int	scan_workers(void);
+static uint64 default_prewarm_budget(void);
 
 static const char *progname;
-static ControlFileData ControlFile; /* pg_control values */
+static PgControl control;		/* pg_control values */
 static char* DataDirOut = NULL;
 static char* DataDirIn = NULL;
-static bool guessed = false;	/* T if we had to guess at any values */
 
 static Oid	set_oid = 0;
 static TransactionId set_xid = 0;
 static MultiXactId set_mxid = 0;
+static MultiXactId set_oldestmxid = 0;
 static MultiXactOffset set_mxoff = (MultiXactOffset) -1;
-static TimeLineID minXlogTli = 0;
 static TransactionId set_oldest_commit_ts_xid = 0;
 static TransactionId set_newest_commit_ts_xid = 0;
 static TransactionId set_oldest_xid = 0;
 static uint32 set_xid_epoch = (uint32) -1;
 static int	set_wal_segsize = 0;
-static int	WalSegSz;
-static XLogSegNo minXlogSegNo = 0;
+static char *log_fname = NULL;
+static char *from_tar = NULL;
+static char *serve_socket = NULL;
+static bool inventory = false;
+static bool watch = false;
+static char *prometheus_textfile = NULL;
+static bool stats_json = false;
+static bool preflight = false;
+static double preflight_deadline = -1;
+static int	scan_jobs = 0;
+static bool verify_wal = false;
+static char *wal_archive = NULL;
+static bool estimate_recovery = false;
+static bool calibrate_recovery = false;
+static char *recovery_model = NULL;
+static bool prewarm = false;
+static int	prewarm_budget_mb = 0;
+static int	set_data_checksums = -1;
+static ScanIO scan_io;			/* how scans read, see scanio.c */
+static bool verify_checksums = false;
+static bool derive = false;
+static bool derive_resume = false;
+static char *derive_state_file = NULL;
+static char *derive_index_file = NULL;
+static double derive_sample = 0;
+static char *output_format = NULL;
+static char **positional_args = NULL;
+static int	num_positional_args = 0;
 
 int
 main(int argc, char *argv[])
+{
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+		{
+			usage();
+			exit(0);
+		}
+	}
+
+	parse_options(argc, argv);
+
+	if (serve_socket != NULL)
+	{
+		if (DataDirIn != NULL || DataDirOut != NULL || from_tar != NULL)
+		{
+			pg_log_error("--serve cannot be combined with other options.");
+			pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+			exit(1);
+		}
+
+		serve(serve_socket, run_request, stats_json);
+		return 0;
+	}
+
+	return run_command();
+}
+
+
+/*
+ * Handle one request of the --serve loop.  This runs in a child forked for
+ * the request, so the usual exit-on-error paths only end that child.
+ */
+static int
+run_request(int argc, char *argv[])
+{
+	/* The server's own options must not leak into the request */
+	reset_options();
+
+	optind = 1;
+#ifdef HAVE_INT_OPTRESET
+	optreset = 1;
+#endif
+	parse_options(argc, argv);
+
+	if (serve_socket != NULL)
+		pg_fatal("--serve is not allowed in a request");
+	/* --watch never returns and the others would read the server's stdin */
+	if (watch)
+		pg_fatal("--watch is not allowed in a request");
+	if (inventory && num_positional_args == 0)
+		pg_fatal("--inventory without data directories is not allowed in a request");
+	if (from_tar != NULL && strcmp(from_tar, "-") == 0)
+		pg_fatal("--from-tar=- is not allowed in a request");
+
+	if (DataDirOut != NULL)
+		serve_lock_directory(DataDirOut);
+
+	return run_command();
+}
+
+
+/*
+ * Put every option back to its default, as it is before parse_options().
+ */
+static void
+reset_options(void)
+{
+	DataDirOut = NULL;
+	DataDirIn = NULL;
+	set_oid = 0;
+	set_xid = 0;
+	set_mxid = 0;
+	set_oldestmxid = 0;
+	set_mxoff = (MultiXactOffset) -1;
+	set_oldest_commit_ts_xid = 0;
+	set_newest_commit_ts_xid = 0;
+	set_oldest_xid = 0;
+	set_xid_epoch = (uint32) -1;
+	set_wal_segsize = 0;
+	log_fname = NULL;
+	from_tar = NULL;
+	serve_socket = NULL;
+	inventory = false;
+	watch = false;
+	prometheus_textfile = NULL;
+	stats_json = false;
+	preflight = false;
+	preflight_deadline = -1;
+	scan_jobs = 0;
+	verify_wal = false;
+	wal_archive = NULL;
+	estimate_recovery = false;
+	calibrate_recovery = false;
+	recovery_model = NULL;
+	prewarm = false;
+	prewarm_budget_mb = 0;
+	set_data_checksums = -1;
+	memset(&scan_io, 0, sizeof(scan_io));
+	verify_checksums = false;
+	derive = false;
+	derive_resume = false;
+	derive_state_file = NULL;
+	derive_index_file = NULL;
+	derive_sample = 0;
+	output_format = NULL;
+	positional_args = NULL;
+	num_positional_args = 0;
+}
+
+
+static void
+parse_options(int argc, char *argv[])
 {
 	int	c;
 	static struct option long_options[] = {
@@ -64,25 +217,39 @@ main(int argc, char *argv[])
 		{"oldest-transaction-id", required_argument, NULL, 'u'},
 		{"next-transaction-id", required_argument, NULL, 'x'},
 		{"wal-segsize", required_argument, NULL, 1},
+		{"from-tar", required_argument, NULL, 2},
+		{"serve", required_argument, NULL, 3},
+		{"inventory", no_argument, NULL, 4},
+		{"format", required_argument, NULL, 5},
+		{"watch", no_argument, NULL, 6},
+		{"prometheus-textfile", required_argument, NULL, 7},
+		{"stats", required_argument, NULL, 8},
+		{"preflight", no_argument, NULL, 9},
+		{"deadline", required_argument, NULL, 10},
+		{"verify-wal", no_argument, NULL, 11},
+		{"wal-archive", required_argument, NULL, 12},
+		{"estimate-recovery", optional_argument, NULL, 13},
+		{"recovery-model", required_argument, NULL, 14},
+		{"prewarm", no_argument, NULL, 15},
+		{"prewarm-budget", required_argument, NULL, 16},
+		{"data-checksums", required_argument, NULL, 17},
+		{"max-io-rate", required_argument, NULL, 18},
+		{"verify-checksums", no_argument, NULL, 19},
+		{"direct-io", no_argument, NULL, 20},
+		{"drop-cache", no_argument, NULL, 21},
+		{"max-iops", required_argument, NULL, 22},
+		{"derive", no_argument, NULL, 23},
+		{"resume", no_argument, NULL, 24},
+		{"state-file", required_argument, NULL, 25},
+		{"index-file", required_argument, NULL, 26},
+		{"sample", required_argument, NULL, 27},
+		{"jobs", required_argument, NULL, 'j'},
 		{NULL, 0, NULL, 0}
 	};
 	char	   *endptr;
 	char	   *endptr2;
-	MultiXactId set_oldestmxid = 0;
-	char	   *log_fname = NULL;
-
-	pg_logging_init(argv[0]);
-	progname = get_progname(argv[0]);
-	if (argc > 1)
-	{
-		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
-		{
-			usage();
-			exit(0);
-		}
-	}
 
-	while ((c = getopt_long(argc, argv, "D:d:o:x:m:O:c:e:l:u:1:", long_options, NULL)) != -1)
+	while ((c = getopt_long(argc, argv, "D:d:o:x:m:O:c:e:l:u:j:1:", long_options, NULL)) != -1)
 	{
 		switch (c)
 		{
@@ -242,6 +409,170 @@ main(int argc, char *argv[])
 					break;
 				}
 
+			case 2:
+				from_tar = pg_strdup(optarg);
+				break;
+
+			case 3:
+				serve_socket = pg_strdup(optarg);
+				break;
+
+			case 4:
+				inventory = true;
+				break;
+
+			case 5:
+				output_format = pg_strdup(optarg);
+				break;
+
+			case 6:
+				watch = true;
+				break;
+
+			case 7:
+				prometheus_textfile = pg_strdup(optarg);
+				break;
+
+			case 8:
+				if (strcmp(optarg, "json") != 0)
+				{
+					pg_log_error("invalid argument for option %s", "--stats");
+					pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+					exit(1);
+				}
+				stats_json = true;
+				break;
+
+			case 9:
+				preflight = true;
+				break;
+
+			case 10:
+				errno = 0;
+				preflight_deadline = strtod(optarg, &endptr);
+				if (endptr == optarg || *endptr != '\0' || errno != 0 ||
+					preflight_deadline < 0)
+				{
+					pg_log_error("invalid argument for option %s", "--deadline");
+					pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+					exit(1);
+				}
+				break;
+
+			case 11:
+				verify_wal = true;
+				break;
+
+			case 12:
+				wal_archive = pg_strdup(optarg);
+				break;
+
+			case 13:
+				estimate_recovery = true;
+				if (optarg != NULL)
+				{
+					if (strcmp(optarg, "calibrate") != 0)
+					{
+						pg_log_error("invalid argument for option %s", "--estimate-recovery");
+						pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+						exit(1);
+					}
+					calibrate_recovery = true;
+				}
+				break;
+
+			case 14:
+				recovery_model = pg_strdup(optarg);
+				break;
+
+			case 15:
+				prewarm = true;
+				break;
+
+			case 16:
+				if (!option_parse_int(optarg, "--prewarm-budget", 1, INT_MAX,
+									  &prewarm_budget_mb))
+					exit(1);
+				break;
+
+			case 17:
+				if (strcmp(optarg, "on") == 0)
+					set_data_checksums = 1;
+				else if (strcmp(optarg, "off") == 0)
+					set_data_checksums = 0;
+				else
+				{
+					pg_log_error("invalid argument for option %s", "--data-checksums");
+					pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+					exit(1);
+				}
+				break;
+
+			case 18:
+				{
+					int			mb;
+
+					if (!option_parse_int(optarg, "--max-io-rate", 1, INT_MAX, &mb))
+						exit(1);
+					scan_io.max_rate = (uint64) mb * 1024 * 1024;
+				}
+				break;
+
+			case 19:
+				verify_checksums = true;
+				break;
+
+			case 20:
+				scan_io.direct = true;
+				break;
+
+			case 21:
+				scan_io.dontneed = true;
+				break;
+
+			case 22:
+				{
+					int			iops;
+
+					if (!option_parse_int(optarg, "--max-iops", 1, INT_MAX, &iops))
+						exit(1);
+					scan_io.max_iops = iops;
+				}
+				break;
+
+			case 23:
+				derive = true;
+				break;
+
+			case 24:
+				derive_resume = true;
+				break;
+
+			case 25:
+				derive_state_file = pg_strdup(optarg);
+				break;
+
+			case 26:
+				derive_index_file = pg_strdup(optarg);
+				break;
+
+			case 27:
+				errno = 0;
+				derive_sample = strtod(optarg, &endptr);
+				if (endptr == optarg || *endptr != '\0' || errno != 0 ||
+					derive_sample <= 0 || derive_sample > 1)
+				{
+					pg_log_error("invalid argument for option %s", "--sample");
+					pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+					exit(1);
+				}
+				break;
+
+			case 'j':
+				if (!option_parse_int(optarg, "-j/--jobs", 1, INT_MAX, &scan_jobs))
+					exit(1);
+				break;
+
 			default:
 				/* getopt_long already emitted a complaint */
 				pg_log_error_hint("Try \"%s --help\" for more information.", progname);
@@ -249,6 +580,17 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* Without -j, scans tune their reads in flight, see scan_workers() */
+	scan_io.adaptive = (scan_jobs == 0);
+
+	/* Data directories to scan in --inventory and --watch mode */
+	if (inventory || watch)
+	{
+		positional_args = &argv[optind];
+		num_positional_args = argc - optind;
+		optind = argc;
+	}
+
 	/* Complain if any arguments remain */
 	if (optind < argc)
 	{
@@ -257,195 +599,409 @@ main(int argc, char *argv[])
 		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
 		exit(1);
 	}
+}
 
-	if (DataDirIn == NULL || DataDirOut == NULL)
+
+/*
+ * Run the mode selected by the parsed options.
+ */
+static int
+run_command(void)
+{
+	scanio_init(&scan_io);
+
+	if (inventory)
 	{
-		pg_log_error("Both input/output data directory should be specified.");
+		if (DataDirIn != NULL || DataDirOut != NULL || from_tar != NULL)
+		{
+			pg_log_error("--inventory cannot be combined with -D, -d or --from-tar.");
+			pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+			exit(1);
+		}
+		return run_inventory(positional_args, num_positional_args,
+							 output_format, stats_json);
+	}
+
+	if (watch)
+	{
+		if (DataDirIn != NULL || DataDirOut != NULL || from_tar != NULL ||
+			output_format != NULL)
+		{
+			pg_log_error("--watch cannot be combined with -D, -d, --from-tar or --format.");
+			pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+			exit(1);
+		}
+		return run_watch(positional_args, num_positional_args,
+						 prometheus_textfile);
+	}
+
+	if (prometheus_textfile != NULL)
+	{
+		pg_log_error("--prometheus-textfile is only valid with --watch.");
 		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
 		exit(1);
 	}
 
-	if (! read_controlfile(DataDirIn))
+	if (preflight_deadline >= 0 && !preflight)
 	{
-		pg_log_error("Could not read control file from the input directory \"%s\"",
-		             DataDirIn);
+		pg_log_error("--deadline is only valid with --preflight.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
 		exit(1);
 	}
 
-	if (set_wal_segsize != 0)
-		WalSegSz = set_wal_segsize;
-	else
-		WalSegSz = ControlFile.xlog_seg_size;
-
-	if (log_fname != NULL)
-		XLogFromFileName(log_fname, &minXlogTli, &minXlogSegNo, WalSegSz);
-
-	if (set_oid != 0)
-		ControlFile.checkPointCopy.nextOid = set_oid;
-
-	if (set_xid != 0)
-		ControlFile.checkPointCopy.nextXid =
-			FullTransactionIdFromEpochAndXid(EpochFromFullTransactionId(ControlFile.checkPointCopy.nextXid),
-											 set_xid);
-	if (set_mxid != 0)
+	if (prewarm_budget_mb > 0 && !prewarm)
 	{
-		ControlFile.checkPointCopy.nextMulti = set_mxid;
-
-		ControlFile.checkPointCopy.oldestMulti = set_oldestmxid;
-		if (ControlFile.checkPointCopy.oldestMulti < FirstMultiXactId)
-			ControlFile.checkPointCopy.oldestMulti += FirstMultiXactId;
-		ControlFile.checkPointCopy.oldestMultiDB = InvalidOid;
+		pg_log_error("--prewarm-budget is only valid with --prewarm.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
 	}
 
-	if (set_mxoff != -1)
-		ControlFile.checkPointCopy.nextMultiOffset = set_mxoff;
-
-	if (minXlogTli > ControlFile.checkPointCopy.ThisTimeLineID)
+	if (output_format != NULL)
 	{
-		ControlFile.checkPointCopy.ThisTimeLineID = minXlogTli;
-		ControlFile.checkPointCopy.PrevTimeLineID = minXlogTli;
+		pg_log_error("--format is only valid with --inventory.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
 	}
 
-	if (set_oldest_commit_ts_xid != 0)
-		ControlFile.checkPointCopy.oldestCommitTsXid = set_oldest_commit_ts_xid;
-	if (set_newest_commit_ts_xid != 0)
-		ControlFile.checkPointCopy.newestCommitTsXid = set_newest_commit_ts_xid;
-
-	if (set_xid_epoch != -1)
-		ControlFile.checkPointCopy.nextXid =
-			FullTransactionIdFromEpochAndXid(set_xid_epoch,
-											 XidFromFullTransactionId(ControlFile.checkPointCopy.nextXid));
+	if (verify_wal || estimate_recovery || derive)
+		return run_verify();
 
-	if (set_oldest_xid != 0)
+	if (derive_resume || derive_state_file != NULL ||
+		derive_index_file != NULL || derive_sample > 0)
 	{
-		ControlFile.checkPointCopy.oldestXid = set_oldest_xid;
-		ControlFile.checkPointCopy.oldestXidDB = InvalidOid;
+		pg_log_error("--resume, --state-file, --index-file and --sample are only valid with --derive.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
 	}
 
-	if (set_wal_segsize != 0)
-		ControlFile.xlog_seg_size = WalSegSz;
+	if (recovery_model != NULL)
+	{
+		pg_log_error("--recovery-model is only valid with --estimate-recovery.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
 
-	make_datadir_out_if_not_exists(DataDirOut);
+	if (wal_archive != NULL)
+	{
+		pg_log_error("--wal-archive is only valid with --verify-wal or --estimate-recovery.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
 
-	update_controlfile(DataDirOut, &ControlFile, false);
-	return 0;
+	return run_edit();
 }
 
 
 /*
- * Try to read the existing pg_control file.
- *
- * This routine is also responsible for updating old pg_control versions
- * to the current format.  (Currently we don't do anything of the sort.)
+ * Perform the edit described by the parsed options.
  */
-static bool
-read_controlfile(const char* pgdata_in)
+static int
+run_edit(void)
 {
-	int			fd;
-	int			len;
-	char	    filepath[PG_CONTROL_FILE_PATH_SIZE] = {0};
-	char	    *buffer;
-	pg_crc32c	crc;
+	PgControlEdits edits;
+	instr_time	start;
+	instr_time	duration;
+	instr_time	manifest_start;
+	instr_time	manifest_duration;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	if (from_tar != NULL)
+	{
+		if (preflight || prewarm || set_data_checksums >= 0 || verify_checksums)
+		{
+			pg_log_error("%s cannot be combined with --from-tar.",
+						 preflight ? "--preflight" :
+						 prewarm ? "--prewarm" :
+						 verify_checksums ? "--verify-checksums" : "--data-checksums");
+			pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+			exit(1);
+		}
+		if (DataDirOut == NULL || DataDirIn != NULL)
+		{
+			pg_log_error("--from-tar requires an output data directory and no input data directory.");
+			pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+			exit(1);
+		}
 
-	snprintf(filepath, PG_CONTROL_FILE_PATH_SIZE - 1, "%s/%s", pgdata_in, XLOG_CONTROL_FILE);
+		extract_tar(from_tar, DataDirOut, edit_control_buffer);
+		update_backup_manifest(NULL, DataDirOut);
+		return 0;
+	}
 
+	if (DataDirIn == NULL || DataDirOut == NULL)
+	{
+		pg_log_error("Both input/output data directory should be specified.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
 
-	if ((fd = open(filepath, O_RDONLY | PG_BINARY, 0)) < 0)
+	if (!pgcontrol_read(&control, DataDirIn))
 	{
-		/*
-		 * If pg_control is not there at all, or we can't read it, the odds
-		 * are we've been handed a bad DataDir path, so give up. User can do
-		 * "touch pg_control" to force us to proceed.
-		 */
-		pg_log_error("could not open file \"%s\" for reading: %m",
-					 XLOG_CONTROL_FILE);
-		if (errno == ENOENT)
+		pg_log_error("%s", control.errmsg);
+		if (control.saved_errno == ENOENT)
 			pg_log_error_hint("If you are sure the data directory path is correct, execute\n"
 							  "  touch %s\n"
 							  "and try again.",
 							  XLOG_CONTROL_FILE);
+		pg_log_error("Could not read control file from the input directory \"%s\"",
+		             DataDirIn);
 		exit(1);
 	}
+	if (!control.crc_ok)
+		pg_log_warning("pg_control exists but has invalid CRC; proceed with caution");
 
-	/* Use malloc to ensure we have a maxaligned buffer */
-	buffer = (char *) pg_malloc(PG_CONTROL_FILE_SIZE);
+	if (set_data_checksums >= 0)
+		check_data_checksums(&control, set_data_checksums == 1);
 
-	len = read(fd, buffer, PG_CONTROL_FILE_SIZE);
-	if (len < 0)
-		pg_fatal("could not read file \"%s\": %m", XLOG_CONTROL_FILE);
-	close(fd);
-
-	if (len >= sizeof(ControlFileData) &&
-		((ControlFileData *) buffer)->pg_control_version == PG_CONTROL_VERSION)
+	/* Refuse to edit a cluster whose pages do not match their checksums */
+	if (verify_checksums)
 	{
-		/* Check the CRC. */
-		INIT_CRC32C(crc);
-		COMP_CRC32C(crc,
-					buffer,
-					offsetof(ControlFileData, crc));
-		FIN_CRC32C(crc);
-
-		if (!EQ_CRC32C(crc, ((ControlFileData *) buffer)->crc))
-		{
-			/* We will use the data but treat it as guessed. */
-			pg_log_warning("pg_control exists but has invalid CRC; proceed with caution");
-			guessed = true;
-		}
+		/* Pages of a running or crashed cluster may be torn or not yet fixed */
+		check_cluster_shut_down(&control, "verify data checksums");
+		if (pgcontrol_get_value(&control, "data_checksum_version") == 0)
+			pg_fatal("data checksums are not enabled in cluster");
+		if (!verify_data_checksums(DataDirOut,
+								   scan_workers(), &scan_io))
+			pg_fatal("data checksum verification failed, control file not changed");
+	}
 
-		memcpy(&ControlFile, buffer, sizeof(ControlFile));
+	collect_edits(&edits);
+	if (!pgcontrol_apply(&control, &edits))
+		pg_fatal("%s", control.errmsg);
 
-		/* return false if WAL segment size is not valid */
-		if (!IsValidWalSegSize(ControlFile.xlog_seg_size))
-		{
-			pg_log_warning(ngettext("pg_control specifies invalid WAL segment size (%d byte); proceed with caution",
-									"pg_control specifies invalid WAL segment size (%d bytes); proceed with caution",
-									ControlFile.xlog_seg_size),
-						   ControlFile.xlog_seg_size);
-			return false;
-		}
-		return true;
+	/* Check the output directory against the edited values, write nothing */
+	if (preflight)
+		return run_preflight(&control, DataDirOut,
+							 preflight_deadline >= 0 ? preflight_deadline : 60,
+							 scan_workers(), &scan_io);
+
+	/*
+	 * Pages get their checksums, and are synced, before pg_control says
+	 * they have them.
+	 */
+	if (set_data_checksums == 1)
+		write_data_checksums(DataDirOut,
+							 scan_workers(), &scan_io);
+
+	if (!pgcontrol_write(&control, DataDirOut, set_data_checksums >= 0))
+		pg_fatal("%s", control.errmsg);
+
+	INSTR_TIME_SET_CURRENT(manifest_start);
+	update_backup_manifest(DataDirIn, DataDirOut);
+	INSTR_TIME_SET_CURRENT(manifest_duration);
+	INSTR_TIME_SUBTRACT(manifest_duration, manifest_start);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	if (serve_stats_slot != NULL)
+		*serve_stats_slot = control.stats;
+
+	if (stats_json)
+	{
+		StringInfoData out;
+
+		initStringInfo(&out);
+		appendStringInfoString(&out, "{\"pgdata_in\": ");
+		append_json_string(&out, DataDirIn);
+		appendStringInfoString(&out, ", \"pgdata_out\": ");
+		append_json_string(&out, DataDirOut);
+		appendStringInfo(&out, ", \"total_ns\": " UINT64_FORMAT
+						 ", \"manifest_ns\": " UINT64_FORMAT ", ",
+						 (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0),
+						 (uint64) (INSTR_TIME_GET_DOUBLE(manifest_duration) * 1000000000.0));
+		stats_append_json(&out, &control.stats);
+		appendStringInfoString(&out, "}\n");
+		fwrite(out.data, 1, out.len, stdout);
+		pfree(out.data);
 	}
 
-	/* Looks like it's a mess. */
-	pg_log_warning("pg_control exists but is broken or wrong version; ignoring it");
-	return false;
+	/* After the edit and outside its timings: pg_control is written by now */
+	if (prewarm)
+		run_prewarm(&control, DataDirOut,
+					scan_jobs > 0 ? scan_jobs : default_jobs(),
+					prewarm_budget_mb > 0 ?
+					(uint64) prewarm_budget_mb * 1024 * 1024 :
+					default_prewarm_budget());
+
+	return 0;
 }
 
 
-static void
-make_datadir_out_if_not_exists(const char* pgdata_out)
+/*
+ * Check or estimate the replay of the WAL of the input data directory from
+ * its redo pointer on.
+ */
+static int
+run_verify(void)
 {
-	char filepath[PG_CONTROL_FILE_PATH_SIZE] = {0};
-	int fd;
+	int			jobs = scan_workers();
+	const char *mode = derive ? "--derive" :
+		verify_wal ? "--verify-wal" : "--estimate-recovery";
 
-	if (mkdir(pgdata_out, 0755)) {
-		if (errno != EEXIST) {
-			pg_log_error("output pgdata \"%s\" doesn't exists and cannot mkdir: %m",
-		                 pgdata_out);
-			exit(1);
-		}
+	if (verify_wal + estimate_recovery + derive > 1)
+	{
+		pg_log_error("--verify-wal, --estimate-recovery and --derive cannot be combined.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
 	}
-
-	snprintf(filepath, PG_CONTROL_FILE_PATH_SIZE - 1, "%s/global", pgdata_out);
-	if (mkdir(filepath, 0755)) {
-		if (errno != EEXIST) {
-			pg_log_error("directory \"%s\" doesn't exists and cannot mkdir: %m",
-			             filepath);
-			exit(1);
-		}
+	if (recovery_model != NULL && !estimate_recovery)
+	{
+		pg_log_error("--recovery-model is only valid with --estimate-recovery.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
+	if (DataDirIn == NULL || DataDirOut != NULL || from_tar != NULL ||
+		preflight)
+	{
+		pg_log_error("%s requires an input data directory and no -d, --from-tar or --preflight.",
+					 mode);
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
+	if ((derive_resume || derive_state_file != NULL ||
+		 derive_index_file != NULL || derive_sample > 0) && !derive)
+	{
+		pg_log_error("--resume, --state-file, --index-file and --sample are only valid with --derive.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
+	if (derive_sample > 0 &&
+		(derive_resume || derive_state_file != NULL || derive_index_file != NULL))
+	{
+		pg_log_error("--sample cannot be combined with --resume, --state-file or --index-file.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
+	}
+	if (wal_archive != NULL && derive)
+	{
+		pg_log_error("--wal-archive is only valid with --verify-wal or --estimate-recovery.");
+		pg_log_error_hint("Try \"%s --help\" for more information.", progname);
+		exit(1);
 	}
 
-	snprintf(filepath, PG_CONTROL_FILE_PATH_SIZE - 1, "%s/%s",
-	         pgdata_out, XLOG_CONTROL_FILE);
-	if ((fd = open(filepath, O_EXCL | O_CREAT, 0644)) == -1) {
-		if (errno != EEXIST) {
-			pg_log_error("file \"%s\" doesn't exists and cannot create: %m",
-			             filepath);
-			exit(1);
-		}
-	} else {
-		close(fd);
+	if (!pgcontrol_read(&control, DataDirIn))
+		pg_fatal("%s", control.errmsg);
+	if (!control.crc_ok)
+		pg_log_warning("pg_control exists but has invalid CRC; proceed with caution");
+
+	if (derive)
+	{
+		char	   *datadir = pg_strdup(DataDirIn);
+		char	   *state_file = derive_state_file;
+		char	   *index_file = derive_index_file;
+
+		/* Next to the data directory, not in it */
+		canonicalize_path(datadir);
+		if (state_file == NULL)
+			state_file = psprintf("%s.derive-state", datadir);
+		if (index_file == NULL)
+			index_file = psprintf("%s.derive-index", datadir);
+		return run_derive(&control, DataDirIn, state_file, derive_resume,
+						  index_file, derive_sample, jobs, &scan_io);
 	}
+	if (estimate_recovery)
+		return run_estimate_recovery(&control, DataDirIn, wal_archive, jobs,
+									 &scan_io, calibrate_recovery,
+									 recovery_model);
+	return run_verify_wal(&control, DataDirIn, wal_archive, jobs, &scan_io);
+}
+
+
+/*
+ * One worker per CPU we may use: the cgroup's cpu.max if it has one, else
+ * the online CPUs.
+ */
+static int
+default_jobs(void)
+{
+	long		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int			limit = cgroup_cpu_limit();
+
+	if (limit > 0 && (ncpus <= 0 || limit < ncpus))
+		return limit;
+	return ncpus > 0 ? (int) ncpus : 1;
+}
+
+
+/*
+ * Worker threads for the scans that honour scan_io.  Without -j, reads in
+ * flight are tuned as the scan runs (scan_io.adaptive) and threads started
+ * as they are needed, up to a bound that leaves room for I/O-bound devices
+ * to want more reads in flight than there are CPUs.
+ */
+static int
+scan_workers(void)
+{
+	if (scan_jobs > 0)
+		return scan_jobs;
+	return default_jobs() * 4;
+}
+
+
+/*
+ * Page cache --prewarm may fill when --prewarm-budget is not given: a
+ * quarter of physical memory, leaving the rest to the server.
+ */
+static uint64
+default_prewarm_budget(void)
+{
+	long		pages = sysconf(_SC_PHYS_PAGES);
+	long		pagesize = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || pagesize <= 0)
+		return (uint64) 1024 * 1024 * 1024;
+	return (uint64) pages * pagesize / 4;
+}
+
+
+/*
+ * Gather the values given on the command line.
+ */
+static void
+collect_edits(PgControlEdits *edits)
+{
+	pgcontrol_edits_init(edits);
+
+	edits->next_oid = set_oid;
+	edits->next_xid = set_xid;
+	edits->next_multi = set_mxid;
+	edits->oldest_multi = set_oldestmxid;
+	edits->next_multi_offset = set_mxoff;
+	edits->oldest_commit_ts_xid = set_oldest_commit_ts_xid;
+	edits->newest_commit_ts_xid = set_newest_commit_ts_xid;
+	edits->oldest_xid = set_oldest_xid;
+	edits->xid_epoch = set_xid_epoch;
+	edits->wal_segsize = set_wal_segsize;
+	edits->next_wal_file = log_fname;
+	if (set_data_checksums >= 0)
+		edits->data_checksum_version = set_data_checksums ? PG_DATA_CHECKSUM_VERSION : 0;
+}
+
+
+/*
+ * Edit a pg_control image in place.
+ *
+ * Used by the tar extractor: buffer holds len bytes of the archived
+ * pg_control and must have room for PG_CONTROL_FILE_SIZE bytes, which is
+ * what the caller writes out afterwards.
+ */
+static void
+edit_control_buffer(char *buffer, size_t len)
+{
+	PgControlEdits edits;
+
+	if (!pgcontrol_parse(&control, buffer, len))
+		pg_fatal("control file in the archive is unusable: %s", control.errmsg);
+	if (!control.crc_ok)
+		pg_log_warning("pg_control exists but has invalid CRC; proceed with caution");
+
+	collect_edits(&edits);
+	if (!pgcontrol_apply(&control, &edits))
+		pg_fatal("%s", control.errmsg);
+
+	pgcontrol_serialize(&control, buffer);
 }
 
 
@@ -456,7 +1012,67 @@ usage(void)
 	printf(_("Usage:\n"));
 	printf(_(" -D, --pgdata-in=DATADIR   input data directory\n"));
 	printf(_(" -d, --pgdata-out=DATADIR  output data directory\n"));
+	printf(_("     --from-tar=FILE       extract a base backup tar (\"-\" for stdin) into\n"
+			 "                           the output data directory instead of reading -D\n"));
+	printf(_("     --serve=SOCKET        accept edit requests on a Unix-domain socket\n"));
+	printf(_("     --stats=json          print per-phase timings of the edit as JSON\n"
+			 "                           (with --serve: latency histograms on SIGUSR1)\n"));
+	printf(_("     --preflight           check that the server would start on the output\n"
+			 "                           data directory with the edited values, and exit\n"
+			 "                           without writing (1 = a check failed, 2 = some\n"
+			 "                           checks did not finish before the deadline)\n"));
+	printf(_("     --deadline=SECONDS    time limit for --preflight (default 60, 0 = none)\n"));
+	printf(_("     --data-checksums=on|off\n"
+			 "                           enable or disable data checksums, writing the\n"
+			 "                           checksum of every page of the output directory\n"));
+	printf(_("     --verify-checksums    verify the checksum of every page of the output\n"
+			 "                           directory first, and fail the edit on a mismatch\n"));
+	printf(_("     --direct-io           read relation files and WAL in scans with O_DIRECT\n"));
+	printf(_("     --drop-cache          drop what scans read from the page cache\n"));
+	printf(_("     --max-io-rate=MB      limit scans to MB per second of I/O\n"));
+	printf(_("     --max-iops=NUM        limit scans to NUM reads and writes per second\n"));
+	printf(_("     --prewarm             after writing, read the WAL from the redo pointer\n"
+			 "                           and the blocks its records touch into the page cache\n"));
+	printf(_("     --prewarm-budget=MB   page cache --prewarm may fill (default: a quarter\n"
+			 "                           of physical memory)\n"));
+	printf(_(" -j, --jobs=NUM            workers for scans; relation file scans run this\n"
+			 "                           many per device (default: adapt to the observed\n"
+			 "                           read latency, within the cgroup's CPU limit)\n"));
 	printf(_(" -?, --help                show this help, then exit\n"));
+	printf(_("\nInventory mode:\n"));
+	printf(_("  %s --inventory [--format=csv|ndjson] [DATADIR...]\n"), progname);
+	printf(_("                           print every pg_control field of each data directory\n"
+			 "                           (names or glob patterns, one per line on stdin if\n"
+			 "                           none are given); with --stats=json, a summary\n"
+			 "                           of per-directory read latency goes to stderr\n"));
+	printf(_("\nWatch mode:\n"));
+	printf(_("  %s --watch [--prometheus-textfile=FILE] DATADIR...\n"), progname);
+	printf(_("                           print changed fields and XID/multixact rates as\n"
+			 "                           NDJSON whenever a server rewrites pg_control\n"));
+	printf(_("\nWAL verification mode:\n"));
+	printf(_("  %s --verify-wal -D DATADIR [--wal-archive=DIR] [-j NUM]\n"), progname);
+	printf(_("                           check that the WAL from the redo pointer to its\n"
+			 "                           end is contiguous and valid, reading segments\n"
+			 "                           missing from pg_wal from the archive\n"));
+	printf(_("\nRecovery estimate mode:\n"));
+	printf(_("  %s --estimate-recovery[=calibrate] -D DATADIR [--recovery-model=FILE]\n"), progname);
+	printf(_("                           predict crash recovery time from the WAL mix\n"
+			 "                           between redo and its end; with calibrate, measure\n"
+			 "                           this host's I/O and copy costs into FILE instead\n"));
+	printf(_("\nDerive mode:\n"));
+	printf(_("  %s --derive -D DATADIR [--resume] [--state-file=FILE] [--index-file=FILE]\n"), progname);
+	printf(_("                           scan the heap and the WAL for the newest XID,\n"
+			 "                           multixact, OID and LSN in use and print the -x,\n"
+			 "                           -m, -o and -l values past them; progress is kept\n"
+			 "                           in the state file (default: DATADIR.derive-state)\n"
+			 "                           so that an interrupted scan can be continued with\n"
+			 "                           --resume, and files unchanged since the last run\n"
+			 "                           are taken from the index (default:\n"
+			 "                           DATADIR.derive-index)\n"));
+	printf(_("  %s --derive --sample=FRACTION -D DATADIR\n"), progname);
+	printf(_("                           read FRACTION of every relation's blocks, biased\n"
+			 "                           toward its end, and the tail of pg_wal, and print\n"
+			 "                           estimated maxima with a 99%% bound and margin\n"));
 	printf(_("\nOptions to override control file values:\n"));
 	printf(_("  -c, --commit-timestamp-ids=XID,XID\n"
 			 "                                   set oldest and newest transactions bearing\n"
@@ -0,0 +1,104 @@
+/*
+ * pg_control_editor.h
+ *	  Declarations shared between the pg_control_editor source files.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef PG_CONTROL_EDITOR_H
+#define PG_CONTROL_EDITOR_H
+
+#include "lib/stringinfo.h"
+#include "pgcontrol.h"
+#include "scanio.h"
+
+/* SLRU geometry, from slru.h, clog.c, commit_ts.c and multixact.c */
+#define SLRU_PAGES_PER_SEGMENT	32
+#define CLOG_XACTS_PER_PAGE		(BLCKSZ * 4)
+#define COMMIT_TS_ENTRY_SIZE	(sizeof(TimestampTz) + sizeof(RepOriginId))
+#define COMMIT_TS_XACTS_PER_PAGE	(BLCKSZ / COMMIT_TS_ENTRY_SIZE)
+#define MULTIXACT_OFFSETS_PER_PAGE	(BLCKSZ / sizeof(MultiXactOffset))
+#define MULTIXACT_MEMBERS_PER_GROUP	4
+#define MULTIXACT_GROUP_SIZE	(MULTIXACT_MEMBERS_PER_GROUP * (1 + sizeof(TransactionId)))
+#define MULTIXACT_MEMBERS_PER_PAGE	((BLCKSZ / MULTIXACT_GROUP_SIZE) * MULTIXACT_MEMBERS_PER_GROUP)
+
+/* log2 buckets of nanoseconds; bucket i holds values below 2^i */
+#define LATENCY_BUCKETS		65
+
+typedef struct LatencyHistogram
+{
+	uint64		counts[LATENCY_BUCKETS];
+	uint64		count;
+	uint64		sum_ns;
+	uint64		max_ns;
+} LatencyHistogram;
+
+/*
+ * Callback used to rewrite pg_control while it passes through a copy path.
+ * The buffer holds len bytes of the original file and has room for
+ * PG_CONTROL_FILE_SIZE bytes, all of which are written out afterwards.
+ */
+typedef void (*control_edit_hook) (char *buffer, size_t len);
+
+/* Runs one --serve request; returns the exit status */
+typedef int (*request_handler) (int argc, char *argv[]);
+
+/* checksums.c */
+extern void check_cluster_shut_down(const PgControl *ctl, const char *what);
+extern void check_data_checksums(const PgControl *ctl, bool enable);
+extern void write_data_checksums(const char *datadir, int jobs, ScanIO *io);
+extern bool verify_data_checksums(const char *datadir, int jobs, ScanIO *io);
+
+/* derive.c */
+extern int	run_derive(const PgControl *ctl, const char *datadir,
+					   const char *state_file, bool resume,
+					   const char *index_file, double sample, int jobs,
+					   ScanIO *io);
+
+/* estimate_recovery.c */
+extern int	run_estimate_recovery(const PgControl *ctl, const char *datadir,
+								  const char *archive, int jobs, ScanIO *io,
+								  bool calibrate_only, const char *model_path);
+
+/* inventory.c */
+extern int	run_inventory(char **datadirs, int ndatadirs, const char *format,
+						  bool stats);
+extern void append_json_string(StringInfo out, const char *value);
+
+/* prewarm.c */
+extern void run_prewarm(const PgControl *ctl, const char *datadir, int jobs,
+						uint64 budget);
+
+/* preflight.c */
+extern int	run_preflight(const PgControl *ctl, const char *datadir,
+						  double deadline, int jobs, ScanIO *io);
+
+/* verify_wal.c */
+extern int	run_verify_wal(const PgControl *ctl, const char *datadir,
+						   const char *archive, int jobs, ScanIO *io);
+
+/* manifest.c */
+extern void update_backup_manifest(const char *pgdata_in,
+								   const char *pgdata_out);
+
+/* serve.c */
+extern PgControlStats *serve_stats_slot;
+extern void serve(const char *socket_path, request_handler handler,
+				  bool collect_stats);
+extern void serve_lock_directory(const char *datadir);
+
+/* stats.c */
+extern void stats_append_json(StringInfo out, const PgControlStats *stats);
+extern void histogram_add(LatencyHistogram *hist, uint64 ns);
+extern void histogram_merge(LatencyHistogram *into,
+							const LatencyHistogram *from);
+extern void histogram_append_json(StringInfo out, const char *name,
+								  const LatencyHistogram *hist);
+
+/* tar_extract.c */
+extern void extract_tar(const char *tarfile, const char *pgdata_out,
+						control_edit_hook edit_control);
+
+/* watch.c */
+extern int	run_watch(char **datadirs, int ndatadirs, const char *textfile);
+
+#endif							/* PG_CONTROL_EDITOR_H */
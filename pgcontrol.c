@@ -0,0 +1,487 @@
+/*
+ * pgcontrol.c
+ *	  Reentrant read/modify/write of pg_control, the core of
+ *	  pg_control_editor, also built as libpgcontrol.
+ *
+ * Nothing in here logs or exits; failures are described in ctl->errmsg.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access/multixact.h"
+#include "access/transam.h"
+#include "access/xlog_internal.h"
+#include "portability/instr_time.h"
+
+#include "pgcontrol.h"
+#include "pgcontrol_probes.h"
+
+const char *const pgcontrol_phase_names[PGCONTROL_NUM_PHASES] = {
+	"open", "read", "validate", "apply", "mkdir", "write", "fsync", "close"
+};
+
+/* Time one step and charge it, and one call, to a phase of ctl->stats */
+#define PHASE_BEGIN(start) INSTR_TIME_SET_CURRENT(start)
+#define PHASE_END(ctl, phase, start) phase_end(&(ctl)->stats, (phase), &(start))
+
+static bool pgcontrol_error(PgControl *ctl, const char *fmt,...) pg_attribute_printf(2, 3);
+static bool pgcontrol_syserror(PgControl *ctl, const char *fmt,...) pg_attribute_printf(2, 3);
+static bool parse_image(PgControl *ctl, const char *buffer, size_t len);
+static bool apply_edits(PgControl *ctl, const PgControlEdits *edits);
+static bool make_directory(PgControl *ctl, const char *path);
+static uint64 field_get(const PgControl *ctl, const char *name);
+static void field_set(PgControl *ctl, const char *name, uint64 value);
+static void phase_end(PgControlStats *stats, PgControlPhase phase,
+					  instr_time *start);
+
+
+PgControl *
+pgcontrol_create(void)
+{
+	return (PgControl *) calloc(1, sizeof(PgControl));
+}
+
+
+void
+pgcontrol_destroy(PgControl *ctl)
+{
+	free(ctl);
+}
+
+
+void
+pgcontrol_edits_init(PgControlEdits *edits)
+{
+	memset(edits, 0, sizeof(PgControlEdits));
+	edits->next_multi_offset = (MultiXactOffset) -1;
+	edits->xid_epoch = (uint32) -1;
+	edits->data_checksum_version = -1;
+}
+
+
+void
+pgcontrol_stats_reset(PgControl *ctl)
+{
+	memset(&ctl->stats, 0, sizeof(PgControlStats));
+}
+
+
+/*
+ * Read and validate datadir/global/pg_control.
+ */
+bool
+pgcontrol_read(PgControl *ctl, const char *datadir)
+{
+	char		path[MAXPGPATH];
+	char		buffer[PG_CONTROL_FILE_SIZE];
+	int			fd;
+	ssize_t		len;
+	instr_time	start;
+	bool		result;
+
+	snprintf(path, sizeof(path), "%s/%s", datadir, XLOG_CONTROL_FILE);
+	PGCONTROL_PROBE1(read__start, path);
+
+	PHASE_BEGIN(start);
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	PHASE_END(ctl, PGCONTROL_PHASE_OPEN, start);
+	if (fd < 0)
+	{
+		PGCONTROL_PROBE3(read__done, path, -1, 0);
+		return pgcontrol_syserror(ctl, "could not open file \"%s\" for reading: %m",
+								  path);
+	}
+
+	PHASE_BEGIN(start);
+	len = read(fd, buffer, PG_CONTROL_FILE_SIZE);
+	PHASE_END(ctl, PGCONTROL_PHASE_READ, start);
+	PGCONTROL_PROBE3(read__done, path, len, len >= 0);
+	if (len < 0)
+	{
+		pgcontrol_syserror(ctl, "could not read file \"%s\": %m", path);
+		close(fd);
+		return false;
+	}
+	ctl->stats.bytes_read += len;
+
+	PHASE_BEGIN(start);
+	close(fd);
+	PHASE_END(ctl, PGCONTROL_PHASE_CLOSE, start);
+
+	PHASE_BEGIN(start);
+	result = pgcontrol_parse(ctl, buffer, len);
+	PHASE_END(ctl, PGCONTROL_PHASE_VALIDATE, start);
+
+	return result;
+}
+
+
+/*
+ * Validate a pg_control image of any supported version and load it.
+ *
+ * A CRC mismatch is not an error: the data is used but ctl->crc_ok is
+ * cleared so the caller can warn.
+ */
+bool
+pgcontrol_parse(PgControl *ctl, const char *buffer, size_t len)
+{
+	bool		result;
+
+	PGCONTROL_PROBE1(validate__start, len);
+	result = parse_image(ctl, buffer, len);
+	PGCONTROL_PROBE3(validate__done,
+					 ctl->layout != NULL ? ctl->layout->version : 0,
+					 ctl->crc_ok, result);
+
+	return result;
+}
+
+
+static bool
+parse_image(PgControl *ctl, const char *buffer, size_t len)
+{
+	uint32		version;
+	uint32		segsize;
+	pg_crc32c	crc;
+	pg_crc32c	stored;
+
+	ctl->layout = NULL;
+	ctl->crc_ok = false;
+
+	if (len < offsetof(ControlFileData, pg_control_version) + sizeof(uint32))
+		return pgcontrol_error(ctl, "pg_control exists but is broken or wrong version");
+
+	/* The version sits at the same offset in every layout */
+	memcpy(&version, buffer + offsetof(ControlFileData, pg_control_version),
+		   sizeof(version));
+	ctl->layout = pgcontrol_find_layout(version);
+	if (ctl->layout == NULL || len < ctl->layout->size)
+		return pgcontrol_error(ctl, "pg_control exists but is broken or wrong version");
+	ctl->native = (version == PG_CONTROL_VERSION);
+
+	/* Copy first; buffer need not be suitably aligned */
+	memset(ctl->image, 0, PG_CONTROL_FILE_SIZE);
+	memcpy(ctl->image, buffer, ctl->layout->size);
+	if (ctl->native)
+		memcpy(&ctl->data, ctl->image, sizeof(ControlFileData));
+	else
+		memset(&ctl->data, 0, sizeof(ControlFileData));
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, ctl->image, ctl->layout->crc_offset);
+	FIN_CRC32C(crc);
+	memcpy(&stored, ctl->image + ctl->layout->crc_offset, sizeof(stored));
+	ctl->crc_ok = EQ_CRC32C(crc, stored);
+
+	segsize = (uint32) field_get(ctl, "xlog_seg_size");
+	if (!IsValidWalSegSize(segsize))
+		return pgcontrol_error(ctl, "pg_control specifies invalid WAL segment size (%u bytes)",
+							   segsize);
+
+	ctl->wal_segsize = segsize;
+	return true;
+}
+
+
+/*
+ * Apply the overrides in edits.  Works through the layout table so files
+ * of other server versions are edited the same way.
+ */
+bool
+pgcontrol_apply(PgControl *ctl, const PgControlEdits *edits)
+{
+	instr_time	start;
+	bool		result;
+
+	PHASE_BEGIN(start);
+	result = apply_edits(ctl, edits);
+	PHASE_END(ctl, PGCONTROL_PHASE_APPLY, start);
+
+	return result;
+}
+
+
+static bool
+apply_edits(PgControl *ctl, const PgControlEdits *edits)
+{
+	uint64		next_xid;
+
+	if (edits->wal_segsize != 0)
+	{
+		if (!IsValidWalSegSize(edits->wal_segsize))
+			return pgcontrol_error(ctl, "invalid WAL segment size %d",
+								   edits->wal_segsize);
+		ctl->wal_segsize = edits->wal_segsize;
+	}
+	else
+		ctl->wal_segsize = (int) field_get(ctl, "xlog_seg_size");
+
+	ctl->min_tli = 0;
+	ctl->min_segno = 0;
+	if (edits->next_wal_file != NULL)
+	{
+		if (strspn(edits->next_wal_file, "01234567890ABCDEFabcdef") != XLOG_FNAME_LEN ||
+			edits->next_wal_file[XLOG_FNAME_LEN] != '\0')
+			return pgcontrol_error(ctl, "invalid WAL file name \"%s\"",
+								   edits->next_wal_file);
+		XLogFromFileName(edits->next_wal_file, &ctl->min_tli, &ctl->min_segno,
+						 ctl->wal_segsize);
+	}
+
+	if (edits->next_oid != 0)
+		field_set(ctl, "checkPointCopy.nextOid", edits->next_oid);
+
+	/* FullTransactionId: epoch in the high half, xid in the low half */
+	if (edits->next_xid != 0)
+	{
+		next_xid = field_get(ctl, "checkPointCopy.nextXid");
+		field_set(ctl, "checkPointCopy.nextXid",
+				  (next_xid & UINT64CONST(0xFFFFFFFF00000000)) | edits->next_xid);
+	}
+
+	if (edits->next_multi != 0)
+	{
+		MultiXactId oldest = edits->oldest_multi;
+
+		field_set(ctl, "checkPointCopy.nextMulti", edits->next_multi);
+
+		if (oldest < FirstMultiXactId)
+			oldest += FirstMultiXactId;
+		field_set(ctl, "checkPointCopy.oldestMulti", oldest);
+		field_set(ctl, "checkPointCopy.oldestMultiDB", InvalidOid);
+	}
+
+	if (edits->next_multi_offset != (MultiXactOffset) -1)
+		field_set(ctl, "checkPointCopy.nextMultiOffset", edits->next_multi_offset);
+
+	if (ctl->min_tli > field_get(ctl, "checkPointCopy.ThisTimeLineID"))
+	{
+		field_set(ctl, "checkPointCopy.ThisTimeLineID", ctl->min_tli);
+		field_set(ctl, "checkPointCopy.PrevTimeLineID", ctl->min_tli);
+	}
+
+	if (edits->oldest_commit_ts_xid != 0)
+		field_set(ctl, "checkPointCopy.oldestCommitTsXid", edits->oldest_commit_ts_xid);
+	if (edits->newest_commit_ts_xid != 0)
+		field_set(ctl, "checkPointCopy.newestCommitTsXid", edits->newest_commit_ts_xid);
+
+	if (edits->xid_epoch != (uint32) -1)
+	{
+		next_xid = field_get(ctl, "checkPointCopy.nextXid");
+		field_set(ctl, "checkPointCopy.nextXid",
+				  ((uint64) edits->xid_epoch << 32) | (uint32) next_xid);
+	}
+
+	if (edits->oldest_xid != 0)
+	{
+		field_set(ctl, "checkPointCopy.oldestXid", edits->oldest_xid);
+		field_set(ctl, "checkPointCopy.oldestXidDB", InvalidOid);
+	}
+
+	if (edits->wal_segsize != 0)
+		field_set(ctl, "xlog_seg_size", ctl->wal_segsize);
+
+	if (edits->data_checksum_version >= 0)
+		field_set(ctl, "data_checksum_version", edits->data_checksum_version);
+
+	if (ctl->native)
+		memcpy(&ctl->data, ctl->image, sizeof(ControlFileData));
+
+	return true;
+}
+
+
+/*
+ * Produce the on-disk image, PG_CONTROL_FILE_SIZE bytes with a fresh CRC,
+ * exactly as update_controlfile() would write it.
+ */
+void
+pgcontrol_serialize(PgControl *ctl, char *buffer)
+{
+	pg_crc32c	crc;
+
+	/* Changes made directly to ctl->data win over the image */
+	if (ctl->native)
+		memcpy(ctl->image, &ctl->data, sizeof(ControlFileData));
+
+	/* Like update_controlfile(), stamp the time of the write */
+	pgcontrol_set_field(ctl, pgcontrol_find_field(ctl->layout, "time"),
+						(uint64) time(NULL));
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, ctl->image, ctl->layout->crc_offset);
+	FIN_CRC32C(crc);
+	memcpy(ctl->image + ctl->layout->crc_offset, &crc, sizeof(crc));
+	if (ctl->native)
+		memcpy(&ctl->data, ctl->image, sizeof(ControlFileData));
+
+	memset(buffer, 0, PG_CONTROL_FILE_SIZE);
+	memcpy(buffer, ctl->image, ctl->layout->size);
+}
+
+
+/*
+ * Field access by name for the fields every layout has.
+ */
+static uint64
+field_get(const PgControl *ctl, const char *name)
+{
+	const PgControlField *field = pgcontrol_find_field(ctl->layout, name);
+
+	Assert(field != NULL);
+	return pgcontrol_get_field(ctl, field);
+}
+
+
+static void
+field_set(PgControl *ctl, const char *name, uint64 value)
+{
+	const PgControlField *field = pgcontrol_find_field(ctl->layout, name);
+
+	Assert(field != NULL);
+	PGCONTROL_PROBE3(override, name, pgcontrol_get_field(ctl, field), value);
+	pgcontrol_set_field(ctl, field, value);
+}
+
+
+/*
+ * Write the edited image to datadir/global/pg_control, creating datadir and
+ * datadir/global if they do not exist yet.
+ */
+bool
+pgcontrol_write(PgControl *ctl, const char *datadir, bool do_sync)
+{
+	char		path[MAXPGPATH];
+	char		buffer[PG_CONTROL_FILE_SIZE];
+	int			fd;
+	ssize_t		rc;
+	instr_time	start;
+
+	if (!make_directory(ctl, datadir))
+		return false;
+	snprintf(path, sizeof(path), "%s/global", datadir);
+	if (!make_directory(ctl, path))
+		return false;
+
+	pgcontrol_serialize(ctl, buffer);
+
+	snprintf(path, sizeof(path), "%s/%s", datadir, XLOG_CONTROL_FILE);
+	PHASE_BEGIN(start);
+	fd = open(path, O_WRONLY | O_CREAT | PG_BINARY, 0644);
+	PHASE_END(ctl, PGCONTROL_PHASE_OPEN, start);
+	if (fd < 0)
+		return pgcontrol_syserror(ctl, "could not open file \"%s\": %m", path);
+
+	errno = 0;
+	PGCONTROL_PROBE2(write__start, path, PG_CONTROL_FILE_SIZE);
+	PHASE_BEGIN(start);
+	rc = write(fd, buffer, PG_CONTROL_FILE_SIZE);
+	PHASE_END(ctl, PGCONTROL_PHASE_WRITE, start);
+	PGCONTROL_PROBE3(write__done, path, rc, rc == PG_CONTROL_FILE_SIZE);
+	if (rc != PG_CONTROL_FILE_SIZE)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		pgcontrol_syserror(ctl, "could not write file \"%s\": %m", path);
+		close(fd);
+		return false;
+	}
+	ctl->stats.bytes_written += rc;
+
+	if (do_sync)
+	{
+		PGCONTROL_PROBE1(fsync__start, path);
+		PHASE_BEGIN(start);
+		rc = fsync(fd);
+		PHASE_END(ctl, PGCONTROL_PHASE_FSYNC, start);
+		PGCONTROL_PROBE2(fsync__done, path, rc == 0);
+		if (rc != 0)
+		{
+			pgcontrol_syserror(ctl, "could not fsync file \"%s\": %m", path);
+			close(fd);
+			return false;
+		}
+	}
+
+	PHASE_BEGIN(start);
+	rc = close(fd);
+	PHASE_END(ctl, PGCONTROL_PHASE_CLOSE, start);
+	if (rc != 0)
+		return pgcontrol_syserror(ctl, "could not close file \"%s\": %m", path);
+
+	return true;
+}
+
+
+static bool
+make_directory(PgControl *ctl, const char *path)
+{
+	instr_time	start;
+	int			rc;
+
+	PGCONTROL_PROBE1(mkdir__start, path);
+	PHASE_BEGIN(start);
+	rc = mkdir(path, 0755);
+	PHASE_END(ctl, PGCONTROL_PHASE_MKDIR, start);
+	PGCONTROL_PROBE2(mkdir__done, path, rc == 0 || errno == EEXIST);
+	if (rc != 0 && errno != EEXIST)
+		return pgcontrol_syserror(ctl, "could not create directory \"%s\": %m", path);
+	return true;
+}
+
+
+static void
+phase_end(PgControlStats *stats, PgControlPhase phase, instr_time *start)
+{
+	instr_time	duration;
+	int			save_errno = errno;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, *start);
+	stats->phase_ns[phase] += (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0);
+	stats->phase_calls[phase]++;
+	errno = save_errno;
+}
+
+
+/*
+ * Record an error in ctl and return false.
+ */
+static bool
+pgcontrol_error(PgControl *ctl, const char *fmt,...)
+{
+	va_list		args;
+
+	ctl->saved_errno = 0;
+	va_start(args, fmt);
+	vsnprintf(ctl->errmsg, sizeof(ctl->errmsg), fmt, args);
+	va_end(args);
+	return false;
+}
+
+
+/*
+ * Likewise for a failed system call; errno is kept for %m and the caller.
+ */
+static bool
+pgcontrol_syserror(PgControl *ctl, const char *fmt,...)
+{
+	va_list		args;
+
+	ctl->saved_errno = errno;
+	va_start(args, fmt);
+	vsnprintf(ctl->errmsg, sizeof(ctl->errmsg), fmt, args);
+	va_end(args);
+	errno = ctl->saved_errno;
+	return false;
+}
@@ -0,0 +1,147 @@
+/*
+ * pgcontrol.h
+ *	  Reentrant read/modify/write API for pg_control (libpgcontrol).
+ *
+ * All state lives in the PgControl handle and errors are reported through
+ * its errmsg instead of terminating the process, so independent handles
+ * may be used concurrently from different threads.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef PGCONTROL_H
+#define PGCONTROL_H
+
+#include "access/xlogdefs.h"
+#include "catalog/pg_control.h"
+
+#define PGCONTROL_ERRMSG_LEN	512
+
+typedef enum PgControlFieldType
+{
+	PGCF_BOOL,
+	PGCF_INT32,
+	PGCF_UINT32,
+	PGCF_UINT64,
+	PGCF_INT64,
+	PGCF_LSN,
+	PGCF_FXID,					/* FullTransactionId, shown as epoch:xid */
+	PGCF_DOUBLE,
+	PGCF_BYTES
+} PgControlFieldType;
+
+/* Where one ControlFileData member lives in a given on-disk version */
+typedef struct PgControlField
+{
+	const char *name;			/* member path, e.g. "checkPointCopy.nextOid" */
+	PgControlFieldType type;
+	uint32		offset;
+	uint32		size;
+} PgControlField;
+
+typedef struct PgControlLayout
+{
+	uint32		version;		/* pg_control_version */
+	const char *releases;		/* server releases using it */
+	uint32		size;			/* sizeof(ControlFileData) */
+	uint32		crc_offset;
+	const PgControlField *fields;
+	int			nfields;
+} PgControlLayout;
+
+/*
+ * Values to override.  pgcontrol_edits_init() sets every field to its
+ * "leave unchanged" value, which matches the defaults of the command-line
+ * options.
+ */
+typedef struct PgControlEdits
+{
+	Oid			next_oid;		/* 0 = unchanged */
+	TransactionId next_xid;		/* 0 = unchanged */
+	MultiXactId next_multi;		/* 0 = unchanged */
+	MultiXactId oldest_multi;	/* applied together with next_multi */
+	MultiXactOffset next_multi_offset;	/* -1 = unchanged */
+	TransactionId oldest_commit_ts_xid; /* 0 = unchanged */
+	TransactionId newest_commit_ts_xid; /* 0 = unchanged */
+	TransactionId oldest_xid;	/* 0 = unchanged */
+	uint32		xid_epoch;		/* -1 = unchanged */
+	int			wal_segsize;	/* in bytes, 0 = unchanged */
+	const char *next_wal_file;	/* NULL = unchanged */
+	int			data_checksum_version;	/* -1 = unchanged */
+} PgControlEdits;
+
+/* Steps of a read/modify/write, timed separately in PgControlStats */
+typedef enum PgControlPhase
+{
+	PGCONTROL_PHASE_OPEN,
+	PGCONTROL_PHASE_READ,
+	PGCONTROL_PHASE_VALIDATE,
+	PGCONTROL_PHASE_APPLY,
+	PGCONTROL_PHASE_MKDIR,
+	PGCONTROL_PHASE_WRITE,
+	PGCONTROL_PHASE_FSYNC,
+	PGCONTROL_PHASE_CLOSE
+} PgControlPhase;
+
+#define PGCONTROL_NUM_PHASES	(PGCONTROL_PHASE_CLOSE + 1)
+
+/*
+ * Accumulated since the handle was created or pgcontrol_stats_reset().
+ * For the phases that are a single system call, phase_calls counts those
+ * calls.
+ */
+typedef struct PgControlStats
+{
+	uint64		phase_ns[PGCONTROL_NUM_PHASES];
+	uint32		phase_calls[PGCONTROL_NUM_PHASES];
+	uint64		bytes_read;
+	uint64		bytes_written;
+} PgControlStats;
+
+extern const char *const pgcontrol_phase_names[PGCONTROL_NUM_PHASES];
+
+/*
+ * image always holds the file as read, in the layout of its own version;
+ * edits are made there.  data mirrors it only when the file has the
+ * version we were compiled against (native is true).
+ */
+typedef struct PgControl
+{
+	ControlFileData data;		/* pg_control values, if native */
+	char		image[PG_CONTROL_FILE_SIZE];
+	const PgControlLayout *layout;
+	bool		native;
+	bool		crc_ok;			/* false if the CRC did not match on read */
+	int			wal_segsize;	/* segment size in effect after apply */
+	TimeLineID	min_tli;		/* from next_wal_file, else 0 */
+	XLogSegNo	min_segno;		/* from next_wal_file, else 0 */
+	int			saved_errno;	/* errno of the failed system call, or 0 */
+	PgControlStats stats;
+	char		errmsg[PGCONTROL_ERRMSG_LEN];
+} PgControl;
+
+extern PgControl *pgcontrol_create(void);
+extern void pgcontrol_destroy(PgControl *ctl);
+extern void pgcontrol_edits_init(PgControlEdits *edits);
+extern void pgcontrol_stats_reset(PgControl *ctl);
+
+extern bool pgcontrol_read(PgControl *ctl, const char *datadir);
+extern bool pgcontrol_parse(PgControl *ctl, const char *buffer, size_t len);
+extern bool pgcontrol_apply(PgControl *ctl, const PgControlEdits *edits);
+extern void pgcontrol_serialize(PgControl *ctl, char *buffer);
+extern bool pgcontrol_write(PgControl *ctl, const char *datadir, bool do_sync);
+
+/* pgcontrol_layout.c */
+extern const PgControlLayout *pgcontrol_find_layout(uint32 version);
+extern const PgControlLayout *pgcontrol_get_layout(int index);
+extern const PgControlField *pgcontrol_find_field(const PgControlLayout *layout,
+												  const char *name);
+extern uint64 pgcontrol_get_field(const PgControl *ctl,
+								  const PgControlField *field);
+extern uint64 pgcontrol_get_value(const PgControl *ctl, const char *name);
+extern void pgcontrol_set_field(PgControl *ctl, const PgControlField *field,
+								uint64 value);
+extern void pgcontrol_format_field(const PgControl *ctl,
+								   const PgControlField *field,
+								   char *buf, size_t len);
+
+#endif							/* PGCONTROL_H */
@@ -0,0 +1,395 @@
+/*
+ * pgcontrol_layout.c
+ *	  Field-offset descriptions of pg_control for every supported on-disk
+ *	  version, so one build can edit control files of PostgreSQL 12 to 17.
+ *
+ * Each version's ControlFileData is mirrored below as it appears in that
+ * release's catalog/pg_control.h, and the descriptor tables are derived
+ * from the mirrors with offsetof(), so the compiler lays them out exactly
+ * as the server did on this platform.  The mirror of the version we are
+ * compiled against is checked against the real struct at build time.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include "access/transam.h"
+
+#include "pgcontrol.h"
+
+/* PostgreSQL 12 through 16 */
+typedef struct CheckPointV1201
+{
+	XLogRecPtr	redo;
+	TimeLineID	ThisTimeLineID;
+	TimeLineID	PrevTimeLineID;
+	bool		fullPageWrites;
+	FullTransactionId nextXid;
+	Oid			nextOid;
+	MultiXactId nextMulti;
+	MultiXactOffset nextMultiOffset;
+	TransactionId oldestXid;
+	Oid			oldestXidDB;
+	MultiXactId oldestMulti;
+	Oid			oldestMultiDB;
+	pg_time_t	time;
+	TransactionId oldestCommitTsXid;
+	TransactionId newestCommitTsXid;
+	TransactionId oldestActiveXid;
+} CheckPointV1201;
+
+/* PostgreSQL 17 added wal_level to the checkpoint record */
+typedef struct CheckPointV1700
+{
+	XLogRecPtr	redo;
+	TimeLineID	ThisTimeLineID;
+	TimeLineID	PrevTimeLineID;
+	bool		fullPageWrites;
+	int			wal_level;
+	FullTransactionId nextXid;
+	Oid			nextOid;
+	MultiXactId nextMulti;
+	MultiXactOffset nextMultiOffset;
+	TransactionId oldestXid;
+	Oid			oldestXidDB;
+	MultiXactId oldestMulti;
+	Oid			oldestMultiDB;
+	pg_time_t	time;
+	TransactionId oldestCommitTsXid;
+	TransactionId newestCommitTsXid;
+	TransactionId oldestActiveXid;
+} CheckPointV1700;
+
+#define CONTROL_FILE_HEAD(checkpoint_type) \
+	uint64		system_identifier; \
+	uint32		pg_control_version; \
+	uint32		catalog_version_no; \
+	DBState		state; \
+	pg_time_t	time; \
+	XLogRecPtr	checkPoint; \
+	checkpoint_type checkPointCopy; \
+	XLogRecPtr	unloggedLSN; \
+	XLogRecPtr	minRecoveryPoint; \
+	TimeLineID	minRecoveryPointTLI; \
+	XLogRecPtr	backupStartPoint; \
+	XLogRecPtr	backupEndPoint; \
+	bool		backupEndRequired; \
+	int			wal_level; \
+	bool		wal_log_hints; \
+	int			MaxConnections; \
+	int			max_worker_processes; \
+	int			max_wal_senders; \
+	int			max_prepared_xacts; \
+	int			max_locks_per_xact; \
+	bool		track_commit_timestamp; \
+	uint32		maxAlign; \
+	double		floatFormat; \
+	uint32		blcksz; \
+	uint32		relseg_size; \
+	uint32		xlog_blcksz; \
+	uint32		xlog_seg_size; \
+	uint32		nameDataLen; \
+	uint32		indexMaxKeys; \
+	uint32		toast_max_chunk_size; \
+	uint32		loblksize;
+
+#define CONTROL_FILE_TAIL \
+	bool		float8ByVal; \
+	uint32		data_checksum_version; \
+	char		mock_authentication_nonce[MOCK_AUTH_NONCE_LEN]; \
+	pg_crc32c	crc;
+
+/* PostgreSQL 12: float4ByVal still present */
+typedef struct ControlFileDataV1201
+{
+	CONTROL_FILE_HEAD(CheckPointV1201)
+	bool		float4ByVal;
+	CONTROL_FILE_TAIL
+} ControlFileDataV1201;
+
+/* PostgreSQL 13 to 16 */
+typedef struct ControlFileDataV1300
+{
+	CONTROL_FILE_HEAD(CheckPointV1201)
+	CONTROL_FILE_TAIL
+} ControlFileDataV1300;
+
+/* PostgreSQL 17 */
+typedef struct ControlFileDataV1700
+{
+	CONTROL_FILE_HEAD(CheckPointV1700)
+	CONTROL_FILE_TAIL
+} ControlFileDataV1700;
+
+#if PG_CONTROL_VERSION == 1201
+#define NATIVE_LAYOUT ControlFileDataV1201
+#elif PG_CONTROL_VERSION == 1300
+#define NATIVE_LAYOUT ControlFileDataV1300
+#elif PG_CONTROL_VERSION == 1700
+#define NATIVE_LAYOUT ControlFileDataV1700
+#else
+#error "pg_control layout of this PostgreSQL version is not described in pgcontrol_layout.c"
+#endif
+
+StaticAssertDecl(sizeof(NATIVE_LAYOUT) == sizeof(ControlFileData),
+				 "mirrored ControlFileData size does not match");
+StaticAssertDecl(offsetof(NATIVE_LAYOUT, crc) == offsetof(ControlFileData, crc),
+				 "mirrored ControlFileData crc offset does not match");
+StaticAssertDecl(offsetof(NATIVE_LAYOUT, checkPointCopy.nextXid) ==
+				 offsetof(ControlFileData, checkPointCopy.nextXid),
+				 "mirrored CheckPoint layout does not match");
+StaticAssertDecl(offsetof(NATIVE_LAYOUT, data_checksum_version) ==
+				 offsetof(ControlFileData, data_checksum_version),
+				 "mirrored ControlFileData layout does not match");
+
+#define FIELD(s, member, type) \
+	{#member, type, offsetof(s, member), sizeof(((s *) 0)->member)}
+
+#define HEAD_FIELDS(s) \
+	FIELD(s, system_identifier, PGCF_UINT64), \
+	FIELD(s, pg_control_version, PGCF_UINT32), \
+	FIELD(s, catalog_version_no, PGCF_UINT32), \
+	FIELD(s, state, PGCF_INT32), \
+	FIELD(s, time, PGCF_INT64), \
+	FIELD(s, checkPoint, PGCF_LSN), \
+	FIELD(s, checkPointCopy.redo, PGCF_LSN), \
+	FIELD(s, checkPointCopy.ThisTimeLineID, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.PrevTimeLineID, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.fullPageWrites, PGCF_BOOL)
+
+#define CHECKPOINT_FIELDS(s) \
+	FIELD(s, checkPointCopy.nextXid, PGCF_FXID), \
+	FIELD(s, checkPointCopy.nextOid, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.nextMulti, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.nextMultiOffset, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.oldestXid, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.oldestXidDB, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.oldestMulti, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.oldestMultiDB, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.time, PGCF_INT64), \
+	FIELD(s, checkPointCopy.oldestCommitTsXid, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.newestCommitTsXid, PGCF_UINT32), \
+	FIELD(s, checkPointCopy.oldestActiveXid, PGCF_UINT32), \
+	FIELD(s, unloggedLSN, PGCF_LSN), \
+	FIELD(s, minRecoveryPoint, PGCF_LSN), \
+	FIELD(s, minRecoveryPointTLI, PGCF_UINT32), \
+	FIELD(s, backupStartPoint, PGCF_LSN), \
+	FIELD(s, backupEndPoint, PGCF_LSN), \
+	FIELD(s, backupEndRequired, PGCF_BOOL), \
+	FIELD(s, wal_level, PGCF_INT32), \
+	FIELD(s, wal_log_hints, PGCF_BOOL), \
+	FIELD(s, MaxConnections, PGCF_INT32), \
+	FIELD(s, max_worker_processes, PGCF_INT32), \
+	FIELD(s, max_wal_senders, PGCF_INT32), \
+	FIELD(s, max_prepared_xacts, PGCF_INT32), \
+	FIELD(s, max_locks_per_xact, PGCF_INT32), \
+	FIELD(s, track_commit_timestamp, PGCF_BOOL), \
+	FIELD(s, maxAlign, PGCF_UINT32), \
+	FIELD(s, floatFormat, PGCF_DOUBLE), \
+	FIELD(s, blcksz, PGCF_UINT32), \
+	FIELD(s, relseg_size, PGCF_UINT32), \
+	FIELD(s, xlog_blcksz, PGCF_UINT32), \
+	FIELD(s, xlog_seg_size, PGCF_UINT32), \
+	FIELD(s, nameDataLen, PGCF_UINT32), \
+	FIELD(s, indexMaxKeys, PGCF_UINT32), \
+	FIELD(s, toast_max_chunk_size, PGCF_UINT32), \
+	FIELD(s, loblksize, PGCF_UINT32)
+
+#define TAIL_FIELDS(s) \
+	FIELD(s, float8ByVal, PGCF_BOOL), \
+	FIELD(s, data_checksum_version, PGCF_UINT32), \
+	FIELD(s, mock_authentication_nonce, PGCF_BYTES), \
+	FIELD(s, crc, PGCF_UINT32)
+
+static const PgControlField fields_v1201[] = {
+	HEAD_FIELDS(ControlFileDataV1201),
+	CHECKPOINT_FIELDS(ControlFileDataV1201),
+	FIELD(ControlFileDataV1201, float4ByVal, PGCF_BOOL),
+	TAIL_FIELDS(ControlFileDataV1201)
+};
+
+static const PgControlField fields_v1300[] = {
+	HEAD_FIELDS(ControlFileDataV1300),
+	CHECKPOINT_FIELDS(ControlFileDataV1300),
+	TAIL_FIELDS(ControlFileDataV1300)
+};
+
+static const PgControlField fields_v1700[] = {
+	HEAD_FIELDS(ControlFileDataV1700),
+	FIELD(ControlFileDataV1700, checkPointCopy.wal_level, PGCF_INT32),
+	CHECKPOINT_FIELDS(ControlFileDataV1700),
+	TAIL_FIELDS(ControlFileDataV1700)
+};
+
+#define LAYOUT(version, releases, s, fields) \
+	{version, releases, sizeof(s), offsetof(s, crc), fields, lengthof(fields)}
+
+static const PgControlLayout layouts[] = {
+	LAYOUT(1201, "12", ControlFileDataV1201, fields_v1201),
+	LAYOUT(1300, "13-16", ControlFileDataV1300, fields_v1300),
+	LAYOUT(1700, "17", ControlFileDataV1700, fields_v1700),
+};
+
+
+const PgControlLayout *
+pgcontrol_find_layout(uint32 version)
+{
+	int			i;
+
+	for (i = 0; i < lengthof(layouts); i++)
+	{
+		if (layouts[i].version == version)
+			return &layouts[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * Enumerate the known layouts, oldest first; NULL past the end.
+ */
+const PgControlLayout *
+pgcontrol_get_layout(int index)
+{
+	if (index < 0 || index >= lengthof(layouts))
+		return NULL;
+	return &layouts[index];
+}
+
+
+const PgControlField *
+pgcontrol_find_field(const PgControlLayout *layout, const char *name)
+{
+	int			i;
+
+	for (i = 0; i < layout->nfields; i++)
+	{
+		if (strcmp(layout->fields[i].name, name) == 0)
+			return &layout->fields[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * Fetch an integer-valued field from the raw image, zero-extended to 64
+ * bits.  Not meaningful for PGCF_DOUBLE and PGCF_BYTES.
+ */
+uint64
+pgcontrol_get_field(const PgControl *ctl, const PgControlField *field)
+{
+	const char *p = ctl->image + field->offset;
+
+	switch (field->size)
+	{
+		case 1:
+			return (uint8) *p;
+		case 4:
+			{
+				uint32		v;
+
+				memcpy(&v, p, sizeof(v));
+				return v;
+			}
+		case 8:
+			{
+				uint64		v;
+
+				memcpy(&v, p, sizeof(v));
+				return v;
+			}
+	}
+	return 0;
+}
+
+
+/*
+ * pgcontrol_get_field() by name; 0 if the layout has no such field.
+ */
+uint64
+pgcontrol_get_value(const PgControl *ctl, const char *name)
+{
+	const PgControlField *field = pgcontrol_find_field(ctl->layout, name);
+
+	return field != NULL ? pgcontrol_get_field(ctl, field) : 0;
+}
+
+
+void
+pgcontrol_set_field(PgControl *ctl, const PgControlField *field, uint64 value)
+{
+	char	   *p = ctl->image + field->offset;
+
+	switch (field->size)
+	{
+		case 1:
+			*p = (char) value;
+			break;
+		case 4:
+			{
+				uint32		v = (uint32) value;
+
+				memcpy(p, &v, sizeof(v));
+				break;
+			}
+		case 8:
+			memcpy(p, &value, sizeof(value));
+			break;
+	}
+}
+
+
+/*
+ * Render a field the way pg_controldata would show its value.
+ */
+void
+pgcontrol_format_field(const PgControl *ctl, const PgControlField *field,
+					   char *buf, size_t len)
+{
+	uint64		v = pgcontrol_get_field(ctl, field);
+
+	switch (field->type)
+	{
+		case PGCF_BOOL:
+			snprintf(buf, len, "%s", v ? "on" : "off");
+			break;
+		case PGCF_INT32:
+			snprintf(buf, len, "%d", (int32) v);
+			break;
+		case PGCF_UINT32:
+			snprintf(buf, len, "%u", (uint32) v);
+			break;
+		case PGCF_UINT64:
+			snprintf(buf, len, UINT64_FORMAT, v);
+			break;
+		case PGCF_INT64:
+			snprintf(buf, len, INT64_FORMAT, (int64) v);
+			break;
+		case PGCF_LSN:
+			snprintf(buf, len, "%X/%X", (uint32) (v >> 32), (uint32) v);
+			break;
+		case PGCF_FXID:
+			snprintf(buf, len, "%u:%u", (uint32) (v >> 32), (uint32) v);
+			break;
+		case PGCF_DOUBLE:
+			{
+				double		d;
+
+				memcpy(&d, ctl->image + field->offset, sizeof(d));
+				snprintf(buf, len, "%g", d);
+				break;
+			}
+		case PGCF_BYTES:
+			{
+				int			i;
+
+				for (i = 0; i < field->size && (i + 1) * 2 < len; i++)
+					snprintf(buf + i * 2, len - i * 2, "%02x",
+							 (unsigned char) ctl->image[field->offset + i]);
+				break;
+			}
+	}
+}
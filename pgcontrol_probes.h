@@ -0,0 +1,40 @@
+/*
+ * pgcontrol_probes.h
+ *	  USDT static tracepoints of the pg_control read/validate/write path.
+ *
+ * Built in with "make USE_SDT=1" (needs <sys/sdt.h>, e.g. from
+ * systemtap-sdt-dev); otherwise they compile to nothing.  An unattached
+ * probe is a single nop.  Probes, all under provider pg_control_editor:
+ *
+ *	read__start(path)			read__done(path, bytes, ok)
+ *	validate__start(bytes)		validate__done(version, crc_ok, ok)
+ *	override(field, old, new)	one per field changed by pgcontrol_apply()
+ *	mkdir__start(path)			mkdir__done(path, ok)
+ *	write__start(path, bytes)	write__done(path, bytes, ok)
+ *	fsync__start(path)			fsync__done(path, ok)
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef PGCONTROL_PROBES_H
+#define PGCONTROL_PROBES_H
+
+#ifdef USE_SDT
+
+#include <sys/sdt.h>
+
+#define PGCONTROL_PROBE1(name, a) \
+	DTRACE_PROBE1(pg_control_editor, name, a)
+#define PGCONTROL_PROBE2(name, a, b) \
+	DTRACE_PROBE2(pg_control_editor, name, a, b)
+#define PGCONTROL_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(pg_control_editor, name, a, b, c)
+
+#else
+
+#define PGCONTROL_PROBE1(name, a) ((void) 0)
+#define PGCONTROL_PROBE2(name, a, b) ((void) 0)
+#define PGCONTROL_PROBE3(name, a, b, c) ((void) 0)
+
+#endif							/* USE_SDT */
+
+#endif							/* PGCONTROL_PROBES_H */
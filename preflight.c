@@ -0,0 +1,525 @@
+/*
+ * preflight.c
+ *	  Check that the server will start on a data directory with an edited
+ *	  pg_control, without writing it (--preflight).
+ *
+ * The checks are the ones a pg_resetwal-style edit never makes:
+ *
+ *	- the record at checkPoint exists, passes its CRC and is a checkpoint
+ *	  whose redo pointer matches checkPointCopy.redo;
+ *	- the pg_xact, pg_multixact and pg_commit_ts pages that startup will
+ *	  read for the new counters exist;
+ *	- no relation page has an LSN past the start of the new WAL, which
+ *	  would make every later flush of that page fail;
+ *	- every WAL segment has the size xlog_seg_size says.
+ *
+ * Each check runs in its own thread, the page scan with --jobs workers of
+ * its own.  When the deadline passes, whatever has not finished is
+ * reported as unchecked, with its progress, and the rest is not waited for.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access/rmgr.h"
+#include "access/xlog_internal.h"
+#include "storage/bufpage.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+#include "relscan.h"
+#include "walreader.h"
+
+typedef enum PreflightStatus
+{
+	PREFLIGHT_RUNNING,
+	PREFLIGHT_PASSED,
+	PREFLIGHT_FAILED
+} PreflightStatus;
+
+typedef struct PreflightCheck PreflightCheck;
+
+struct PreflightCheck
+{
+	const char *name;
+	void		(*run) (PreflightCheck *check);
+	PreflightStatus status;		/* protected by preflight_lock */
+	char		detail[512];
+	pthread_t	thread;
+};
+
+/* Shared by all checks; read-only once they start */
+static const PgControl *pf_control;
+static const char *pf_datadir;
+static int	pf_jobs;
+static ScanIO *pf_io;
+
+static pthread_mutex_t preflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preflight_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * The page LSN scan, so its progress can be reported at the deadline.
+ * The main thread looks at it only once lsn_scan_running is set, as
+ * relscan_collect() resets it; once deadline_passed is set, the scan is
+ * not started any more.  Both flags are protected by preflight_lock.
+ */
+static RelScan lsn_scan;
+static bool lsn_scan_running = false;
+static bool deadline_passed = false;
+static XLogRecPtr lsn_limit;
+static XLogRecPtr *lsn_max;		/* per worker */
+static uint64 *lsn_bad_pages;	/* per worker */
+
+static void check_checkpoint_record(PreflightCheck *check);
+static void check_slru_segments(PreflightCheck *check);
+static void check_page_lsns(PreflightCheck *check);
+static void check_wal_segment_size(PreflightCheck *check);
+static bool check_slru_page(PreflightCheck *check, const char *dir,
+							int64 pageno, const char *what);
+static bool lsn_page(RelScan *scan, int worker, const RelFile *file,
+					 BlockNumber blkno, char *page);
+static void *preflight_thread(void *arg);
+static void check_finish(PreflightCheck *check, PreflightStatus status,
+						 const char *fmt,...) pg_attribute_printf(3, 4);
+
+static PreflightCheck checks[] = {
+	{"checkpoint record", check_checkpoint_record},
+	{"SLRU segments", check_slru_segments},
+	{"page LSNs", check_page_lsns},
+	{"WAL segment size", check_wal_segment_size},
+};
+
+
+/*
+ * Run all checks against datadir as if ctl were its pg_control, waiting at
+ * most deadline seconds (no limit if zero).  Returns the exit status: 1 if
+ * a check failed, 2 if none failed but some were left unchecked, else 0.
+ */
+int
+run_preflight(const PgControl *ctl, const char *datadir, double deadline,
+			  int jobs, ScanIO *io)
+{
+	struct timespec until;
+	int			i;
+	int			nfailed = 0;
+	int			nunchecked = 0;
+
+	pf_control = ctl;
+	pf_datadir = datadir;
+	pf_jobs = jobs;
+	pf_io = io;
+
+	memset(&lsn_scan, 0, sizeof(lsn_scan));
+	pthread_mutex_init(&lsn_scan.lock, NULL);
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += (time_t) deadline;
+	until.tv_nsec += (long) ((deadline - (time_t) deadline) * 1000000000.0);
+	if (until.tv_nsec >= 1000000000L)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	for (i = 0; i < lengthof(checks); i++)
+	{
+		int			rc;
+
+		checks[i].status = PREFLIGHT_RUNNING;
+		if ((rc = pthread_create(&checks[i].thread, NULL, preflight_thread,
+								 &checks[i])) != 0)
+		{
+			errno = rc;
+			pg_fatal("could not create thread: %m");
+		}
+	}
+
+	pthread_mutex_lock(&preflight_lock);
+	for (;;)
+	{
+		bool		running = false;
+
+		for (i = 0; i < lengthof(checks); i++)
+		{
+			if (checks[i].status == PREFLIGHT_RUNNING)
+				running = true;
+		}
+		if (!running)
+			break;
+		if (deadline <= 0)
+			pthread_cond_wait(&preflight_done, &preflight_lock);
+		else if (pthread_cond_timedwait(&preflight_done, &preflight_lock,
+										&until) == ETIMEDOUT)
+			break;
+	}
+
+	/* Tell a still running page scan to give up, but do not wait for it */
+	deadline_passed = true;
+	if (lsn_scan_running)
+		lsn_scan.cancel = true;
+
+	for (i = 0; i < lengthof(checks); i++)
+	{
+		PreflightCheck *check = &checks[i];
+
+		switch (check->status)
+		{
+			case PREFLIGHT_PASSED:
+				printf("%-20s ok         %s\n", check->name, check->detail);
+				break;
+			case PREFLIGHT_FAILED:
+				printf("%-20s FAILED     %s\n", check->name, check->detail);
+				nfailed++;
+				break;
+			case PREFLIGHT_RUNNING:
+				{
+					uint64		done = 0;
+					uint64		total = 0;
+
+					if (check->run == check_page_lsns && lsn_scan_running)
+						relscan_progress(&lsn_scan, &done, &total);
+					if (total > 0)
+						printf("%-20s unchecked  deadline reached after " UINT64_FORMAT
+							   " of " UINT64_FORMAT " blocks\n", check->name,
+							   done, total);
+					else
+						printf("%-20s unchecked  deadline reached\n", check->name);
+					nunchecked++;
+					break;
+				}
+		}
+	}
+	pthread_mutex_unlock(&preflight_lock);
+
+	if (fflush(stdout) != 0)
+		pg_fatal("could not write output: %m");
+
+	if (nfailed > 0)
+		return 1;
+	return nunchecked > 0 ? 2 : 0;
+}
+
+
+static void *
+preflight_thread(void *arg)
+{
+	PreflightCheck *check = (PreflightCheck *) arg;
+
+	check->run(check);
+	return NULL;
+}
+
+
+static void
+check_checkpoint_record(PreflightCheck *check)
+{
+	XLogRecPtr	checkpoint = pgcontrol_get_value(pf_control, "checkPoint");
+	XLogRecPtr	redo = pgcontrol_get_value(pf_control, "checkPointCopy.redo");
+	TimeLineID	tli = pgcontrol_get_value(pf_control, "checkPointCopy.ThisTimeLineID");
+	WalReader	reader;
+	XLogRecord *record;
+	XLogRecPtr	record_redo;
+	uint8		info;
+
+	walreader_init(&reader, pf_datadir, NULL, pf_control->wal_segsize, tli);
+	if (walreader_read_record(&reader, checkpoint) != WAL_READ_OK)
+	{
+		check_finish(check, PREFLIGHT_FAILED, "%s", reader.errmsg);
+		walreader_close(&reader);
+		return;
+	}
+
+	record = (XLogRecord *) reader.record;
+	info = record->xl_info & ~XLR_INFO_MASK;
+	if (record->xl_rmid != RM_XLOG_ID ||
+		(info != XLOG_CHECKPOINT_SHUTDOWN && info != XLOG_CHECKPOINT_ONLINE))
+	{
+		check_finish(check, PREFLIGHT_FAILED,
+					 "record at %X/%X is not a checkpoint (rmgr %u, info %02X)",
+					 LSN_FORMAT_ARGS(checkpoint), record->xl_rmid, info);
+		walreader_close(&reader);
+		return;
+	}
+
+	/*
+	 * The main data, a CheckPoint starting with redo, follows a short data
+	 * header; checkpoint records carry no block references.
+	 */
+	if (record->xl_tot_len < SizeOfXLogRecord + SizeOfXLogRecordDataHeaderShort + sizeof(XLogRecPtr) ||
+		(uint8) reader.record[SizeOfXLogRecord] != XLR_BLOCK_ID_DATA_SHORT)
+	{
+		check_finish(check, PREFLIGHT_FAILED,
+					 "checkpoint record at %X/%X has unexpected contents",
+					 LSN_FORMAT_ARGS(checkpoint));
+		walreader_close(&reader);
+		return;
+	}
+	memcpy(&record_redo,
+		   reader.record + SizeOfXLogRecord + SizeOfXLogRecordDataHeaderShort,
+		   sizeof(XLogRecPtr));
+	walreader_close(&reader);
+
+	if (record_redo != redo)
+		check_finish(check, PREFLIGHT_FAILED,
+					 "checkpoint record at %X/%X has redo %X/%X, pg_control has %X/%X",
+					 LSN_FORMAT_ARGS(checkpoint), LSN_FORMAT_ARGS(record_redo),
+					 LSN_FORMAT_ARGS(redo));
+	else
+		check_finish(check, PREFLIGHT_PASSED, "%s checkpoint at %X/%X, redo %X/%X",
+					 info == XLOG_CHECKPOINT_SHUTDOWN ? "shutdown" : "online",
+					 LSN_FORMAT_ARGS(checkpoint), LSN_FORMAT_ARGS(redo));
+}
+
+
+/*
+ * Startup reads, rather than zeroes, the SLRU page holding the next XID,
+ * multixact and member offset unless that ID is the first on its page
+ * (see TrimCLOG() and TrimMultiXact()), so that page must exist.
+ */
+static void
+check_slru_segments(PreflightCheck *check)
+{
+	TransactionId next_xid = (TransactionId) pgcontrol_get_value(pf_control, "checkPointCopy.nextXid");
+	MultiXactId next_multi = pgcontrol_get_value(pf_control, "checkPointCopy.nextMulti");
+	MultiXactOffset next_offset = pgcontrol_get_value(pf_control, "checkPointCopy.nextMultiOffset");
+	TransactionId newest_commit_ts = pgcontrol_get_value(pf_control, "checkPointCopy.newestCommitTsXid");
+
+	if (next_xid % CLOG_XACTS_PER_PAGE != 0 &&
+		!check_slru_page(check, "pg_xact", next_xid / CLOG_XACTS_PER_PAGE,
+						 "next transaction ID"))
+		return;
+	if (next_multi % MULTIXACT_OFFSETS_PER_PAGE != 0 &&
+		!check_slru_page(check, "pg_multixact/offsets",
+						 next_multi / MULTIXACT_OFFSETS_PER_PAGE,
+						 "next multitransaction ID"))
+		return;
+	if (next_offset % MULTIXACT_MEMBERS_PER_PAGE != 0 &&
+		!check_slru_page(check, "pg_multixact/members",
+						 next_offset / MULTIXACT_MEMBERS_PER_PAGE,
+						 "next multitransaction offset"))
+		return;
+	if (pgcontrol_get_value(pf_control, "track_commit_timestamp") &&
+		TransactionIdIsNormal(newest_commit_ts) &&
+		!check_slru_page(check, "pg_commit_ts",
+						 newest_commit_ts / COMMIT_TS_XACTS_PER_PAGE,
+						 "newest commit timestamp XID"))
+		return;
+
+	check_finish(check, PREFLIGHT_PASSED,
+				 "pages for next XID %u, multixact %u and offset %u present",
+				 next_xid, next_multi, next_offset);
+}
+
+
+static bool
+check_slru_page(PreflightCheck *check, const char *dir, int64 pageno,
+				const char *what)
+{
+	char		path[MAXPGPATH];
+	struct stat st;
+	int64		segno = pageno / SLRU_PAGES_PER_SEGMENT;
+	off_t		needed = (off_t) (pageno % SLRU_PAGES_PER_SEGMENT + 1) * BLCKSZ;
+
+	snprintf(path, sizeof(path), "%s/%s/%04X", pf_datadir, dir, (unsigned int) segno);
+	if (stat(path, &st) != 0)
+	{
+		check_finish(check, PREFLIGHT_FAILED,
+					 "segment \"%s\" for the %s is missing: %m", path, what);
+		return false;
+	}
+	if (st.st_size < needed)
+	{
+		check_finish(check, PREFLIGHT_FAILED,
+					 "segment \"%s\" for the %s ends before page " INT64_FORMAT,
+					 path, what, pageno);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * The new WAL starts at the checkpoint, or at the segment given with -l if
+ * that is later.
+ */
+static void
+check_page_lsns(PreflightCheck *check)
+{
+	XLogRecPtr	max = InvalidXLogRecPtr;
+	uint64		bad_pages = 0;
+	int			nworkers;
+	int			i;
+
+	lsn_limit = pgcontrol_get_value(pf_control, "checkPoint");
+	if (pf_control->min_segno != 0)
+	{
+		XLogRecPtr	min_start;
+
+		XLogSegNoOffsetToRecPtr(pf_control->min_segno, 0,
+								pf_control->wal_segsize, min_start);
+		lsn_limit = Max(lsn_limit, min_start);
+	}
+
+	/* relscan_collect() sets up the scan run_preflight() prepared afresh */
+	relscan_free(&lsn_scan);
+	if (!relscan_collect(&lsn_scan, pf_datadir, false))
+	{
+		check_finish(check, PREFLIGHT_FAILED, "%s", lsn_scan.errmsg);
+		return;
+	}
+
+	lsn_scan.nworkers = pf_jobs;
+	lsn_scan.io = pf_io;
+	lsn_scan.page_fn = lsn_page;
+	nworkers = relscan_nworkers(&lsn_scan);
+	lsn_max = pg_malloc0(sizeof(XLogRecPtr) * nworkers);
+	lsn_bad_pages = pg_malloc0(sizeof(uint64) * nworkers);
+
+	/* From here on the main thread may cancel the scan and ask its progress */
+	pthread_mutex_lock(&preflight_lock);
+	if (deadline_passed)
+	{
+		/* leave the status at running, the result is no longer waited for */
+		pthread_mutex_unlock(&preflight_lock);
+		return;
+	}
+	lsn_scan_running = true;
+	pthread_mutex_unlock(&preflight_lock);
+
+	if (!relscan_run(&lsn_scan))
+	{
+		/* cancelled at the deadline; leave the status at running */
+		if (lsn_scan.failed)
+			check_finish(check, PREFLIGHT_FAILED, "%s", lsn_scan.errmsg);
+		return;
+	}
+
+	for (i = 0; i < nworkers; i++)
+	{
+		max = Max(max, lsn_max[i]);
+		bad_pages += lsn_bad_pages[i];
+	}
+
+	if (bad_pages > 0)
+		check_finish(check, PREFLIGHT_FAILED,
+					 UINT64_FORMAT " pages have an LSN past %X/%X, the highest %X/%X",
+					 bad_pages, LSN_FORMAT_ARGS(lsn_limit), LSN_FORMAT_ARGS(max));
+	else
+		check_finish(check, PREFLIGHT_PASSED,
+					 "highest of " UINT64_FORMAT " pages is %X/%X, limit %X/%X",
+					 lsn_scan.blocks_total, LSN_FORMAT_ARGS(max),
+					 LSN_FORMAT_ARGS(lsn_limit));
+}
+
+
+static bool
+lsn_page(RelScan *scan, int worker, const RelFile *file, BlockNumber blkno,
+		 char *page)
+{
+	XLogRecPtr	lsn;
+
+	if (PageIsNew(page))
+		return false;
+
+	lsn = PageGetLSN(page);
+	if (lsn > lsn_max[worker])
+		lsn_max[worker] = lsn;
+	if (lsn > lsn_limit)
+		lsn_bad_pages[worker]++;
+	return false;
+}
+
+
+static void
+check_wal_segment_size(PreflightCheck *check)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+	int			nsegments = 0;
+	int			nbad = 0;
+	char		first_bad[MAXPGPATH] = "";
+	off_t		first_bad_size = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", pf_datadir, XLOGDIR);
+	if ((dir = opendir(path)) == NULL)
+	{
+		check_finish(check, PREFLIGHT_FAILED, "could not open directory \"%s\": %m", path);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		segpath[MAXPGPATH];
+		struct stat st;
+		XLogLongPageHeaderData longhdr;
+		int			fd;
+		bool		ok;
+
+		if (!IsXLogFileName(de->d_name))
+			continue;
+		nsegments++;
+
+		snprintf(segpath, sizeof(segpath), "%s/%s", path, de->d_name);
+		if ((fd = open(segpath, O_RDONLY | PG_BINARY, 0)) < 0 || fstat(fd, &st) != 0)
+		{
+			check_finish(check, PREFLIGHT_FAILED, "could not open file \"%s\": %m", segpath);
+			if (fd >= 0)
+				close(fd);
+			closedir(dir);
+			return;
+		}
+
+		/* The long header of a segment that was written agrees, too */
+		ok = st.st_size == pf_control->wal_segsize;
+		if (ok && pg_pread(fd, &longhdr, sizeof(longhdr), 0) == sizeof(longhdr) &&
+			longhdr.std.xlp_magic == XLOG_PAGE_MAGIC)
+			ok = longhdr.xlp_seg_size == pf_control->wal_segsize;
+		close(fd);
+
+		if (!ok)
+		{
+			if (nbad++ == 0)
+			{
+				strlcpy(first_bad, de->d_name, sizeof(first_bad));
+				first_bad_size = st.st_size;
+			}
+		}
+	}
+	closedir(dir);
+
+	if (nbad > 0)
+		check_finish(check, PREFLIGHT_FAILED,
+					 "%d of %d segments do not match xlog_seg_size %d, first \"%s\" (%lld bytes)",
+					 nbad, nsegments, pf_control->wal_segsize, first_bad,
+					 (long long) first_bad_size);
+	else
+		check_finish(check, PREFLIGHT_PASSED, "%d segments of %d bytes",
+					 nsegments, pf_control->wal_segsize);
+}
+
+
+static void
+check_finish(PreflightCheck *check, PreflightStatus status, const char *fmt,...)
+{
+	int			save_errno = errno;
+	va_list		args;
+
+	pthread_mutex_lock(&preflight_lock);
+	va_start(args, fmt);
+	errno = save_errno;
+	vsnprintf(check->detail, sizeof(check->detail), fmt, args);
+	va_end(args);
+	check->status = status;
+	pthread_cond_signal(&preflight_done);
+	pthread_mutex_unlock(&preflight_lock);
+}
@@ -0,0 +1,267 @@
+/*
+ * prewarm.c
+ *	  Pull the WAL and relation blocks that startup will replay into the
+ *	  page cache after an edit (--prewarm).
+ *
+ * Replay starts at checkPointCopy.redo and reads the WAL sequentially,
+ * plus every block a record touches that is not restored from a full-page
+ * image.  On a cold cache each of those block reads is a random read on
+ * the replay's critical path.
+ *
+ * The WAL segments from redo on are scanned in parallel, which brings
+ * them into the page cache, until the memory budget would be exceeded.
+ * The blocks their records reference are then ordered by the first record
+ * touching them, and as many as the rest of the budget allows are handed to
+ * the kernel with POSIX_FADV_WILLNEED, coalesced into ranges per file.
+ * Blocks first touched by a full-page image are skipped, as replay does
+ * not read them.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "access/xlog_internal.h"
+#include "common/hashfn.h"
+#include "common/logging.h"
+#include "common/relpath.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+#include "walscan.h"
+
+/* A referenced block, with the first record that touches it */
+typedef struct PrewarmEntry
+{
+	WalBlockTag tag;
+	char		status;
+	XLogRecPtr	first_lsn;
+	bool		first_is_image;
+} PrewarmEntry;
+
+#define SH_PREFIX			prewarmset
+#define SH_ELEMENT_TYPE		PrewarmEntry
+#define SH_KEY_TYPE			WalBlockTag
+#define SH_KEY				tag
+#define SH_HASH_KEY(tb, key) \
+	hash_bytes((const unsigned char *) &(key), sizeof(WalBlockTag))
+#define SH_EQUAL(tb, a, b)	(memcmp(&(a), &(b), sizeof(WalBlockTag)) == 0)
+#define SH_SCOPE			static inline
+#define SH_RAW_ALLOCATOR	pg_malloc0
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+static void note_record(WalScan *scan, int worker, XLogRecPtr lsn,
+						const XLogRecord *record);
+static void note_block(prewarmset_hash *set, const WalBlockTag *tag,
+					   XLogRecPtr lsn, bool is_image);
+static int	cmp_first_lsn(const void *a, const void *b);
+static int	cmp_block(const void *a, const void *b);
+static uint64 advise_blocks(const char *datadir, PrewarmEntry *blocks,
+							int nblocks);
+
+
+/*
+ * Prewarm the WAL and blocks replay will read, within budget bytes of
+ * page cache.
+ */
+void
+run_prewarm(const PgControl *ctl, const char *datadir, int jobs, uint64 budget)
+{
+	WalScan		scan;
+	prewarmset_hash **sets;
+	prewarmset_iterator iter;
+	PrewarmEntry *entry;
+	PrewarmEntry *blocks;
+	uint64		wal_segments;
+	uint64		block_budget;
+	uint64		nwanted;
+	uint64		nadvised;
+	int			nblocks;
+	int			i;
+
+	/* The WAL comes first, replay cannot start without it */
+	wal_segments = Max(budget / ctl->wal_segsize, 1);
+
+	sets = pg_malloc(sizeof(prewarmset_hash *) * jobs);
+	for (i = 0; i < jobs; i++)
+		sets[i] = prewarmset_create(1024, NULL);
+
+	memset(&scan, 0, sizeof(scan));
+	scan.pgdata = datadir;
+	scan.segsize = ctl->wal_segsize;
+	scan.tli = pgcontrol_get_value(ctl, "checkPointCopy.ThisTimeLineID");
+	scan.start = pgcontrol_get_value(ctl, "checkPointCopy.redo");
+	scan.nworkers = jobs;
+	scan.max_segments = (int) Min(wal_segments, INT_MAX);
+	scan.record_fn = note_record;
+	scan.arg = sets;
+	walscan_run(&scan);
+
+	block_budget = budget > scan.bytes_read ? (budget - scan.bytes_read) / BLCKSZ : 0;
+
+	/* Merge the workers' blocks, keeping the earliest reference */
+	for (i = 1; i < jobs; i++)
+	{
+		prewarmset_start_iterate(sets[i], &iter);
+		while ((entry = prewarmset_iterate(sets[i], &iter)) != NULL)
+			note_block(sets[0], &entry->tag, entry->first_lsn,
+					   entry->first_is_image);
+		prewarmset_destroy(sets[i]);
+	}
+
+	blocks = pg_malloc(sizeof(PrewarmEntry) * Max(sets[0]->members, 1));
+	nblocks = 0;
+	prewarmset_start_iterate(sets[0], &iter);
+	while ((entry = prewarmset_iterate(sets[0], &iter)) != NULL)
+	{
+		/* Past the end of the valid WAL, replay never gets there */
+		if (entry->first_lsn >= scan.end || entry->first_is_image)
+			continue;
+		blocks[nblocks++] = *entry;
+	}
+	prewarmset_destroy(sets[0]);
+	pg_free(sets);
+	nwanted = nblocks;
+
+	/* Earliest first within the budget, then in file order for the kernel */
+	if ((uint64) nblocks > block_budget)
+	{
+		qsort(blocks, nblocks, sizeof(PrewarmEntry), cmp_first_lsn);
+		nblocks = block_budget;
+	}
+	qsort(blocks, nblocks, sizeof(PrewarmEntry), cmp_block);
+	nadvised = advise_blocks(datadir, blocks, nblocks);
+	pg_free(blocks);
+
+	pg_log_info("prewarmed %d WAL segments from %X/%X (" UINT64_FORMAT " MB) and "
+				UINT64_FORMAT " of " UINT64_FORMAT " blocks replay reads",
+				scan.nsegments, LSN_FORMAT_ARGS(scan.start),
+				scan.bytes_read / (1024 * 1024), nadvised, nwanted);
+	if (scan.gap || scan.end < pgcontrol_get_value(ctl, "checkPoint"))
+		pg_log_warning("WAL ends at %X/%X: %s", LSN_FORMAT_ARGS(scan.end),
+					   scan.errmsg);
+
+	pg_free(scan.segments);
+}
+
+
+static void
+note_record(WalScan *scan, int worker, XLogRecPtr lsn, const XLogRecord *record)
+{
+	prewarmset_hash *set = ((prewarmset_hash **) scan->arg)[worker];
+	WalBlockRef refs[XLR_MAX_BLOCK_ID + 1];
+	int			nrefs = walreader_decode_blocks(record, refs);
+	int			i;
+
+	for (i = 0; i < nrefs; i++)
+	{
+		WalBlockTag tag;
+
+		memset(&tag, 0, sizeof(tag));
+		tag.rlocator = refs[i].rlocator;
+		tag.forknum = refs[i].forknum;
+		tag.blkno = refs[i].blkno;
+		note_block(set, &tag, lsn, refs[i].has_image);
+	}
+}
+
+
+static void
+note_block(prewarmset_hash *set, const WalBlockTag *tag, XLogRecPtr lsn,
+		   bool is_image)
+{
+	PrewarmEntry *entry;
+	bool		found;
+
+	entry = prewarmset_insert(set, *tag, &found);
+	if (!found || lsn < entry->first_lsn)
+	{
+		entry->first_lsn = lsn;
+		entry->first_is_image = is_image;
+	}
+}
+
+
+static int
+cmp_first_lsn(const void *a, const void *b)
+{
+	XLogRecPtr	la = ((const PrewarmEntry *) a)->first_lsn;
+	XLogRecPtr	lb = ((const PrewarmEntry *) b)->first_lsn;
+
+	return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+
+static int
+cmp_block(const void *a, const void *b)
+{
+	const WalBlockTag *ta = &((const PrewarmEntry *) a)->tag;
+	const WalBlockTag *tb = &((const PrewarmEntry *) b)->tag;
+	int			c = memcmp(&ta->rlocator, &tb->rlocator, sizeof(RelFileLocator));
+
+	if (c != 0)
+		return c;
+	if (ta->forknum != tb->forknum)
+		return ta->forknum < tb->forknum ? -1 : 1;
+	return ta->blkno < tb->blkno ? -1 : ta->blkno > tb->blkno ? 1 : 0;
+}
+
+
+/*
+ * Issue POSIX_FADV_WILLNEED for the sorted blocks, one call per run of
+ * consecutive blocks in a segment file.  Files that do not exist are
+ * skipped; replay creates them.
+ */
+static uint64
+advise_blocks(const char *datadir, PrewarmEntry *blocks, int nblocks)
+{
+	uint64		nadvised = 0;
+	int			i = 0;
+
+	while (i < nblocks)
+	{
+		const WalBlockTag *tag = &blocks[i].tag;
+		BlockNumber segno = tag->blkno / RELSEG_SIZE;
+		BlockNumber first = tag->blkno;
+		BlockNumber last = first;
+		char	   *relpath;
+		char		path[MAXPGPATH];
+		int			fd;
+
+		/* Extend the run while the next block follows in the same file */
+		while (i + 1 < nblocks &&
+			   RelFileLocatorEquals(blocks[i + 1].tag.rlocator, tag->rlocator) &&
+			   blocks[i + 1].tag.forknum == tag->forknum &&
+			   blocks[i + 1].tag.blkno == last + 1 &&
+			   blocks[i + 1].tag.blkno / RELSEG_SIZE == segno)
+		{
+			last++;
+			i++;
+		}
+		i++;
+
+		relpath = relpathperm(tag->rlocator, tag->forknum);
+		if (segno == 0)
+			snprintf(path, sizeof(path), "%s/%s", datadir, relpath);
+		else
+			snprintf(path, sizeof(path), "%s/%s.%u", datadir, relpath, segno);
+		pfree(relpath);
+
+		if ((fd = open(path, O_RDONLY | PG_BINARY, 0)) < 0)
+			continue;
+		if (posix_fadvise(fd, (off_t) (first % RELSEG_SIZE) * BLCKSZ,
+						  (off_t) (last - first + 1) * BLCKSZ,
+						  POSIX_FADV_WILLNEED) == 0)
+			nadvised += last - first + 1;
+		close(fd);
+	}
+
+	return nadvised;
+}
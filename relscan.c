@@ -0,0 +1,669 @@
+/*
+ * relscan.c
+ *	  Parallel page-by-page scan of the relation files of a data directory.
+ *
+ * relscan_collect() finds every segment of every fork of every relation in
+ * global, base and the tablespaces, the same files pg_checksums looks at.
+ * relscan_run() cuts them into ranges of at most RELSCAN_RANGE_BLOCKS so
+ * that a few large segments still keep all workers busy, and hands the
+ * ranges out to pools of threads that read them in large chunks and call
+ * the page callback for every block.  With write_back, chunks holding pages
+ * the callback changed are written back in place and each file is fsynced
+ * before it is closed.  How files are opened and read, and how fast, is up
+ * to scan->io.  A scan that records the ranges it has finished through
+ * range_done_fn can leave them out of a later run with skip_fn.
+ *
+ * Files are grouped by the device they live on, st_dev as seen through the
+ * pg_tblspc links, and every device gets its own queue and nworkers threads
+ * of its own.  A single pool would keep many requests in flight on
+ * whichever device the queue happened to be at and none on the others;
+ * with one pool per device each runs at its own queue depth and the scan
+ * gets the sum of their bandwidths.  With io->adaptive, nworkers is only the
+ * upper bound of each device's reads in flight; concurrency.c finds the
+ * right number as the scan goes, and a device starts with that many
+ * threads and gets another each time it rises.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog/pg_tablespace_d.h"
+
+#include "relscan.h"
+
+/* 128MB ranges, read 1MB at a time */
+#define RELSCAN_RANGE_BLOCKS	(128 * 1024 * 1024 / BLCKSZ)
+#define RELSCAN_CHUNK_BLOCKS	(1024 * 1024 / BLCKSZ)
+
+typedef struct RelScanWorker
+{
+	RelScan    *scan;
+	RelScanDevice *device;
+	int			id;
+	pthread_t	thread;
+} RelScanWorker;
+
+static bool scan_database_dir(RelScan *scan, const char *path, Oid tablespace,
+							  Oid dboid, bool main_forks_only);
+static bool scan_tablespace_dir(RelScan *scan, const char *path, Oid tablespace,
+								bool main_forks_only);
+static bool parse_relfile_name(const char *name, Oid *relfilenode,
+							   ForkNumber *forknum, BlockNumber *segno);
+static int	find_device(const RelScanDevice *devices, int ndevices, dev_t dev);
+static void queue_range(RelScan *scan, RelScanDevice *device, int file,
+						BlockNumber start, BlockNumber end);
+static void relscan_free_devices(RelScan *scan);
+static bool start_worker(RelScan *scan, RelScanDevice *device);
+static void *relscan_worker(void *arg);
+static bool relscan_close(RelScan *scan, int fd, const RelFile *file,
+						  bool dirty);
+static bool relscan_fail(RelScan *scan, const char *fmt,...) pg_attribute_printf(2, 3);
+
+
+/*
+ * Find the relation files of datadir.  Resets everything in scan.
+ */
+bool
+relscan_collect(RelScan *scan, const char *datadir, bool main_forks_only)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+
+	memset(scan, 0, sizeof(RelScan));
+	pthread_mutex_init(&scan->lock, NULL);
+
+	snprintf(path, sizeof(path), "%s/global", datadir);
+	if (!scan_database_dir(scan, path, GLOBALTABLESPACE_OID, InvalidOid,
+						   main_forks_only))
+		return false;
+
+	snprintf(path, sizeof(path), "%s/base", datadir);
+	if (!scan_tablespace_dir(scan, path, DEFAULTTABLESPACE_OID, main_forks_only))
+		return false;
+
+	snprintf(path, sizeof(path), "%s/pg_tblspc", datadir);
+	if ((dir = opendir(path)) == NULL)
+		return relscan_fail(scan, "could not open directory \"%s\": %m", path);
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		spcpath[MAXPGPATH];
+
+		if (strspn(de->d_name, "0123456789") != strlen(de->d_name))
+			continue;
+
+		/* stat() follows the link, so dev is that of the tablespace */
+		snprintf(spcpath, sizeof(spcpath), "%s/%s/%s",
+				 path, de->d_name, TABLESPACE_VERSION_DIRECTORY);
+		if (!scan_tablespace_dir(scan, spcpath, atooid(de->d_name),
+								 main_forks_only))
+		{
+			closedir(dir);
+			return false;
+		}
+	}
+	if (errno != 0)
+		relscan_fail(scan, "could not read directory \"%s\": %m", path);
+	closedir(dir);
+
+	return !scan->failed;
+}
+
+
+/*
+ * How many workers relscan_run() starts, nworkers for each device: the
+ * range of the worker argument of page_fn.
+ */
+int
+relscan_nworkers(const RelScan *scan)
+{
+	RelScanDevice *devices = pg_malloc(sizeof(RelScanDevice) * Max(scan->nfiles, 1));
+	int			ndevices = 0;
+	int			i;
+
+	for (i = 0; i < scan->nfiles; i++)
+		if (find_device(devices, ndevices, scan->files[i].dev) < 0)
+			devices[ndevices++].dev = scan->files[i].dev;
+	pg_free(devices);
+
+	return Max(ndevices, 1) * Max(scan->nworkers, 1);
+}
+
+
+/*
+ * Scan every collected file with scan->nworkers threads per device.
+ * Returns false if a file could not be read or the scan was cancelled.
+ */
+bool
+relscan_run(RelScan *scan)
+{
+	return relscan_run_ranges(scan, NULL, 0);
+}
+
+
+/*
+ * Like relscan_run(), but scan only the given ranges of the collected
+ * files, e.g. a sample of their blocks.  Ranges are read in the order
+ * given, per device.  ranges may be NULL for all blocks of every file.
+ */
+bool
+relscan_run_ranges(RelScan *scan, const RelScanRange *ranges, int nranges)
+{
+	bool		adaptive = scan->io != NULL && scan->io->adaptive;
+	int			per_device = Max(scan->nworkers, 1);
+	int		   *file_device;
+	int			i;
+	int			j;
+
+	relscan_free_devices(scan);
+	scan->devices = pg_malloc0(sizeof(RelScanDevice) * Max(scan->nfiles, 1));
+	pthread_mutex_lock(&scan->lock);
+	scan->blocks_total = 0;
+	scan->blocks_done = 0;
+	pthread_mutex_unlock(&scan->lock);
+
+	file_device = pg_malloc(sizeof(int) * Max(scan->nfiles, 1));
+	for (i = 0; i < scan->nfiles; i++)
+	{
+		int			d = find_device(scan->devices, scan->ndevices, scan->files[i].dev);
+
+		if (d < 0)
+		{
+			d = scan->ndevices++;
+			scan->devices[d].dev = scan->files[i].dev;
+			pthread_mutex_init(&scan->devices[d].lock, NULL);
+			if (adaptive)
+				concurrency_init(&scan->devices[d].cc, per_device, scan->files[i].dev);
+		}
+		file_device[i] = d;
+	}
+
+	if (ranges == NULL)
+	{
+		for (i = 0; i < scan->nfiles; i++)
+		{
+			BlockNumber start;
+
+			for (start = 0; start < scan->files[i].nblocks; start += RELSCAN_RANGE_BLOCKS)
+				queue_range(scan, &scan->devices[file_device[i]], i, start,
+							Min(start + RELSCAN_RANGE_BLOCKS, scan->files[i].nblocks));
+		}
+	}
+	else
+	{
+		for (i = 0; i < nranges; i++)
+			queue_range(scan, &scan->devices[file_device[ranges[i].file]],
+						ranges[i].file, ranges[i].start, ranges[i].end);
+	}
+	pg_free(file_device);
+
+	/* With io->adaptive, workers start more workers as the limit rises */
+	for (i = 0; i < scan->ndevices; i++)
+	{
+		RelScanDevice *device = &scan->devices[i];
+		int			nstart = adaptive ? device->cc.workers : per_device;
+
+		device->workers = pg_malloc0(sizeof(RelScanWorker) * per_device);
+		for (j = 0; j < nstart; j++)
+			if (!start_worker(scan, device))
+				break;
+		if (j < nstart)
+			break;
+	}
+
+	/* A device's workers are only started by its running workers */
+	for (i = 0; i < scan->ndevices; i++)
+	{
+		RelScanDevice *device = &scan->devices[i];
+
+		for (j = 0;; j++)
+		{
+			int			nstarted;
+
+			pthread_mutex_lock(&device->lock);
+			nstarted = device->nstarted;
+			pthread_mutex_unlock(&device->lock);
+			if (j >= nstarted)
+				break;
+			pthread_join(device->workers[j].thread, NULL);
+		}
+	}
+
+	return !scan->failed && !scan->cancel;
+}
+
+
+/*
+ * Start another worker for device.  Its id follows those of the devices
+ * before it, so that ids stay below relscan_nworkers().
+ */
+static bool
+start_worker(RelScan *scan, RelScanDevice *device)
+{
+	int			per_device = Max(scan->nworkers, 1);
+	RelScanWorker *worker;
+	int			rc;
+
+	pthread_mutex_lock(&device->lock);
+	Assert(device->nstarted < per_device);
+	worker = &device->workers[device->nstarted];
+	worker->scan = scan;
+	worker->device = device;
+	worker->id = (device - scan->devices) * per_device + device->nstarted;
+	rc = pthread_create(&worker->thread, NULL, relscan_worker, worker);
+	if (rc == 0)
+		device->nstarted++;
+	pthread_mutex_unlock(&device->lock);
+
+	if (rc != 0)
+	{
+		errno = rc;
+		return relscan_fail(scan, "could not create thread: %m");
+	}
+	return true;
+}
+
+
+static int
+find_device(const RelScanDevice *devices, int ndevices, dev_t dev)
+{
+	int			i;
+
+	for (i = 0; i < ndevices; i++)
+		if (devices[i].dev == dev)
+			return i;
+	return -1;
+}
+
+
+/*
+ * Add a range of a file to the queue of its device, unless skip_fn says it
+ * has been scanned before.
+ */
+static void
+queue_range(RelScan *scan, RelScanDevice *device, int file, BlockNumber start,
+			BlockNumber end)
+{
+	RelScanRange *range;
+	bool		skip;
+
+	skip = scan->skip_fn != NULL &&
+		scan->skip_fn(scan, &scan->files[file], start, end);
+
+	/* relscan_progress() may be called while the ranges are queued */
+	pthread_mutex_lock(&scan->lock);
+	scan->blocks_total += end - start;
+	if (skip)
+		scan->blocks_done += end - start;
+	pthread_mutex_unlock(&scan->lock);
+	device->blocks_total += end - start;
+	if (skip)
+		return;
+
+	if (device->nranges % 1024 == 0)
+		device->ranges = pg_realloc(device->ranges,
+									sizeof(RelScanRange) * (device->nranges + 1024));
+	range = &device->ranges[device->nranges++];
+	range->file = file;
+	range->start = start;
+	range->end = end;
+}
+
+
+static void
+relscan_free_devices(RelScan *scan)
+{
+	int			i;
+
+	for (i = 0; i < scan->ndevices; i++)
+	{
+		if (scan->devices[i].ranges != NULL)
+			pg_free(scan->devices[i].ranges);
+		if (scan->devices[i].workers != NULL)
+			pg_free(scan->devices[i].workers);
+		pthread_mutex_destroy(&scan->devices[i].lock);
+		if (scan->io != NULL && scan->io->adaptive)
+			concurrency_destroy(&scan->devices[i].cc);
+	}
+	if (scan->devices != NULL)
+		pg_free(scan->devices);
+	scan->devices = NULL;
+	scan->ndevices = 0;
+}
+
+
+/*
+ * Blocks scanned so far and in total, safe to call while the scan runs.
+ */
+void
+relscan_progress(RelScan *scan, uint64 *done, uint64 *total)
+{
+	pthread_mutex_lock(&scan->lock);
+	*done = scan->blocks_done;
+	*total = scan->blocks_total;
+	pthread_mutex_unlock(&scan->lock);
+}
+
+
+void
+relscan_free(RelScan *scan)
+{
+	if (scan->files != NULL)
+		pg_free(scan->files);
+	relscan_free_devices(scan);
+	scan->files = NULL;
+	pthread_mutex_destroy(&scan->lock);
+}
+
+
+/*
+ * Add the database directories under path, e.g. base.  A tablespace
+ * directory without a subdirectory for this server version is skipped.
+ */
+static bool
+scan_tablespace_dir(RelScan *scan, const char *path, Oid tablespace,
+					bool main_forks_only)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	if ((dir = opendir(path)) == NULL)
+	{
+		if (errno == ENOENT && tablespace != DEFAULTTABLESPACE_OID)
+			return true;
+		return relscan_fail(scan, "could not open directory \"%s\": %m", path);
+	}
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		dbpath[MAXPGPATH];
+
+		if (strspn(de->d_name, "0123456789") != strlen(de->d_name))
+			continue;
+
+		snprintf(dbpath, sizeof(dbpath), "%s/%s", path, de->d_name);
+		if (!scan_database_dir(scan, dbpath, tablespace, atooid(de->d_name),
+							   main_forks_only))
+		{
+			closedir(dir);
+			return false;
+		}
+	}
+	if (errno != 0)
+		relscan_fail(scan, "could not read directory \"%s\": %m", path);
+	closedir(dir);
+
+	return !scan->failed;
+}
+
+
+static bool
+scan_database_dir(RelScan *scan, const char *path, Oid tablespace, Oid dboid,
+				  bool main_forks_only)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	if ((dir = opendir(path)) == NULL)
+		return relscan_fail(scan, "could not open directory \"%s\": %m", path);
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		RelFile    *file;
+		Oid			relfilenode;
+		ForkNumber	forknum;
+		BlockNumber segno;
+		struct stat st;
+		char		filepath[MAXPGPATH];
+
+		if (!parse_relfile_name(de->d_name, &relfilenode, &forknum, &segno))
+			continue;
+		if (main_forks_only && forknum != MAIN_FORKNUM)
+			continue;
+
+		snprintf(filepath, sizeof(filepath), "%s/%s", path, de->d_name);
+		if (stat(filepath, &st) != 0)
+		{
+			/* dropped while we looked */
+			if (errno == ENOENT)
+				continue;
+			closedir(dir);
+			return relscan_fail(scan, "could not stat file \"%s\": %m", filepath);
+		}
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		if (scan->nfiles % 1024 == 0)
+			scan->files = pg_realloc(scan->files,
+									 sizeof(RelFile) * (scan->nfiles + 1024));
+		file = &scan->files[scan->nfiles++];
+		strlcpy(file->path, filepath, sizeof(file->path));
+		file->tablespace = tablespace;
+		file->dboid = dboid;
+		file->relfilenode = relfilenode;
+		file->forknum = forknum;
+		file->segno = segno;
+		file->nblocks = st.st_size / BLCKSZ;
+		file->dev = st.st_dev;
+		file->size = st.st_size;
+		file->ino = st.st_ino;
+		file->mtime = st.st_mtime;
+	}
+	if (errno != 0)
+		relscan_fail(scan, "could not read directory \"%s\": %m", path);
+	closedir(dir);
+
+	return !scan->failed;
+}
+
+
+/*
+ * Parse "<relfilenode>[_<fork>][.<segno>]".  Temporary relations and
+ * everything else in the directory are rejected.
+ */
+static bool
+parse_relfile_name(const char *name, Oid *relfilenode, ForkNumber *forknum,
+				   BlockNumber *segno)
+{
+	const char *p = name;
+	size_t		len = strspn(p, "0123456789");
+
+	if (len == 0 || len > OIDCHARS)
+		return false;
+	*relfilenode = atooid(p);
+	p += len;
+
+	*forknum = MAIN_FORKNUM;
+	if (*p == '_')
+	{
+		len = forkname_chars(p + 1, forknum);
+		if (len == 0)
+			return false;
+		p += len + 1;
+	}
+
+	*segno = 0;
+	if (*p == '.')
+	{
+		len = strspn(p + 1, "0123456789");
+		if (len == 0)
+			return false;
+		*segno = strtoul(p + 1, NULL, 10);
+		p += len + 1;
+	}
+
+	return *p == '\0';
+}
+
+
+static void *
+relscan_worker(void *arg)
+{
+	RelScanWorker *worker = (RelScanWorker *) arg;
+	RelScan    *scan = worker->scan;
+	RelScanDevice *device = worker->device;
+	bool		adaptive = scan->io != NULL && scan->io->adaptive;
+	instr_time	read_start;
+	char	   *buffer = scanio_alloc(RELSCAN_CHUNK_BLOCKS * BLCKSZ);
+	int			fd = -1;
+	int			fd_file = -1;
+	bool		fd_dirty = false;
+
+	for (;;)
+	{
+		RelScanRange range;
+		RelFile    *file;
+		BlockNumber blkno;
+
+		if (scan->cancel)
+			break;
+		pthread_mutex_lock(&device->lock);
+		if (device->next_range >= device->nranges)
+		{
+			pthread_mutex_unlock(&device->lock);
+			break;
+		}
+		range = device->ranges[device->next_range++];
+		pthread_mutex_unlock(&device->lock);
+
+		file = &scan->files[range.file];
+		if (fd_file != range.file)
+		{
+			if (fd >= 0 && !relscan_close(scan, fd, &scan->files[fd_file], fd_dirty))
+			{
+				fd = -1;
+				break;
+			}
+			fd_file = range.file;
+			fd_dirty = false;
+			if ((fd = scanio_open(scan->io, file->path,
+								  scan->write_back ? O_RDWR : O_RDONLY)) < 0)
+			{
+				relscan_fail(scan, "could not open file \"%s\": %m", file->path);
+				break;
+			}
+		}
+
+		for (blkno = range.start; blkno < range.end && !scan->cancel;)
+		{
+			int			nblocks = Min(RELSCAN_CHUNK_BLOCKS, range.end - blkno);
+			size_t		len = (size_t) nblocks * BLCKSZ;
+			bool		dirty = false;
+			ssize_t		rc;
+			int			i;
+
+			scanio_throttle(scan->io, len);
+			if (adaptive)
+			{
+				concurrency_acquire(&device->cc);
+				INSTR_TIME_SET_CURRENT(read_start);
+			}
+			rc = pg_pread(fd, buffer, len, (off_t) blkno * BLCKSZ);
+			if (adaptive)
+			{
+				instr_time	read_time;
+
+				INSTR_TIME_SET_CURRENT(read_time);
+				INSTR_TIME_SUBTRACT(read_time, read_start);
+				concurrency_release(&device->cc, len,
+									INSTR_TIME_GET_DOUBLE(read_time));
+				if (concurrency_grow(&device->cc))
+					(void) start_worker(scan, device);
+			}
+			if (rc != (ssize_t) len)
+			{
+				if (rc < 0)
+					relscan_fail(scan, "could not read file \"%s\": %m", file->path);
+				else
+					relscan_fail(scan, "could not read block %u in file \"%s\": read %d of %d",
+								 blkno, file->path, (int) rc, nblocks * BLCKSZ);
+				break;
+			}
+
+			for (i = 0; i < nblocks; i++)
+				if (scan->page_fn(scan, worker->id, file,
+								  file->segno * RELSEG_SIZE + blkno + i,
+								  buffer + (size_t) i * BLCKSZ))
+					dirty = true;
+
+			if (dirty && scan->write_back)
+			{
+				scanio_throttle(scan->io, len);
+				rc = pg_pwrite(fd, buffer, len, (off_t) blkno * BLCKSZ);
+				if (rc != (ssize_t) len)
+				{
+					/* if write didn't set errno, assume problem is no disk space */
+					if (rc >= 0)
+						errno = ENOSPC;
+					relscan_fail(scan, "could not write block %u in file \"%s\": %m",
+								 blkno, file->path);
+					break;
+				}
+				fd_dirty = true;
+			}
+			else
+				scanio_done(scan->io, fd, (off_t) blkno * BLCKSZ, len);
+
+			blkno += nblocks;
+			pthread_mutex_lock(&scan->lock);
+			scan->blocks_done += nblocks;
+			pthread_mutex_unlock(&scan->lock);
+		}
+
+		if (blkno >= range.end && scan->range_done_fn != NULL)
+			scan->range_done_fn(scan, worker->id, file, range.start, range.end);
+	}
+
+	if (fd >= 0)
+		(void) relscan_close(scan, fd, &scan->files[fd_file], fd_dirty);
+	scanio_free(buffer);
+	return NULL;
+}
+
+
+/*
+ * Close a file, fsyncing it first if pages were written to it.
+ */
+static bool
+relscan_close(RelScan *scan, int fd, const RelFile *file, bool dirty)
+{
+	if (dirty && fsync(fd) != 0)
+	{
+		relscan_fail(scan, "could not fsync file \"%s\": %m", file->path);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+
+/*
+ * Record the first error and stop all workers.  Returns false.
+ */
+static bool
+relscan_fail(RelScan *scan, const char *fmt,...)
+{
+	int			save_errno = errno;
+	va_list		args;
+
+	pthread_mutex_lock(&scan->lock);
+	if (!scan->failed)
+	{
+		va_start(args, fmt);
+		errno = save_errno;
+		vsnprintf(scan->errmsg, sizeof(scan->errmsg), fmt, args);
+		va_end(args);
+		scan->failed = true;
+	}
+	scan->cancel = true;
+	pthread_mutex_unlock(&scan->lock);
+
+	return false;
+}
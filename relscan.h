@@ -0,0 +1,121 @@
+/*
+ * relscan.h
+ *	  Parallel page-by-page scan of the relation files of a data directory.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef RELSCAN_H
+#define RELSCAN_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "common/relpath.h"
+#include "storage/block.h"
+
+#include "concurrency.h"
+#include "scanio.h"
+
+/* One segment file of one fork of a relation */
+typedef struct RelFile
+{
+	char		path[MAXPGPATH];
+	Oid			tablespace;
+	Oid			dboid;
+	Oid			relfilenode;
+	ForkNumber	forknum;
+	BlockNumber segno;
+	BlockNumber nblocks;		/* whole blocks in the file */
+	dev_t		dev;
+	/* identity of the file when it was found */
+	off_t		size;
+	ino_t		ino;
+	time_t		mtime;
+} RelFile;
+
+struct RelScan;
+
+/*
+ * Called by a worker for every page.  blkno is the block number within the
+ * fork, not the segment file.  Calls from different workers run
+ * concurrently; worker identifies the caller, from 0 to nworkers - 1.
+ * Returns true if it changed the page, which matters only with write_back.
+ */
+typedef bool (*relscan_page_fn) (struct RelScan *scan, int worker,
+								 const RelFile *file, BlockNumber blkno,
+								 char *page);
+
+/*
+ * Optional per-range callbacks, for scans that keep track of their progress.
+ * start and end are block numbers within the segment file.  skip_fn is
+ * asked about every range before the workers start, and ranges it returns
+ * true for are not read.  range_done_fn is called by the worker that has
+ * passed every block of a range to page_fn.
+ */
+typedef bool (*relscan_skip_fn) (struct RelScan *scan, const RelFile *file,
+								 BlockNumber start, BlockNumber end);
+typedef void (*relscan_range_fn) (struct RelScan *scan, int worker,
+								  const RelFile *file, BlockNumber start,
+								  BlockNumber end);
+
+typedef struct RelScanRange
+{
+	int			file;			/* index into files */
+	BlockNumber start;			/* first block, within the segment file */
+	BlockNumber end;			/* one past the last */
+} RelScanRange;
+
+/* The work queue of the files on one device, with workers of its own */
+typedef struct RelScanDevice
+{
+	dev_t		dev;
+	pthread_mutex_t lock;		/* protects next_range */
+	RelScanRange *ranges;
+	int			nranges;
+	int			next_range;
+	uint64		blocks_total;
+	ScanConcurrency cc;			/* used if io->adaptive */
+	struct RelScanWorker *workers;	/* room for nworkers */
+	int			nstarted;		/* protected by lock */
+} RelScanDevice;
+
+typedef struct RelScan
+{
+	/* set by relscan_collect() */
+	RelFile    *files;
+	int			nfiles;
+
+	/* set by the caller before relscan_run() */
+	int			nworkers;		/* per device, see relscan_nworkers() */
+	relscan_page_fn page_fn;
+	relscan_skip_fn skip_fn;	/* may be NULL */
+	relscan_range_fn range_done_fn; /* may be NULL */
+	void	   *arg;
+	bool		write_back;		/* write changed pages back, fsync files */
+	ScanIO	   *io;				/* read policy and limits, NULL = buffered */
+
+	/* may be set from another thread to stop the scan early */
+	volatile bool cancel;
+
+	/* progress, protected by lock */
+	pthread_mutex_t lock;
+	uint64		blocks_total;
+	uint64		blocks_done;		/* including skipped ranges */
+	bool		failed;
+	char		errmsg[256];
+
+	/* work queues, one per st_dev */
+	RelScanDevice *devices;
+	int			ndevices;
+} RelScan;
+
+extern bool relscan_collect(RelScan *scan, const char *datadir,
+							bool main_forks_only);
+extern int	relscan_nworkers(const RelScan *scan);
+extern bool relscan_run(RelScan *scan);
+extern bool relscan_run_ranges(RelScan *scan, const RelScanRange *ranges,
+							   int nranges);
+extern void relscan_progress(RelScan *scan, uint64 *done, uint64 *total);
+extern void relscan_free(RelScan *scan);
+
+#endif							/* RELSCAN_H */
@@ -0,0 +1,146 @@
+/*
+ * scanio.c
+ *	  Read policy of scans: O_DIRECT, dropping read data from the page
+ *	  cache, and limits on bytes and requests per second.
+ *
+ * A buffered scan of a large cluster pushes the server's working set out
+ * of the page cache.  With direct, files are opened with O_DIRECT and read
+ * into aligned buffers, so nothing is cached; file systems that refuse
+ * O_DIRECT fall back to buffered reads.  With dontneed, every chunk is
+ * dropped from the cache with POSIX_FADV_DONTNEED once it has been
+ * processed, which also works where O_DIRECT does not.
+ *
+ * The limits are token buckets shared by all threads of a process: each
+ * request advances the time at which the bytes and requests issued so far
+ * are due, and a thread that is more than SCANIO_BURST ahead of the clock
+ * sleeps until it no longer is.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+
+#include "scanio.h"
+
+/* How far ahead of the limits a burst may run, in seconds */
+#define SCANIO_BURST		0.05
+
+
+void
+scanio_init(ScanIO *io)
+{
+	pthread_mutex_init(&io->lock, NULL);
+	INSTR_TIME_SET_CURRENT(io->start);
+	io->rate_due = 0;
+	io->iops_due = 0;
+}
+
+
+void
+scanio_destroy(ScanIO *io)
+{
+	pthread_mutex_destroy(&io->lock);
+}
+
+
+/*
+ * open() with O_DIRECT if io asks for it and the file system allows it.
+ * io may be NULL for plain buffered reads.
+ */
+int
+scanio_open(const ScanIO *io, const char *path, int flags)
+{
+#ifdef O_DIRECT
+	if (io != NULL && io->direct)
+	{
+		int			fd = open(path, flags | O_DIRECT | PG_BINARY, 0);
+
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+		/* e.g. tmpfs; read through the cache instead */
+	}
+#endif
+	return open(path, flags | PG_BINARY, 0);
+}
+
+
+/*
+ * A buffer suitable for O_DIRECT reads of size bytes.
+ */
+char *
+scanio_alloc(size_t size)
+{
+	void	   *buf;
+	int			rc;
+
+	if ((rc = posix_memalign(&buf, SCANIO_ALIGN, size)) != 0)
+	{
+		errno = rc;
+		pg_fatal("could not allocate %zu bytes: %m", size);
+	}
+	return buf;
+}
+
+
+void
+scanio_free(char *buf)
+{
+	free(buf);
+}
+
+
+/*
+ * Account for a read or write of bytes about to be issued, sleeping first
+ * if the limits of io are exceeded.  io may be NULL.
+ */
+void
+scanio_throttle(ScanIO *io, size_t bytes)
+{
+	instr_time	now;
+	double		elapsed;
+	double		wait = 0;
+
+	if (io == NULL || (io->max_rate == 0 && io->max_iops == 0))
+		return;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, io->start);
+	elapsed = INSTR_TIME_GET_DOUBLE(now);
+
+	pthread_mutex_lock(&io->lock);
+	if (io->max_rate > 0)
+	{
+		/* an idle bucket fills up to the burst, no further */
+		io->rate_due = Max(io->rate_due, elapsed - SCANIO_BURST);
+		io->rate_due += (double) bytes / io->max_rate;
+		wait = Max(wait, io->rate_due - elapsed - SCANIO_BURST);
+	}
+	if (io->max_iops > 0)
+	{
+		io->iops_due = Max(io->iops_due, elapsed - SCANIO_BURST);
+		io->iops_due += 1.0 / io->max_iops;
+		wait = Max(wait, io->iops_due - elapsed - SCANIO_BURST);
+	}
+	pthread_mutex_unlock(&io->lock);
+
+	if (wait > 0)
+		pg_usleep((long) (wait * 1000000.0));
+}
+
+
+/*
+ * The caller is done with len bytes at offset of fd.  io may be NULL.
+ */
+void
+scanio_done(const ScanIO *io, int fd, off_t offset, size_t len)
+{
+	if (io != NULL && io->dontneed)
+		(void) posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
@@ -0,0 +1,49 @@
+/*
+ * scanio.h
+ *	  How scans of relation files and WAL do their reads, so that they can
+ *	  run next to a production server without disturbing it.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef SCANIO_H
+#define SCANIO_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "portability/instr_time.h"
+
+typedef struct ScanIO
+{
+	/* set before scanio_init() */
+	bool		direct;			/* open with O_DIRECT where supported */
+	bool		dontneed;		/* drop what was read from the page cache */
+	uint64		max_rate;		/* bytes per second, 0 = no limit */
+	uint64		max_iops;		/* requests per second, 0 = no limit */
+	bool		adaptive;		/* tune reads in flight, see concurrency.c */
+
+	/* token buckets shared by all threads, protected by lock */
+	pthread_mutex_t lock;
+	instr_time	start;
+	double		rate_due;		/* seconds since start when the bytes so far
+								 * may have been issued */
+	double		iops_due;		/* same for requests */
+} ScanIO;
+
+/* Buffers for O_DIRECT reads must be aligned to this */
+#ifdef PG_IO_ALIGN_SIZE
+#define SCANIO_ALIGN		PG_IO_ALIGN_SIZE
+#else
+/* PG_IO_ALIGN_SIZE is new in 16; the same value serves 15 */
+#define SCANIO_ALIGN		4096
+#endif
+
+extern void scanio_init(ScanIO *io);
+extern void scanio_destroy(ScanIO *io);
+extern int	scanio_open(const ScanIO *io, const char *path, int flags);
+extern char *scanio_alloc(size_t size);
+extern void scanio_free(char *buf);
+extern void scanio_throttle(ScanIO *io, size_t bytes);
+extern void scanio_done(const ScanIO *io, int fd, off_t offset, size_t len);
+
+#endif							/* SCANIO_H */
@@ -0,0 +1,629 @@
+/*
+ * serve.c
+ *	  Long-lived request loop for --serve.
+ *
+ * Requests arrive on a Unix-domain stream socket as frames: a 4-byte
+ * big-endian length followed by that many bytes of NUL-separated
+ * arguments, spelled exactly like the command-line options.  Each request
+ * is run in a child forked from the already-initialized server process, so
+ * exec, dynamic linking and logging setup are paid once, and a request that
+ * fails with pg_fatal() only ends its own child.  The reply frame carries
+ * a status line ("status=N elapsed_us=N") followed by whatever the request
+ * printed.
+ *
+ * Every connection is served by a child of its own, up to
+ * SERVE_MAX_CONNECTIONS at a time, so a slow or idle client does not hold
+ * up the others.  Requests within a connection run in order, and requests
+ * editing the same output directory take turns on a lock of it, see
+ * serve_lock_directory().  The server waits in poll() on the listening
+ * socket and a self-pipe written by its signal handlers, so SIGINT,
+ * SIGTERM and SIGUSR1 take effect on an idle server too.  On shutdown the
+ * connections are closed for reading, which ends each once its running
+ * request has replied.
+ *
+ * With collect_stats, each connection child has a slot in a shared
+ * anonymous mapping.  Its request children leave their PgControlStats
+ * there and it folds them into per-phase latency histograms of the slot,
+ * which the server sums up and prints as JSON on SIGUSR1 and at shutdown.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+#include "lib/stringinfo.h"
+#include "port/pg_bswap.h"
+#include "portability/instr_time.h"
+
+#include "pg_control_editor.h"
+
+#define SERVE_MAX_REQUEST	65536
+#define SERVE_MAX_ARGS		64
+#define SERVE_MAX_CONNECTIONS	16
+
+/* Statistics of one connection child, in shared memory */
+typedef struct ServeSlot
+{
+	PgControlStats stats;		/* of the request running now */
+	LatencyHistogram request_hist;
+	LatencyHistogram phase_hist[PGCONTROL_NUM_PHASES];
+} ServeSlot;
+
+/* Where a request child reports its statistics; NULL when not collecting */
+PgControlStats *serve_stats_slot = NULL;
+
+static volatile sig_atomic_t shutdown_requested = false;
+static volatile sig_atomic_t report_requested = false;
+static volatile sig_atomic_t child_exited = false;
+static int	signal_pipe[2] = {-1, -1};
+
+static ServeSlot *slots = NULL;
+static pid_t conn_pids[SERVE_MAX_CONNECTIONS];
+static int	conn_fds[SERVE_MAX_CONNECTIONS];
+static int	nconnections = 0;
+
+static void set_signal(int signo, void (*handler) (SIGNAL_ARGS));
+static void handle_shutdown(SIGNAL_ARGS);
+static void handle_report(SIGNAL_ARGS);
+static void handle_child(SIGNAL_ARGS);
+static void wake_server(void);
+static void accept_connection(int listen_fd, request_handler handler);
+static void reap_connections(bool block);
+static void report_histograms(void);
+static void serve_connection(int conn, request_handler handler,
+							 ServeSlot *slot);
+static bool send_reply(int conn, int result, uint64 elapsed_us,
+					   StringInfo output);
+static bool recv_fully(int fd, char *buf, size_t len);
+static bool send_fully(int fd, const char *buf, size_t len);
+
+
+void
+serve(const char *socket_path, request_handler handler, bool collect_stats)
+{
+	struct sockaddr_un addr;
+	int			listen_fd;
+	int			i;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		pg_fatal("socket path \"%s\" is too long", socket_path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path));
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		pg_fatal("could not create socket: %m");
+
+	/* A stale socket file from an earlier run would make bind() fail */
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		pg_fatal("could not bind to socket \"%s\": %m", socket_path);
+	if (chmod(socket_path, 0600) < 0)
+		pg_fatal("could not set permissions of socket \"%s\": %m", socket_path);
+	if (listen(listen_fd, 64) < 0)
+		pg_fatal("could not listen on socket \"%s\": %m", socket_path);
+
+	/* A client gone between poll() and accept() must not block us */
+	if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0)
+		pg_fatal("could not set socket to nonblocking mode: %m");
+
+	if (pipe(signal_pipe) < 0)
+		pg_fatal("could not create pipe: %m");
+	for (i = 0; i < 2; i++)
+	{
+		if (fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK) < 0)
+			pg_fatal("could not set pipe to nonblocking mode: %m");
+	}
+
+	if (collect_stats)
+	{
+		slots = mmap(NULL, sizeof(ServeSlot) * SERVE_MAX_CONNECTIONS,
+					 PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (slots == MAP_FAILED)
+			pg_fatal("could not create shared memory for statistics: %m");
+		set_signal(SIGUSR1, handle_report);
+	}
+
+	pqsignal(SIGPIPE, SIG_IGN);
+	set_signal(SIGINT, handle_shutdown);
+	set_signal(SIGTERM, handle_shutdown);
+	set_signal(SIGCHLD, handle_child);
+
+	while (!shutdown_requested)
+	{
+		struct pollfd fds[2];
+		int			nfds = 0;
+		char		drain[64];
+
+		fds[nfds].fd = signal_pipe[0];
+		fds[nfds++].events = POLLIN;
+		/* With every slot taken, only the exit of a child wakes us */
+		if (nconnections < SERVE_MAX_CONNECTIONS)
+		{
+			fds[nfds].fd = listen_fd;
+			fds[nfds++].events = POLLIN;
+		}
+
+		if (poll(fds, nfds, -1) < 0)
+		{
+			if (errno != EINTR)
+				pg_fatal("could not wait for connections: %m");
+			continue;
+		}
+
+		while (read(signal_pipe[0], drain, sizeof(drain)) > 0)
+			;
+
+		if (child_exited)
+		{
+			child_exited = false;
+			reap_connections(false);
+		}
+
+		if (report_requested)
+		{
+			report_requested = false;
+			report_histograms();
+		}
+
+		if (nfds > 1 && (fds[1].revents & POLLIN) && !shutdown_requested)
+			accept_connection(listen_fd, handler);
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+
+	/* Let every connection finish the request it is running, then end it */
+	for (i = 0; i < SERVE_MAX_CONNECTIONS; i++)
+	{
+		if (conn_pids[i] != 0)
+			shutdown(conn_fds[i], SHUT_RD);
+	}
+	reap_connections(true);
+
+	if (collect_stats)
+		report_histograms();
+}
+
+
+/*
+ * Install a handler that interrupts the system call it arrives in, unlike
+ * pqsignal(), which restarts it.
+ */
+static void
+set_signal(int signo, void (*handler) (SIGNAL_ARGS))
+{
+	struct sigaction act;
+
+	act.sa_handler = handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	if (sigaction(signo, &act, NULL) < 0)
+		pg_fatal("could not set signal handler: %m");
+}
+
+
+static void
+handle_shutdown(SIGNAL_ARGS)
+{
+	shutdown_requested = true;
+	wake_server();
+}
+
+
+static void
+handle_report(SIGNAL_ARGS)
+{
+	report_requested = true;
+	wake_server();
+}
+
+
+static void
+handle_child(SIGNAL_ARGS)
+{
+	child_exited = true;
+	wake_server();
+}
+
+
+/*
+ * Make the poll() of the server loop return; called from signal handlers.
+ */
+static void
+wake_server(void)
+{
+	int			save_errno = errno;
+
+	if (signal_pipe[1] >= 0 && write(signal_pipe[1], "", 1) < 0)
+	{
+		/* A full pipe wakes the loop just as well */
+	}
+	errno = save_errno;
+}
+
+
+/*
+ * Accept one connection and fork a child to serve it in a free slot.
+ */
+static void
+accept_connection(int listen_fd, request_handler handler)
+{
+	int			conn;
+	int			slot;
+	int			i;
+	pid_t		pid;
+
+	if ((conn = accept(listen_fd, NULL, NULL)) < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == ECONNABORTED)
+			return;
+		pg_fatal("could not accept connection: %m");
+	}
+
+	/* Some platforms let the accepted socket inherit O_NONBLOCK */
+	if (fcntl(conn, F_SETFL, 0) < 0)
+		pg_fatal("could not set socket to blocking mode: %m");
+
+	for (slot = 0; slot < SERVE_MAX_CONNECTIONS; slot++)
+	{
+		if (conn_pids[slot] == 0)
+			break;
+	}
+	Assert(slot < SERVE_MAX_CONNECTIONS);
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0)
+		pg_fatal("could not fork: %m");
+	if (pid == 0)
+	{
+		/* The server decides when a connection ends, see serve() */
+		pqsignal(SIGINT, SIG_IGN);
+		pqsignal(SIGTERM, SIG_IGN);
+		pqsignal(SIGUSR1, SIG_IGN);
+		pqsignal(SIGCHLD, SIG_DFL);
+		close(listen_fd);
+		close(signal_pipe[0]);
+		close(signal_pipe[1]);
+		signal_pipe[0] = signal_pipe[1] = -1;
+
+		/*
+		 * Drop the other connections' sockets, or a client would not see
+		 * EOF on its connection until every later sibling has ended too.
+		 */
+		for (i = 0; i < SERVE_MAX_CONNECTIONS; i++)
+		{
+			if (conn_pids[i] != 0)
+				close(conn_fds[i]);
+			conn_pids[i] = 0;
+		}
+		nconnections = 0;
+
+		serve_connection(conn, handler, slots != NULL ? &slots[slot] : NULL);
+		fflush(NULL);
+		_exit(0);
+	}
+
+	conn_pids[slot] = pid;
+	conn_fds[slot] = conn;
+	nconnections++;
+}
+
+
+/*
+ * Collect the connection children that have exited; with block, wait until
+ * all of them have.
+ */
+static void
+reap_connections(bool block)
+{
+	while (nconnections > 0)
+	{
+		int			status;
+		pid_t		pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+		int			i;
+
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pg_fatal("could not wait for child process: %m");
+		}
+		if (pid == 0)
+			break;
+
+		for (i = 0; i < SERVE_MAX_CONNECTIONS; i++)
+		{
+			if (conn_pids[i] == pid)
+			{
+				close(conn_fds[i]);
+				conn_pids[i] = 0;
+				nconnections--;
+				break;
+			}
+		}
+	}
+}
+
+
+static void
+report_histograms(void)
+{
+	LatencyHistogram request_hist;
+	LatencyHistogram phase_hist[PGCONTROL_NUM_PHASES];
+	StringInfoData out;
+	int			i;
+	int			j;
+
+	/* Slots in use are still written to; a report is only a snapshot */
+	memset(&request_hist, 0, sizeof(request_hist));
+	memset(phase_hist, 0, sizeof(phase_hist));
+	for (i = 0; i < SERVE_MAX_CONNECTIONS; i++)
+	{
+		histogram_merge(&request_hist, &slots[i].request_hist);
+		for (j = 0; j < PGCONTROL_NUM_PHASES; j++)
+			histogram_merge(&phase_hist[j], &slots[i].phase_hist[j]);
+	}
+
+	initStringInfo(&out);
+	appendStringInfoString(&out, "{");
+	histogram_append_json(&out, "request", &request_hist);
+	for (i = 0; i < PGCONTROL_NUM_PHASES; i++)
+	{
+		appendStringInfoString(&out, ", ");
+		histogram_append_json(&out, pgcontrol_phase_names[i], &phase_hist[i]);
+	}
+	appendStringInfoString(&out, "}\n");
+
+	fwrite(out.data, 1, out.len, stdout);
+	fflush(stdout);
+	pfree(out.data);
+}
+
+
+/*
+ * Run requests from one client until it disconnects.  Runs in the
+ * connection's child; slot is NULL when not collecting statistics.
+ */
+static void
+serve_connection(int conn, request_handler handler, ServeSlot *slot)
+{
+	char	   *request = pg_malloc(SERVE_MAX_REQUEST + 1);
+	char		chunk[8192];
+	StringInfoData reply;
+
+	if (slot != NULL)
+		serve_stats_slot = &slot->stats;
+
+	initStringInfo(&reply);
+
+	for (;;)
+	{
+		uint32		len;
+		char	   *args[SERVE_MAX_ARGS + 2];
+		int			nargs = 0;
+		char	   *p;
+		int			pipefd[2];
+		pid_t		pid;
+		int			status;
+		int			result;
+		ssize_t		rc;
+		instr_time	start;
+		instr_time	duration;
+
+		if (!recv_fully(conn, (char *) &len, sizeof(len)))
+			break;
+		len = pg_ntoh32(len);
+		if (len > SERVE_MAX_REQUEST)
+		{
+			pg_log_warning("request of %u bytes exceeds the limit, dropping connection", len);
+			break;
+		}
+		if (!recv_fully(conn, request, len))
+			break;
+		request[len] = '\0';
+
+		/* argv[0] is not transmitted; getopt skips it anyway */
+		args[nargs++] = "pg_control_editor";
+		for (p = request; p < request + len && nargs <= SERVE_MAX_ARGS;
+			 p += strlen(p) + 1)
+			args[nargs++] = p;
+		args[nargs] = NULL;
+		if (p < request + len)
+		{
+			pg_log_warning("request has more than %d arguments, dropping connection",
+						   SERVE_MAX_ARGS);
+			break;
+		}
+
+		if (pipe(pipefd) < 0)
+			pg_fatal("could not create pipe: %m");
+
+		if (serve_stats_slot != NULL)
+			memset(serve_stats_slot, 0, sizeof(PgControlStats));
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		fflush(NULL);
+		pid = fork();
+		if (pid < 0)
+			pg_fatal("could not fork: %m");
+		if (pid == 0)
+		{
+			int			devnull;
+
+			/* Child: report messages to the client instead of our stderr */
+			close(conn);
+			close(pipefd[0]);
+			dup2(pipefd[1], STDOUT_FILENO);
+			dup2(pipefd[1], STDERR_FILENO);
+			close(pipefd[1]);
+
+			/* The server's stdin is not the client's to read */
+			if ((devnull = open(DEVNULL, O_RDONLY, 0)) >= 0)
+			{
+				dup2(devnull, STDIN_FILENO);
+				close(devnull);
+			}
+
+			pqsignal(SIGINT, SIG_DFL);
+			pqsignal(SIGTERM, SIG_DFL);
+
+			result = handler(nargs, args);
+			fflush(NULL);
+			_exit(result);
+		}
+
+		close(pipefd[1]);
+		resetStringInfo(&reply);
+		while ((rc = read(pipefd[0], chunk, sizeof(chunk))) != 0)
+		{
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				pg_fatal("could not read from pipe: %m");
+			}
+			appendBinaryStringInfo(&reply, chunk, rc);
+		}
+		close(pipefd[0]);
+
+		while (waitpid(pid, &status, 0) < 0)
+		{
+			if (errno != EINTR)
+				pg_fatal("could not wait for child process: %m");
+		}
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		if (slot != NULL)
+		{
+			int			i;
+
+			histogram_add(&slot->request_hist,
+						  (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0));
+			for (i = 0; i < PGCONTROL_NUM_PHASES; i++)
+			{
+				if (slot->stats.phase_calls[i] > 0)
+					histogram_add(&slot->phase_hist[i], slot->stats.phase_ns[i]);
+			}
+		}
+
+		if (WIFEXITED(status))
+			result = WEXITSTATUS(status);
+		else
+			result = 128 + WTERMSIG(status);
+
+		if (!send_reply(conn, result, INSTR_TIME_GET_MICROSEC(duration), &reply))
+			break;
+	}
+
+	pfree(reply.data);
+	pg_free(request);
+}
+
+
+/*
+ * Hold an exclusive lock on datadir until the request ends, so requests of
+ * different connections editing the same directory do not interleave their
+ * read and write of pg_control.  A directory that does not exist yet is
+ * created first, just as writing pg_control would, so that it is locked
+ * too.
+ */
+void
+serve_lock_directory(const char *datadir)
+{
+	int			fd;
+
+	if (mkdir(datadir, 0755) != 0 && errno != EEXIST)
+		pg_fatal("could not create directory \"%s\": %m", datadir);
+	if ((fd = open(datadir, O_RDONLY, 0)) < 0)
+		pg_fatal("could not open directory \"%s\": %m", datadir);
+
+	/* fd stays open; the lock goes away with the request's process */
+	while (flock(fd, LOCK_EX) < 0)
+	{
+		if (errno != EINTR)
+			pg_fatal("could not lock directory \"%s\": %m", datadir);
+	}
+}
+
+
+/*
+ * Send one reply frame: the status line followed by the request's output.
+ */
+static bool
+send_reply(int conn, int result, uint64 elapsed_us, StringInfo output)
+{
+	StringInfoData frame;
+	uint32		len = 0;
+	bool		ok;
+
+	initStringInfo(&frame);
+	appendBinaryStringInfo(&frame, (char *) &len, sizeof(len));
+	appendStringInfo(&frame, "status=%d elapsed_us=" UINT64_FORMAT "\n",
+					 result, elapsed_us);
+	appendBinaryStringInfo(&frame, output->data, output->len);
+
+	len = pg_hton32((uint32) (frame.len - sizeof(len)));
+	memcpy(frame.data, &len, sizeof(len));
+
+	ok = send_fully(conn, frame.data, frame.len);
+	pfree(frame.data);
+	return ok;
+}
+
+
+static bool
+recv_fully(int fd, char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		rc = recv(fd, buf, len, 0);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return false;
+		buf += rc;
+		len -= rc;
+	}
+	return true;
+}
+
+
+static bool
+send_fully(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		rc = send(fd, buf, len, 0);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return false;
+		buf += rc;
+		len -= rc;
+	}
+	return true;
+}
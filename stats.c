@@ -0,0 +1,112 @@
+/*
+ * stats.c
+ *	  Reporting of per-phase timings (--stats=json).
+ *
+ * A single edit is reported as one JSON record.  The --serve loop also
+ * folds every request into log2-bucketed latency histograms per phase,
+ * which are printed on SIGUSR1 and at shutdown.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include "port/pg_bitutils.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+
+
+/*
+ * Append the phases of stats as members of an enclosing JSON object.
+ */
+void
+stats_append_json(StringInfo out, const PgControlStats *stats)
+{
+	int			i;
+
+	appendStringInfo(out, "\"bytes_read\": " UINT64_FORMAT
+					 ", \"bytes_written\": " UINT64_FORMAT ", \"phases\": {",
+					 stats->bytes_read, stats->bytes_written);
+	for (i = 0; i < PGCONTROL_NUM_PHASES; i++)
+		appendStringInfo(out, "%s\"%s\": {\"ns\": " UINT64_FORMAT ", \"calls\": %u}",
+						 i > 0 ? ", " : "", pgcontrol_phase_names[i],
+						 stats->phase_ns[i], stats->phase_calls[i]);
+	appendStringInfoChar(out, '}');
+}
+
+
+void
+histogram_add(LatencyHistogram *hist, uint64 ns)
+{
+	int			bucket = ns == 0 ? 0 : pg_leftmost_one_pos64(ns) + 1;
+
+	hist->counts[bucket]++;
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+}
+
+
+void
+histogram_merge(LatencyHistogram *into, const LatencyHistogram *from)
+{
+	int			i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		into->counts[i] += from->counts[i];
+	into->count += from->count;
+	into->sum_ns += from->sum_ns;
+	if (from->max_ns > into->max_ns)
+		into->max_ns = from->max_ns;
+}
+
+
+/*
+ * Upper bound of the bucket holding the given quantile.
+ */
+static uint64
+histogram_quantile(const LatencyHistogram *hist, double q)
+{
+	uint64		target = (uint64) (q * hist->count);
+	uint64		seen = 0;
+	int			i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += hist->counts[i];
+		if (seen > target)
+		{
+			if (i == 0)
+				return 0;
+			if (i >= 64)
+				return hist->max_ns;
+			return Min(((uint64) 1 << i) - 1, hist->max_ns);
+		}
+	}
+	return hist->max_ns;
+}
+
+
+void
+histogram_append_json(StringInfo out, const char *name,
+					  const LatencyHistogram *hist)
+{
+	appendStringInfo(out, "\"%s\": {\"count\": " UINT64_FORMAT, name, hist->count);
+	if (hist->count > 0)
+		appendStringInfo(out,
+						 ", \"mean_ns\": " UINT64_FORMAT
+						 ", \"p50_ns\": " UINT64_FORMAT
+						 ", \"p90_ns\": " UINT64_FORMAT
+						 ", \"p99_ns\": " UINT64_FORMAT
+						 ", \"max_ns\": " UINT64_FORMAT,
+						 hist->sum_ns / hist->count,
+						 histogram_quantile(hist, 0.50),
+						 histogram_quantile(hist, 0.90),
+						 histogram_quantile(hist, 0.99),
+						 hist->max_ns);
+	appendStringInfoChar(out, '}');
+}
@@ -0,0 +1,373 @@
+/*
+ * tar_extract.c
+ *	  Extract a base backup tar archive into the output data directory,
+ *	  writing the edited pg_control in the same pass.
+ *
+ * Only the plain ustar format written by pg_basebackup -Ft is understood;
+ * compressed archives have to be piped through the decompressor first.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+#include "catalog/pg_control.h"
+#include "pgtar.h"
+
+#include "pg_control_editor.h"
+
+#define TAR_BLOCK			512
+#define TAR_IO_SIZE			(1024 * 1024)
+#define TAR_PADDING(size)	((TAR_BLOCK - (size) % TAR_BLOCK) % TAR_BLOCK)
+
+/* ustar header field offsets */
+#define TAR_OFFSET_NAME		0
+#define TAR_OFFSET_MODE		100
+#define TAR_OFFSET_SIZE		124
+#define TAR_OFFSET_CHECKSUM	148
+#define TAR_OFFSET_TYPEFLAG	156
+#define TAR_OFFSET_LINKNAME	157
+#define TAR_OFFSET_PREFIX	345
+
+static bool read_fully(int fd, char *buf, size_t len);
+static void skip_bytes(int fd, char *iobuf, uint64 len, const char *tarfile);
+static void extract_file(int fd, char *iobuf, const char *path, uint64 size,
+						 mode_t mode, const char *tarfile);
+static void write_fully(int fd, const char *buf, size_t len, const char *path);
+static void make_parent_directory(const char *path);
+static void check_parent_symlinks(const char *pgdata_out, const char *member,
+								  const char *tarfile);
+
+
+void
+extract_tar(const char *tarfile, const char *pgdata_out,
+			control_edit_hook edit_control)
+{
+	int			fd;
+	char	   *iobuf;
+	char		header[TAR_BLOCK];
+	bool		found_control = false;
+
+	if (strcmp(tarfile, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(tarfile, O_RDONLY | PG_BINARY, 0)) < 0)
+		pg_fatal("could not open file \"%s\" for reading: %m", tarfile);
+
+	if (mkdir(pgdata_out, 0700) < 0 && errno != EEXIST)
+		pg_fatal("could not create directory \"%s\": %m", pgdata_out);
+
+	iobuf = (char *) pg_malloc(TAR_IO_SIZE);
+
+	for (;;)
+	{
+		char		name[MAXPGPATH];
+		char		path[MAXPGPATH];
+		char		linkname[101];
+		char	   *member;
+		uint64		size;
+		mode_t		mode;
+
+		if (!read_fully(fd, header, TAR_BLOCK))
+			pg_fatal("unexpected end of tar archive \"%s\"", tarfile);
+
+		/* A zero block marks the end of the archive */
+		if (header[0] == '\0')
+			break;
+
+		if (tarChecksum(header) !=
+			(int) read_tar_number(&header[TAR_OFFSET_CHECKSUM], 8))
+			pg_fatal("tar archive \"%s\" has a corrupt header", tarfile);
+
+		if (header[TAR_OFFSET_PREFIX] != '\0')
+			snprintf(name, sizeof(name), "%.155s/%.100s",
+					 &header[TAR_OFFSET_PREFIX], &header[TAR_OFFSET_NAME]);
+		else
+			snprintf(name, sizeof(name), "%.100s", &header[TAR_OFFSET_NAME]);
+
+		member = name;
+		while (strncmp(member, "./", 2) == 0)
+			member += 2;
+		if (member[0] != '\0' && member[strlen(member) - 1] == '/')
+			member[strlen(member) - 1] = '\0';
+
+		size = read_tar_number(&header[TAR_OFFSET_SIZE], 12);
+		mode = (mode_t) read_tar_number(&header[TAR_OFFSET_MODE], 8) & 07777;
+
+		if (member[0] == '\0')
+		{
+			skip_bytes(fd, iobuf, size + TAR_PADDING(size), tarfile);
+			continue;
+		}
+		if (!path_is_relative_and_below_cwd(member))
+			pg_fatal("tar archive \"%s\" contains unsafe path \"%s\"",
+					 tarfile, member);
+		check_parent_symlinks(pgdata_out, member, tarfile);
+
+		snprintf(path, sizeof(path), "%s/%s", pgdata_out, member);
+
+		switch (header[TAR_OFFSET_TYPEFLAG])
+		{
+			case '0':
+			case '\0':
+				if (strcmp(member, XLOG_CONTROL_FILE) == 0)
+				{
+					int			cfd;
+
+					if (size > PG_CONTROL_FILE_SIZE)
+						pg_fatal("\"%s\" in tar archive \"%s\" is too large",
+								 member, tarfile);
+					if (!read_fully(fd, iobuf, size))
+						pg_fatal("unexpected end of tar archive \"%s\"", tarfile);
+					skip_bytes(fd, iobuf + PG_CONTROL_FILE_SIZE,
+							   TAR_PADDING(size), tarfile);
+
+					edit_control(iobuf, size);
+
+					make_parent_directory(path);
+					if ((cfd = open(path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY,
+									mode)) < 0)
+						pg_fatal("could not create file \"%s\": %m", path);
+					write_fully(cfd, iobuf, PG_CONTROL_FILE_SIZE, path);
+#ifndef HAVE_SYNCFS
+					if (fsync(cfd) != 0)
+						pg_fatal("could not fsync file \"%s\": %m", path);
+#endif
+					close(cfd);
+					found_control = true;
+				}
+				else
+					extract_file(fd, iobuf, path, size, mode, tarfile);
+				break;
+
+			case '5':
+				make_parent_directory(path);
+				if (mkdir(path, mode) < 0 && errno != EEXIST)
+					pg_fatal("could not create directory \"%s\": %m", path);
+				skip_bytes(fd, iobuf, size + TAR_PADDING(size), tarfile);
+				break;
+
+			case '2':
+				snprintf(linkname, sizeof(linkname), "%.100s",
+						 &header[TAR_OFFSET_LINKNAME]);
+
+				/*
+				 * Only tablespace links may point outside the data
+				 * directory; anything else could lead a later member out.
+				 */
+				if (strncmp(member, "pg_tblspc/", 10) != 0 &&
+					!path_is_relative_and_below_cwd(linkname))
+					pg_fatal("tar archive \"%s\" contains symbolic link \"%s\" with unsafe target \"%s\"",
+							 tarfile, member, linkname);
+				make_parent_directory(path);
+				if (symlink(linkname, path) < 0)
+					pg_fatal("could not create symbolic link \"%s\": %m", path);
+				skip_bytes(fd, iobuf, size + TAR_PADDING(size), tarfile);
+				break;
+
+			default:
+				pg_log_warning("skipping tar member \"%s\" of unsupported type '%c'",
+							   member, header[TAR_OFFSET_TYPEFLAG]);
+				skip_bytes(fd, iobuf, size + TAR_PADDING(size), tarfile);
+				break;
+		}
+	}
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+	pg_free(iobuf);
+
+	if (!found_control)
+		pg_fatal("tar archive \"%s\" does not contain \"%s\"",
+				 tarfile, XLOG_CONTROL_FILE);
+
+#ifdef HAVE_SYNCFS
+	/* One filesystem-wide flush instead of an fsync per member */
+	{
+		int			dfd;
+
+		if ((dfd = open(pgdata_out, O_RDONLY, 0)) < 0)
+			pg_fatal("could not open directory \"%s\": %m", pgdata_out);
+		if (syncfs(dfd) < 0)
+			pg_fatal("could not synchronize file system for \"%s\": %m",
+					 pgdata_out);
+		close(dfd);
+	}
+#endif
+}
+
+
+/*
+ * Copy one regular file out of the archive, including its block padding.
+ */
+static void
+extract_file(int fd, char *iobuf, const char *path, uint64 size,
+			 mode_t mode, const char *tarfile)
+{
+	int			ofd;
+	uint64		remaining = size;
+
+	make_parent_directory(path);
+	if ((ofd = open(path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY, mode)) < 0)
+		pg_fatal("could not create file \"%s\": %m", path);
+
+#ifdef HAVE_POSIX_FALLOCATE
+	if (size > 0)
+	{
+		int			rc = posix_fallocate(ofd, 0, (off_t) size);
+
+		/* Filesystems without fallocate support are fine, a full disk is not */
+		if (rc == ENOSPC)
+		{
+			errno = rc;
+			pg_fatal("could not allocate space for file \"%s\": %m", path);
+		}
+	}
+#endif
+
+	while (remaining > 0)
+	{
+		size_t		chunk = Min(remaining, TAR_IO_SIZE);
+
+		if (!read_fully(fd, iobuf, chunk))
+			pg_fatal("unexpected end of tar archive \"%s\"", tarfile);
+		write_fully(ofd, iobuf, chunk, path);
+		remaining -= chunk;
+	}
+
+#ifndef HAVE_SYNCFS
+	if (fsync(ofd) != 0)
+		pg_fatal("could not fsync file \"%s\": %m", path);
+#endif
+	if (close(ofd) != 0)
+		pg_fatal("could not close file \"%s\": %m", path);
+
+	skip_bytes(fd, iobuf, TAR_PADDING(size), tarfile);
+}
+
+
+/*
+ * read() until len bytes arrived; returns false on a premature EOF.
+ * Archives may come from a pipe, so short reads are expected.
+ */
+static bool
+read_fully(int fd, char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		rc = read(fd, buf, len);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pg_fatal("could not read tar archive: %m");
+		}
+		if (rc == 0)
+			return false;
+		buf += rc;
+		len -= rc;
+	}
+	return true;
+}
+
+
+/*
+ * Skip len bytes of the archive.  A file or device is seeked over; where
+ * lseek() fails, as on a pipe, the bytes are read in TAR_IO_SIZE chunks.
+ * Seeking past the end of a truncated archive is caught by the next header
+ * read.
+ */
+static void
+skip_bytes(int fd, char *iobuf, uint64 len, const char *tarfile)
+{
+	if (len == 0)
+		return;
+	if (lseek(fd, (off_t) len, SEEK_CUR) >= 0)
+		return;
+
+	while (len > 0)
+	{
+		size_t		chunk = Min(len, TAR_IO_SIZE);
+
+		if (!read_fully(fd, iobuf, chunk))
+			pg_fatal("unexpected end of tar archive \"%s\"", tarfile);
+		len -= chunk;
+	}
+}
+
+
+static void
+write_fully(int fd, const char *buf, size_t len, const char *path)
+{
+	while (len > 0)
+	{
+		ssize_t		rc = write(fd, buf, len);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pg_fatal("could not write file \"%s\": %m", path);
+		}
+		buf += rc;
+		len -= rc;
+	}
+}
+
+
+/*
+ * pg_basebackup emits directory members before their contents, but don't
+ * rely on it.
+ */
+static void
+make_parent_directory(const char *path)
+{
+	char		parent[MAXPGPATH];
+	char	   *sep;
+
+	strlcpy(parent, path, sizeof(parent));
+	sep = strrchr(parent, '/');
+	if (sep == NULL)
+		return;
+	*sep = '\0';
+	if (pg_mkdir_p(parent, 0700) != 0 && errno != EEXIST)
+		pg_fatal("could not create directory \"%s\": %m", parent);
+}
+
+
+/*
+ * Refuse a member below a symbolic link, e.g. one extracted earlier from
+ * the archive: writing through it could land outside the output directory.
+ */
+static void
+check_parent_symlinks(const char *pgdata_out, const char *member,
+					  const char *tarfile)
+{
+	char		path[MAXPGPATH];
+	size_t		base;
+	char	   *sep;
+
+	base = snprintf(path, sizeof(path), "%s/%s", pgdata_out, member);
+	if (base >= sizeof(path))
+		pg_fatal("tar archive \"%s\" contains too long path \"%s\"",
+				 tarfile, member);
+	base = strlen(pgdata_out) + 1;
+
+	for (sep = strchr(path + base, '/'); sep != NULL; sep = strchr(sep + 1, '/'))
+	{
+		struct stat st;
+
+		*sep = '\0';
+		if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode))
+			pg_fatal("tar archive \"%s\" contains \"%s\" below symbolic link \"%s\"",
+					 tarfile, member, path + base);
+		*sep = '/';
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * verify_wal.c
+ *	  Check that the WAL from the redo pointer onward is contiguous and
+ *	  valid (--verify-wal).
+ *
+ * Recovery replays from checkPointCopy.redo and must reach at least the
+ * checkpoint record without a break; whatever lies beyond is replayed as
+ * long as the chain holds.  The scan reads every segment of the checkpoint's
+ * timeline from pg_wal, falling back to --wal-archive for missing ones,
+ * with one worker per segment at a time.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include "access/xlog_internal.h"
+#include "common/logging.h"
+#include "portability/instr_time.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+#include "walscan.h"
+
+/*
+ * Returns 0 if the WAL is contiguous from redo through the checkpoint
+ * record and no valid WAL lies past its end, 1 otherwise.
+ */
+int
+run_verify_wal(const PgControl *ctl, const char *datadir, const char *archive,
+			   int jobs, ScanIO *io)
+{
+	WalScan		scan;
+	XLogRecPtr	checkpoint = pgcontrol_get_value(ctl, "checkPoint");
+	instr_time	start;
+	instr_time	duration;
+	double		secs;
+	char		first[MAXFNAMELEN];
+	char		last[MAXFNAMELEN];
+	int			status = 0;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.pgdata = datadir;
+	scan.archive = archive;
+	scan.segsize = ctl->wal_segsize;
+	scan.tli = pgcontrol_get_value(ctl, "checkPointCopy.ThisTimeLineID");
+	scan.start = pgcontrol_get_value(ctl, "checkPointCopy.redo");
+	scan.nworkers = jobs;
+	scan.io = io;
+
+	INSTR_TIME_SET_CURRENT(start);
+	walscan_run(&scan);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	secs = INSTR_TIME_GET_DOUBLE(duration);
+
+	XLogFileName(first, scan.tli, scan.first_segno, scan.segsize);
+	XLogFileName(last, scan.tli, scan.first_segno + scan.nsegments - 1, scan.segsize);
+
+	printf("redo                %X/%X\n", LSN_FORMAT_ARGS(scan.start));
+	printf("checkpoint          %X/%X\n", LSN_FORMAT_ARGS(checkpoint));
+	printf("end of WAL          %X/%X (%s)\n", LSN_FORMAT_ARGS(scan.end), scan.errmsg);
+	printf("segments            %d, %s to %s\n", scan.nsegments, first, last);
+	printf("records             " UINT64_FORMAT "\n", scan.nrecords);
+	printf("read                " UINT64_FORMAT " MB in %.3f s (%.1f MB/s)\n",
+		   scan.bytes_read / (1024 * 1024), secs,
+		   secs > 0 ? scan.bytes_read / (1024.0 * 1024.0) / secs : 0);
+
+	if (scan.end <= checkpoint)
+	{
+		pg_log_error("WAL ends at %X/%X, before the checkpoint record at %X/%X",
+					 LSN_FORMAT_ARGS(scan.end), LSN_FORMAT_ARGS(checkpoint));
+		status = 1;
+	}
+	if (scan.gap)
+	{
+		pg_log_error("WAL has a gap at %X/%X", LSN_FORMAT_ARGS(scan.end));
+		status = 1;
+	}
+
+	pg_free(scan.segments);
+	return status;
+}
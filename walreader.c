@@ -0,0 +1,609 @@
+/*
+ * walreader.c
+ *	  Page and record level WAL reading for pg_control_editor.
+ *
+ * The checks mirror what xlogreader.c does on the server:
+ * XLogReaderValidatePageHeader() for pages and ValidXLogRecord() for
+ * record CRCs.  Reading past the end of the WAL is reported as
+ * WAL_READ_END or WAL_READ_MISSING so callers can tell it from damage.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/xlog_internal.h"
+#include "portability/instr_time.h"
+
+#include "walreader.h"
+
+/* XLogRecordMaxSize of newer servers */
+#define WAL_MAX_RECORD_SIZE		(1020 * 1024 * 1024)
+
+/* Window of walreader_stream_segment(), and the size of the reads filling it */
+#define WAL_WINDOW_SIZE			(4 * 1024 * 1024)
+#define WAL_READ_CHUNK			(1024 * 1024)
+
+static WalReadResult walreader_error(WalReader *reader, WalReadResult result,
+									 const char *fmt,...) pg_attribute_printf(3, 4);
+static WalReadResult open_segment(WalReader *reader, XLogSegNo segno);
+static WalReadResult fill_window(WalReader *reader, uint32 offset);
+
+
+void
+walreader_init(WalReader *reader, const char *pgdata, const char *archive,
+			   int segsize, TimeLineID tli)
+{
+	memset(reader, 0, sizeof(WalReader));
+	reader->pgdata = pgdata;
+	reader->archive = archive;
+	reader->segsize = segsize;
+	reader->tli = tli;
+	reader->fd = -1;
+	reader->pageaddr = InvalidXLogRecPtr;
+	/* Aligned, as segments may be opened with O_DIRECT */
+	reader->page = scanio_alloc(XLOG_BLCKSZ);
+}
+
+
+void
+walreader_close(WalReader *reader)
+{
+	if (reader->fd >= 0)
+		close(reader->fd);
+	reader->fd = -1;
+	if (reader->record != NULL)
+		pg_free(reader->record);
+	reader->record = NULL;
+	reader->record_alloc = 0;
+	if (reader->segbuf != NULL)
+		scanio_free(reader->segbuf);
+	reader->segbuf = NULL;
+	reader->segbuf_valid = false;
+	if (reader->page != NULL)
+		scanio_free(reader->page);
+	reader->page = NULL;
+	reader->pageaddr = InvalidXLogRecPtr;
+}
+
+
+/*
+ * Open segment segno for reading front to back: from now on its pages are
+ * read with large reads into a window of at most WAL_WINDOW_SIZE, which
+ * moves on whenever a page past it is asked for.  This keeps the memory of
+ * a reader bounded whatever the segment size.
+ */
+WalReadResult
+walreader_stream_segment(WalReader *reader, XLogSegNo segno)
+{
+	WalReadResult result;
+
+	reader->segbuf_valid = false;
+	reader->pageaddr = InvalidXLogRecPtr;
+
+	result = open_segment(reader, segno);
+	if (result != WAL_READ_OK)
+		return result;
+
+	if (reader->segbuf == NULL)
+		reader->segbuf = scanio_alloc(Min(reader->segsize, WAL_WINDOW_SIZE));
+	reader->segbuf_segno = segno;
+	reader->segbuf_start = 0;
+	reader->segbuf_len = 0;
+	reader->segbuf_valid = true;
+
+	return WAL_READ_OK;
+}
+
+
+/*
+ * Move the window of the streamed segment to start at offset, and fill it.
+ * Pages are not validated here.
+ */
+static WalReadResult
+fill_window(WalReader *reader, uint32 offset)
+{
+	size_t		want = Min((size_t) (reader->segsize - offset), WAL_WINDOW_SIZE);
+	size_t		done = 0;
+	ssize_t		rc = 0;
+	int			save_errno;
+	instr_time	start;
+	instr_time	duration;
+
+	reader->segbuf_start = offset;
+	reader->segbuf_len = 0;
+
+	/* With a controller, a window fill is one read to it */
+	if (reader->cc != NULL)
+	{
+		concurrency_acquire(reader->cc);
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	while (done < want)
+	{
+		size_t		len = Min(want - done, WAL_READ_CHUNK);
+
+		scanio_throttle(reader->io, len);
+		rc = pg_pread(reader->fd, reader->segbuf + done, len, offset + done);
+		if (rc <= 0)
+			break;
+		done += rc;
+	}
+	save_errno = errno;
+	if (reader->cc != NULL)
+	{
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		concurrency_release(reader->cc, done, INSTR_TIME_GET_DOUBLE(duration));
+	}
+	reader->bytes_read += done;
+	errno = save_errno;
+
+	if (rc < 0)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "could not read file \"%s\": %m", reader->segpath);
+	if (done < want)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "could not read file \"%s\": read %zu of %d",
+							   reader->segpath, offset + done, reader->segsize);
+	scanio_done(reader->io, reader->fd, offset, done);
+	reader->segbuf_len = done;
+
+	return WAL_READ_OK;
+}
+
+
+/*
+ * Find segment segno of the reader's timeline, in pg_wal first and then in
+ * the archive.  Returns false, with the pg_wal path, if it is in neither.
+ */
+bool
+walreader_segment_path(const WalReader *reader, XLogSegNo segno,
+					   char *path, size_t len)
+{
+	char		fname[MAXFNAMELEN];
+	struct stat st;
+
+	XLogFileName(fname, reader->tli, segno, reader->segsize);
+
+	if (reader->archive != NULL)
+	{
+		snprintf(path, len, "%s/%s", reader->archive, fname);
+		if (stat(path, &st) == 0)
+		{
+			/* pg_wal still wins if it has the segment too */
+			char		local[MAXPGPATH];
+
+			snprintf(local, sizeof(local), "%s/%s/%s", reader->pgdata, XLOGDIR, fname);
+			if (stat(local, &st) == 0)
+				strlcpy(path, local, len);
+			return true;
+		}
+	}
+
+	snprintf(path, len, "%s/%s/%s", reader->pgdata, XLOGDIR, fname);
+	return stat(path, &st) == 0;
+}
+
+
+/*
+ * Read and validate the page at pageaddr into reader->page.
+ */
+WalReadResult
+walreader_read_page(WalReader *reader, XLogRecPtr pageaddr)
+{
+	XLogPageHeader hdr = (XLogPageHeader) reader->page;
+	XLogSegNo	segno;
+	uint32		offset;
+	WalReadResult result;
+	ssize_t		rc;
+
+	Assert(pageaddr % XLOG_BLCKSZ == 0);
+
+	if (reader->pageaddr == pageaddr && pageaddr != InvalidXLogRecPtr)
+		return WAL_READ_OK;
+	reader->pageaddr = InvalidXLogRecPtr;
+
+	XLByteToSeg(pageaddr, segno, reader->segsize);
+	result = open_segment(reader, segno);
+	if (result != WAL_READ_OK)
+		return result;
+
+	offset = XLogSegmentOffset(pageaddr, reader->segsize);
+	if (reader->segbuf_valid && reader->segbuf_segno == segno)
+	{
+		if (offset < reader->segbuf_start ||
+			offset - reader->segbuf_start >= reader->segbuf_len)
+		{
+			result = fill_window(reader, offset);
+			if (result != WAL_READ_OK)
+				return result;
+		}
+		memcpy(reader->page, reader->segbuf + (offset - reader->segbuf_start),
+			   XLOG_BLCKSZ);
+	}
+	else
+	{
+		scanio_throttle(reader->io, XLOG_BLCKSZ);
+		rc = pg_pread(reader->fd, reader->page, XLOG_BLCKSZ, offset);
+		if (rc != XLOG_BLCKSZ)
+		{
+			if (rc < 0)
+				return walreader_error(reader, WAL_READ_INVALID,
+									   "could not read file \"%s\": %m", reader->segpath);
+			return walreader_error(reader, WAL_READ_INVALID,
+								   "could not read file \"%s\": read %d of %d",
+								   reader->segpath, (int) rc, XLOG_BLCKSZ);
+		}
+		scanio_done(reader->io, reader->fd, offset, XLOG_BLCKSZ);
+		reader->bytes_read += rc;
+	}
+
+	if (hdr->xlp_magic == 0 && hdr->xlp_pageaddr == 0)
+		return walreader_error(reader, WAL_READ_END,
+							   "zeroed page at %X/%X in \"%s\"",
+							   LSN_FORMAT_ARGS(pageaddr), reader->segpath);
+	if (hdr->xlp_magic != XLOG_PAGE_MAGIC)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "invalid magic number %04X in WAL page at %X/%X",
+							   hdr->xlp_magic, LSN_FORMAT_ARGS(pageaddr));
+	if ((hdr->xlp_info & ~XLP_ALL_FLAGS) != 0)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "invalid info bits %04X in WAL page at %X/%X",
+							   hdr->xlp_info, LSN_FORMAT_ARGS(pageaddr));
+
+	if (offset == 0)
+	{
+		XLogLongPageHeader longhdr = (XLogLongPageHeader) hdr;
+
+		if ((hdr->xlp_info & XLP_LONG_HEADER) == 0)
+			return walreader_error(reader, WAL_READ_INVALID,
+								   "missing long header in WAL segment \"%s\"",
+								   reader->segpath);
+		if (longhdr->xlp_seg_size != reader->segsize)
+			return walreader_error(reader, WAL_READ_INVALID,
+								   "WAL segment \"%s\" has segment size %u, expected %d",
+								   reader->segpath, longhdr->xlp_seg_size,
+								   reader->segsize);
+		if (longhdr->xlp_xlog_blcksz != XLOG_BLCKSZ)
+			return walreader_error(reader, WAL_READ_INVALID,
+								   "WAL segment \"%s\" has page size %u, expected %d",
+								   reader->segpath, longhdr->xlp_xlog_blcksz,
+								   XLOG_BLCKSZ);
+	}
+
+	/* A recycled segment still carries the addresses of its old life */
+	if (hdr->xlp_pageaddr < pageaddr)
+		return walreader_error(reader, WAL_READ_END,
+							   "recycled WAL page at %X/%X (page address %X/%X)",
+							   LSN_FORMAT_ARGS(pageaddr),
+							   LSN_FORMAT_ARGS(hdr->xlp_pageaddr));
+	if (hdr->xlp_pageaddr != pageaddr)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "unexpected page address %X/%X in WAL page at %X/%X",
+							   LSN_FORMAT_ARGS(hdr->xlp_pageaddr),
+							   LSN_FORMAT_ARGS(pageaddr));
+	if (hdr->xlp_tli > reader->tli)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "timeline %u in WAL page at %X/%X is after timeline %u",
+							   hdr->xlp_tli, LSN_FORMAT_ARGS(pageaddr), reader->tli);
+
+	reader->pageaddr = pageaddr;
+	return WAL_READ_OK;
+}
+
+
+/*
+ * Read the record starting at lsn into reader->record, following it onto
+ * as many continuation pages as it needs, and verify its CRC.
+ */
+WalReadResult
+walreader_read_record(WalReader *reader, XLogRecPtr lsn)
+{
+	XLogPageHeader hdr = (XLogPageHeader) reader->page;
+	uint32		offset = lsn % XLOG_BLCKSZ;
+	XLogRecPtr	pageaddr = lsn - offset;
+	XLogRecord *record;
+	uint32		tot_len;
+	uint32		gathered;
+	uint32		chunk;
+	pg_crc32c	crc;
+	WalReadResult result;
+
+	result = walreader_read_page(reader, pageaddr);
+	if (result != WAL_READ_OK)
+		return result;
+
+	if (offset < XLogPageHeaderSize(hdr) ||
+		((hdr->xlp_info & XLP_FIRST_IS_CONTRECORD) != 0 &&
+		 offset < XLogPageHeaderSize(hdr) + MAXALIGN(hdr->xlp_rem_len)))
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "%X/%X is not the start of a record",
+							   LSN_FORMAT_ARGS(lsn));
+
+	/* xl_tot_len always lies on the first page, the rest may not */
+	memcpy(&tot_len, reader->page + offset, sizeof(uint32));
+	if (tot_len == 0)
+		return walreader_error(reader, WAL_READ_END,
+							   "no record at %X/%X", LSN_FORMAT_ARGS(lsn));
+	if (tot_len < SizeOfXLogRecord || tot_len > WAL_MAX_RECORD_SIZE)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "invalid record length %u at %X/%X",
+							   tot_len, LSN_FORMAT_ARGS(lsn));
+
+	if (reader->record_alloc < tot_len)
+	{
+		reader->record_alloc = Max(tot_len, 2 * XLOG_BLCKSZ);
+		if (reader->record != NULL)
+			pg_free(reader->record);
+		reader->record = pg_malloc(reader->record_alloc);
+	}
+
+	chunk = Min(tot_len, XLOG_BLCKSZ - offset);
+	memcpy(reader->record, reader->page + offset, chunk);
+	gathered = chunk;
+	reader->record_end = lsn + chunk;
+
+	while (gathered < tot_len)
+	{
+		pageaddr += XLOG_BLCKSZ;
+		result = walreader_read_page(reader, pageaddr);
+		if (result != WAL_READ_OK)
+			return result;
+
+		if ((hdr->xlp_info & XLP_FIRST_IS_CONTRECORD) == 0 ||
+			hdr->xlp_rem_len != tot_len - gathered)
+			return walreader_error(reader, WAL_READ_INVALID,
+								   "invalid continuation at %X/%X of record at %X/%X",
+								   LSN_FORMAT_ARGS(pageaddr), LSN_FORMAT_ARGS(lsn));
+
+		chunk = Min(tot_len - gathered, XLOG_BLCKSZ - XLogPageHeaderSize(hdr));
+		memcpy(reader->record + gathered,
+			   reader->page + XLogPageHeaderSize(hdr), chunk);
+		gathered += chunk;
+		reader->record_end = pageaddr + XLogPageHeaderSize(hdr) + chunk;
+	}
+
+	record = (XLogRecord *) reader->record;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, reader->record + SizeOfXLogRecord, tot_len - SizeOfXLogRecord);
+	COMP_CRC32C(crc, reader->record, offsetof(XLogRecord, xl_crc));
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(record->xl_crc, crc))
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "incorrect resource manager data checksum in record at %X/%X",
+							   LSN_FORMAT_ARGS(lsn));
+
+	return WAL_READ_OK;
+}
+
+
+/*
+ * Find where the first record starting in segment segno begins, skipping
+ * the tail of a record continued from the previous segment.  *lsn is set
+ * to InvalidXLogRecPtr if such a record covers the whole segment.
+ */
+WalReadResult
+walreader_first_record(WalReader *reader, XLogSegNo segno, XLogRecPtr *lsn)
+{
+	XLogPageHeader hdr = (XLogPageHeader) reader->page;
+	XLogRecPtr	pageaddr;
+	XLogRecPtr	segend;
+
+	XLogSegNoOffsetToRecPtr(segno, 0, reader->segsize, pageaddr);
+	XLogSegNoOffsetToRecPtr(segno + 1, 0, reader->segsize, segend);
+
+	for (; pageaddr < segend; pageaddr += XLOG_BLCKSZ)
+	{
+		WalReadResult result = walreader_read_page(reader, pageaddr);
+		uint32		hdrsize;
+
+		if (result != WAL_READ_OK)
+			return result;
+		hdrsize = XLogPageHeaderSize(hdr);
+
+		if ((hdr->xlp_info & XLP_FIRST_IS_CONTRECORD) == 0)
+		{
+			*lsn = pageaddr + hdrsize;
+			return WAL_READ_OK;
+		}
+		if (hdrsize + MAXALIGN(hdr->xlp_rem_len) < XLOG_BLCKSZ)
+		{
+			*lsn = pageaddr + hdrsize + MAXALIGN(hdr->xlp_rem_len);
+			return WAL_READ_OK;
+		}
+	}
+
+	*lsn = InvalidXLogRecPtr;
+	return WAL_READ_OK;
+}
+
+
+/*
+ * Decode the block references of a record read by walreader_read_record(),
+ * following the header layout of DecodeXLogRecord().  blocks must have room
+ * for XLR_MAX_BLOCK_ID + 1 entries.  Returns how many were found, or -1 if
+ * the headers are malformed.
+ */
+int
+walreader_decode_blocks(const XLogRecord *record, WalBlockRef *blocks)
+{
+	const char *ptr = (const char *) record + SizeOfXLogRecord;
+	uint32		remaining = record->xl_tot_len - SizeOfXLogRecord;
+	uint32		datatotal = 0;
+	RelFileLocator rlocator;
+	bool		have_rlocator = false;
+	int			nblocks = 0;
+
+#define DECODE_COPY(dst, len) \
+	do { \
+		if (remaining < (len)) \
+			return -1; \
+		memcpy((dst), ptr, (len)); \
+		ptr += (len); \
+		remaining -= (len); \
+	} while (0)
+
+	while (remaining > datatotal)
+	{
+		uint8		block_id;
+
+		DECODE_COPY(&block_id, sizeof(uint8));
+
+		if (block_id == XLR_BLOCK_ID_DATA_SHORT)
+		{
+			uint8		len;
+
+			DECODE_COPY(&len, sizeof(uint8));
+			datatotal += len;
+			break;				/* main data header is always last */
+		}
+		else if (block_id == XLR_BLOCK_ID_DATA_LONG)
+		{
+			uint32		len;
+
+			DECODE_COPY(&len, sizeof(uint32));
+			datatotal += len;
+			break;
+		}
+		else if (block_id == XLR_BLOCK_ID_ORIGIN)
+		{
+			RepOriginId origin;
+
+			DECODE_COPY(&origin, sizeof(RepOriginId));
+		}
+		else if (block_id == XLR_BLOCK_ID_TOPLEVEL_XID)
+		{
+			TransactionId xid;
+
+			DECODE_COPY(&xid, sizeof(TransactionId));
+		}
+		else if (block_id <= XLR_MAX_BLOCK_ID && nblocks <= XLR_MAX_BLOCK_ID)
+		{
+			WalBlockRef *blk = &blocks[nblocks++];
+			uint8		fork_flags;
+			uint16		data_len;
+
+			DECODE_COPY(&fork_flags, sizeof(uint8));
+			DECODE_COPY(&data_len, sizeof(uint16));
+			datatotal += data_len;
+
+			blk->forknum = fork_flags & BKPBLOCK_FORK_MASK;
+			blk->has_image = (fork_flags & BKPBLOCK_HAS_IMAGE) != 0;
+			blk->image_len = 0;
+			if (blk->has_image)
+			{
+				uint16		hole_offset;
+				uint8		bimg_info;
+
+				DECODE_COPY(&blk->image_len, sizeof(uint16));
+				DECODE_COPY(&hole_offset, sizeof(uint16));
+				DECODE_COPY(&bimg_info, sizeof(uint8));
+				if ((bimg_info & BKPIMAGE_HAS_HOLE) && BKPIMAGE_COMPRESSED(bimg_info))
+				{
+					uint16		hole_length;
+
+					DECODE_COPY(&hole_length, sizeof(uint16));
+				}
+				datatotal += blk->image_len;
+			}
+			if (!(fork_flags & BKPBLOCK_SAME_REL))
+			{
+				DECODE_COPY(&rlocator, sizeof(RelFileLocator));
+				have_rlocator = true;
+			}
+			else if (!have_rlocator)
+				return -1;
+			blk->rlocator = rlocator;
+			DECODE_COPY(&blk->blkno, sizeof(BlockNumber));
+		}
+		else
+			return -1;
+	}
+
+#undef DECODE_COPY
+
+	return nblocks;
+}
+
+
+/*
+ * Where the record after the last one read starts: MAXALIGNed, and past
+ * the header if that falls on a page boundary.
+ */
+XLogRecPtr
+walreader_next_lsn(const WalReader *reader)
+{
+	XLogRecPtr	next = MAXALIGN64(reader->record_end);
+
+	if (next % XLOG_BLCKSZ == 0)
+	{
+		if (XLogSegmentOffset(next, reader->segsize) == 0)
+			next += SizeOfXLogLongPHD;
+		else
+			next += SizeOfXLogShortPHD;
+	}
+	return next;
+}
+
+
+static WalReadResult
+open_segment(WalReader *reader, XLogSegNo segno)
+{
+	struct stat st;
+
+	if (reader->fd >= 0 && reader->segno == segno)
+		return WAL_READ_OK;
+
+	if (reader->fd >= 0)
+		close(reader->fd);
+	reader->fd = -1;
+
+	if (!walreader_segment_path(reader, segno, reader->segpath,
+								sizeof(reader->segpath)))
+		return walreader_error(reader, WAL_READ_MISSING,
+							   "WAL segment \"%s\" not found%s",
+							   reader->segpath,
+							   reader->archive != NULL ? " in pg_wal or the archive" : "");
+
+	if ((reader->fd = scanio_open(reader->io, reader->segpath, O_RDONLY)) < 0)
+		return walreader_error(reader, WAL_READ_MISSING,
+							   "could not open file \"%s\": %m", reader->segpath);
+	if (fstat(reader->fd, &st) != 0)
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "could not stat file \"%s\": %m", reader->segpath);
+	if (st.st_size != reader->segsize)
+	{
+		close(reader->fd);
+		reader->fd = -1;
+		return walreader_error(reader, WAL_READ_INVALID,
+							   "WAL segment \"%s\" has size %lld, expected %d",
+							   reader->segpath, (long long) st.st_size,
+							   reader->segsize);
+	}
+
+	reader->segno = segno;
+	return WAL_READ_OK;
+}
+
+
+static WalReadResult
+walreader_error(WalReader *reader, WalReadResult result, const char *fmt,...)
+{
+	int			save_errno = errno;
+	va_list		args;
+
+	va_start(args, fmt);
+	errno = save_errno;
+	vsnprintf(reader->errmsg, sizeof(reader->errmsg), fmt, args);
+	va_end(args);
+
+	return result;
+}
@@ -0,0 +1,106 @@
+/*
+ * walreader.h
+ *	  Minimal WAL reader for the checks of pg_control_editor.
+ *
+ * The server's xlogreader.c is not available to PGXS builds, so this
+ * reads segments of one timeline directly: it validates page headers,
+ * reassembles records across page and segment boundaries and checks
+ * their CRCs.  Segments missing from pg_wal are looked up in an optional
+ * archive directory.  A WalReader is not shared between threads.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef WALREADER_H
+#define WALREADER_H
+
+#include "access/xlogdefs.h"
+#include "access/xlogrecord.h"
+#include "common/relpath.h"
+#include "storage/block.h"
+#if PG_VERSION_NUM >= 160000
+#include "storage/relfilelocator.h"
+#else
+#include "storage/relfilenode.h"
+#endif
+
+#include "concurrency.h"
+#include "scanio.h"
+
+#if PG_VERSION_NUM < 160000
+/* Before 16 the relation file identity is a RelFileNode, laid out alike */
+typedef RelFileNode RelFileLocator;
+#define RelFileLocatorEquals(locator1, locator2) \
+	RelFileNodeEquals(locator1, locator2)
+#endif
+
+typedef enum WalReadResult
+{
+	WAL_READ_OK,
+	WAL_READ_MISSING,			/* segment in neither pg_wal nor the archive */
+	WAL_READ_END,				/* zeroed or recycled page, or no record */
+	WAL_READ_INVALID			/* bad page header, record header or CRC */
+} WalReadResult;
+
+/* A block reference of a record, from walreader_decode_blocks() */
+typedef struct WalBlockRef
+{
+	RelFileLocator rlocator;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+	bool		has_image;
+	uint16		image_len;		/* stored length, after hole or compression */
+} WalBlockRef;
+
+typedef struct WalReader
+{
+	const char *pgdata;
+	const char *archive;		/* NULL if none */
+	int			segsize;
+	TimeLineID	tli;
+	ScanIO	   *io;				/* read policy and limits, NULL = buffered */
+
+	/* currently open segment */
+	int			fd;
+	XLogSegNo	segno;
+	char		segpath[MAXPGPATH];
+
+	/*
+	 * Window onto the segment being streamed, see walreader_stream_segment().
+	 * segbuf_len bytes from offset segbuf_start are in segbuf.
+	 */
+	char	   *segbuf;
+	XLogSegNo	segbuf_segno;
+	bool		segbuf_valid;
+	uint32		segbuf_start;
+	uint32		segbuf_len;
+	ScanConcurrency *cc;		/* if set, window reads take a slot of it */
+
+	/* last page read, XLOG_BLCKSZ from scanio_alloc() */
+	XLogRecPtr	pageaddr;
+	char	   *page;
+
+	/* last record read, reassembled */
+	char	   *record;
+	uint32		record_alloc;
+	XLogRecPtr	record_end;		/* end of its last byte */
+
+	uint64		bytes_read;
+	char		errmsg[256];
+} WalReader;
+
+extern void walreader_init(WalReader *reader, const char *pgdata,
+						   const char *archive, int segsize, TimeLineID tli);
+extern void walreader_close(WalReader *reader);
+extern WalReadResult walreader_stream_segment(WalReader *reader,
+											 XLogSegNo segno);
+extern WalReadResult walreader_read_page(WalReader *reader, XLogRecPtr pageaddr);
+extern WalReadResult walreader_read_record(WalReader *reader, XLogRecPtr lsn);
+extern WalReadResult walreader_first_record(WalReader *reader, XLogSegNo segno,
+											XLogRecPtr *lsn);
+extern int	walreader_decode_blocks(const XLogRecord *record,
+									WalBlockRef *blocks);
+extern XLogRecPtr walreader_next_lsn(const WalReader *reader);
+extern bool walreader_segment_path(const WalReader *reader, XLogSegNo segno,
+								   char *path, size_t len);
+
+#endif							/* WALREADER_H */
@@ -0,0 +1,409 @@
+/*
+ * walscan.c
+ *	  Parallel scan of the WAL from a start point to its end.
+ *
+ * Every segment from the one holding the start point up to the last one
+ * found in pg_wal or the archive is a task.  A worker streams its segment
+ * through a window of a few MB filled with large reads, finds the first
+ * record starting in it (skipping the continuation of the previous
+ * segment's last record), then follows the record chain, checking page
+ * headers, CRCs and xl_prev, until a record starts in the next segment.  Records crossing into the next segment are
+ * read by the worker that has their start.
+ *
+ * Afterwards the per-segment chains are stitched together in order: each
+ * must begin where the previous one left off and point back to its last
+ * record.  The first place this fails, or a segment stops early, is the
+ * end of the WAL.  Any segment after that which still holds valid records
+ * means the WAL has a hole rather than an end.
+ *
+ * With tail_segments, the scan starts at the first record of a segment
+ * near the end instead, and the chain is joined wherever its first record
+ * is.  The end is the last segment whose first page carries its own
+ * address: the highest-numbered files of pg_wal are usually recycled or
+ * preallocated for the future and hold no records yet.
+ *
+ * With io->adaptive, the scan starts with as many workers as concurrency.c
+ * allows reads in flight and adds one whenever that rises, rather than
+ * starting them all when the scan does.
+ *
+ * Only the timeline of the start point is read.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "access/xlog_internal.h"
+#include "common/logging.h"
+
+#include "walscan.h"
+
+typedef struct WalScanWorker
+{
+	WalScan    *scan;
+	int			id;
+	pthread_t	thread;
+	uint64		bytes_read;
+} WalScanWorker;
+
+static XLogSegNo find_last_segment(WalScan *scan, const char *dir,
+								   XLogSegNo last);
+static XLogSegNo find_written_segment(WalScan *scan, XLogSegNo first,
+									  XLogSegNo last);
+static void start_worker(WalScan *scan);
+static void *walscan_worker(void *arg);
+static void scan_segment(WalScan *scan, int worker, WalReader *reader,
+						 XLogSegNo segno, WalScanSegment *seg);
+static void stitch_segments(WalScan *scan);
+
+
+void
+walscan_run(WalScan *scan)
+{
+	char		path[MAXPGPATH];
+	XLogSegNo	last;
+	bool		adaptive = scan->io != NULL && scan->io->adaptive;
+	int			nworkers = Max(scan->nworkers, 1);
+	int			nstart = nworkers;
+	int			i;
+
+	XLByteToSeg(scan->start, scan->first_segno, scan->segsize);
+
+	snprintf(path, sizeof(path), "%s/%s", scan->pgdata, XLOGDIR);
+	last = find_last_segment(scan, path, scan->first_segno);
+	if (scan->archive != NULL)
+		last = find_last_segment(scan, scan->archive, last);
+
+	if (scan->tail_segments > 0)
+	{
+		last = find_written_segment(scan, scan->first_segno, last);
+		if (last - scan->first_segno >= scan->tail_segments)
+		{
+			scan->first_segno = last - scan->tail_segments + 1;
+			XLogSegNoOffsetToRecPtr(scan->first_segno, 0, scan->segsize, scan->start);
+		}
+	}
+
+	scan->nsegments = last - scan->first_segno + 1;
+	if (scan->max_segments > 0 && scan->nsegments > scan->max_segments)
+		scan->nsegments = scan->max_segments;
+	scan->segments = pg_malloc0(sizeof(WalScanSegment) * scan->nsegments);
+	scan->next_segment = 0;
+	scan->nrecords = 0;
+	scan->bytes_read = 0;
+	pthread_mutex_init(&scan->lock, NULL);
+	if (adaptive)
+	{
+		struct stat st;
+
+		if (stat(path, &st) != 0)
+			pg_fatal("could not stat directory \"%s\": %m", path);
+		concurrency_init(&scan->cc, nworkers, st.st_dev);
+		/* Workers start more workers as the limit rises */
+		nstart = scan->cc.workers;
+	}
+
+	scan->workers = pg_malloc0(sizeof(WalScanWorker) * nworkers);
+	scan->nstarted = 0;
+	for (i = 0; i < nstart; i++)
+		start_worker(scan);
+
+	/* Workers are only started by running workers */
+	for (i = 0;; i++)
+	{
+		int			nstarted;
+
+		pthread_mutex_lock(&scan->lock);
+		nstarted = scan->nstarted;
+		pthread_mutex_unlock(&scan->lock);
+		if (i >= nstarted)
+			break;
+		pthread_join(scan->workers[i].thread, NULL);
+		scan->bytes_read += scan->workers[i].bytes_read;
+	}
+	pg_free(scan->workers);
+	scan->workers = NULL;
+	pthread_mutex_destroy(&scan->lock);
+	if (adaptive)
+		concurrency_destroy(&scan->cc);
+
+	stitch_segments(scan);
+}
+
+
+/*
+ * Highest segment number of our timeline in dir, or last if that is higher.
+ */
+static XLogSegNo
+find_last_segment(WalScan *scan, const char *dir, XLogSegNo last)
+{
+	DIR		   *d;
+	struct dirent *de;
+
+	if ((d = opendir(dir)) == NULL)
+		pg_fatal("could not open directory \"%s\": %m", dir);
+	while (errno = 0, (de = readdir(d)) != NULL)
+	{
+		TimeLineID	tli;
+		XLogSegNo	segno;
+
+		if (!IsXLogFileName(de->d_name))
+			continue;
+		XLogFromFileName(de->d_name, &tli, &segno, scan->segsize);
+		if (tli == scan->tli && segno > last)
+			last = segno;
+	}
+	if (errno != 0)
+		pg_fatal("could not read directory \"%s\": %m", dir);
+	closedir(d);
+
+	return last;
+}
+
+
+/*
+ * The last segment from first to last that has been written since it was
+ * last recycled, judged by the address in its first page header.  first,
+ * holding the start point, counts as written.
+ */
+static XLogSegNo
+find_written_segment(WalScan *scan, XLogSegNo first, XLogSegNo last)
+{
+	WalReader	reader;
+	XLogSegNo	segno;
+
+	walreader_init(&reader, scan->pgdata, scan->archive, scan->segsize, scan->tli);
+	reader.io = scan->io;
+
+	for (segno = last; segno > first; segno--)
+	{
+		XLogRecPtr	pageaddr;
+
+		XLogSegNoOffsetToRecPtr(segno, 0, scan->segsize, pageaddr);
+		if (walreader_read_page(&reader, pageaddr) == WAL_READ_OK)
+			break;
+	}
+
+	walreader_close(&reader);
+	return segno;
+}
+
+
+static void
+start_worker(WalScan *scan)
+{
+	WalScanWorker *worker;
+	int			rc;
+
+	pthread_mutex_lock(&scan->lock);
+	Assert(scan->nstarted < Max(scan->nworkers, 1));
+	worker = &scan->workers[scan->nstarted];
+	worker->scan = scan;
+	worker->id = scan->nstarted;
+	if ((rc = pthread_create(&worker->thread, NULL, walscan_worker,
+							 worker)) != 0)
+	{
+		errno = rc;
+		pg_fatal("could not create thread: %m");
+	}
+	scan->nstarted++;
+	pthread_mutex_unlock(&scan->lock);
+}
+
+
+static void *
+walscan_worker(void *arg)
+{
+	WalScanWorker *worker = (WalScanWorker *) arg;
+	WalScan    *scan = worker->scan;
+	WalReader	reader;
+
+	walreader_init(&reader, scan->pgdata, scan->archive, scan->segsize, scan->tli);
+	reader.io = scan->io;
+	if (scan->io != NULL && scan->io->adaptive)
+		reader.cc = &scan->cc;
+
+	for (;;)
+	{
+		int			i;
+
+		pthread_mutex_lock(&scan->lock);
+		i = scan->next_segment++;
+		pthread_mutex_unlock(&scan->lock);
+		if (i >= scan->nsegments)
+			break;
+
+		if (scan->skip_fn != NULL &&
+			scan->skip_fn(scan, scan->first_segno + i, &scan->segments[i]))
+			continue;
+		scan_segment(scan, worker->id, &reader, scan->first_segno + i,
+					 &scan->segments[i]);
+		if (scan->segment_done_fn != NULL)
+			scan->segment_done_fn(scan, worker->id, scan->first_segno + i,
+								  &scan->segments[i]);
+	}
+
+	worker->bytes_read = reader.bytes_read;
+	walreader_close(&reader);
+	return NULL;
+}
+
+
+static void
+scan_segment(WalScan *scan, int worker, WalReader *reader, XLogSegNo segno,
+			 WalScanSegment *seg)
+{
+	XLogRecPtr	segend;
+	XLogRecPtr	lsn;
+	XLogRecPtr	prev = InvalidXLogRecPtr;
+	WalReadResult result;
+
+	XLogSegNoOffsetToRecPtr(segno + 1, 0, scan->segsize, segend);
+	seg->stop = WAL_READ_OK;
+
+	/* With io->adaptive, add a worker whenever the limit has risen */
+	result = walreader_stream_segment(reader, segno);
+	if (scan->io != NULL && scan->io->adaptive &&
+		concurrency_grow(&scan->cc))
+		start_worker(scan);
+	if (result == WAL_READ_OK)
+	{
+		if (segno == scan->first_segno &&
+			XLogSegmentOffset(scan->start, scan->segsize) != 0)
+			lsn = scan->start;
+		else
+			result = walreader_first_record(reader, segno, &lsn);
+	}
+	if (result != WAL_READ_OK)
+	{
+		seg->stop = result;
+		XLogSegNoOffsetToRecPtr(segno, 0, scan->segsize, seg->stop_lsn);
+		strlcpy(seg->errmsg, reader->errmsg, sizeof(seg->errmsg));
+		return;
+	}
+	if (XLogRecPtrIsInvalid(lsn))
+		return;
+
+	while (lsn < segend)
+	{
+		const XLogRecord *record;
+
+		result = walreader_read_record(reader, lsn);
+		if (result != WAL_READ_OK)
+		{
+			seg->stop = result;
+			seg->stop_lsn = lsn;
+			strlcpy(seg->errmsg, reader->errmsg, sizeof(seg->errmsg));
+			return;
+		}
+		record = (const XLogRecord *) reader->record;
+
+		if (seg->nrecords == 0)
+		{
+			seg->first_start = lsn;
+			seg->first_prev = record->xl_prev;
+		}
+		else if (record->xl_prev != prev)
+		{
+			seg->stop = WAL_READ_INVALID;
+			seg->stop_lsn = lsn;
+			snprintf(seg->errmsg, sizeof(seg->errmsg),
+					 "record at %X/%X points back to %X/%X instead of %X/%X",
+					 LSN_FORMAT_ARGS(lsn), LSN_FORMAT_ARGS(record->xl_prev),
+					 LSN_FORMAT_ARGS(prev));
+			return;
+		}
+
+		if (scan->record_fn != NULL)
+			scan->record_fn(scan, worker, lsn, record);
+
+		seg->nrecords++;
+		seg->last_start = prev = lsn;
+		lsn = walreader_next_lsn(reader);
+	}
+	seg->next = lsn;
+}
+
+
+static void
+stitch_segments(WalScan *scan)
+{
+	XLogRecPtr	expected = scan->start;
+	XLogRecPtr	prev = InvalidXLogRecPtr;
+	bool		ended = false;
+	bool		joined = false;
+	int			i;
+
+	scan->end = InvalidXLogRecPtr;
+	scan->gap = false;
+	scan->errmsg[0] = '\0';
+
+	for (i = 0; i < scan->nsegments; i++)
+	{
+		WalScanSegment *seg = &scan->segments[i];
+		XLogRecPtr	segend;
+		char		fname[MAXFNAMELEN];
+
+		XLogSegNoOffsetToRecPtr(scan->first_segno + i + 1, 0, scan->segsize, segend);
+		XLogFileName(fname, scan->tli, scan->first_segno + i, scan->segsize);
+		seg->in_wal = false;
+
+		if (ended)
+		{
+			if (seg->nrecords > 0)
+			{
+				scan->gap = true;
+				snprintf(scan->errmsg + strlen(scan->errmsg),
+						 sizeof(scan->errmsg) - strlen(scan->errmsg),
+						 ", but segment %s has valid records from %X/%X",
+						 fname, LSN_FORMAT_ARGS(seg->first_start));
+				return;
+			}
+			continue;
+		}
+
+		/* A record started earlier covers all of this segment */
+		if (expected >= segend && seg->stop == WAL_READ_OK)
+			continue;
+
+		if (expected < segend && joined && seg->nrecords > 0 &&
+			(seg->first_start != expected || seg->first_prev != prev))
+		{
+			scan->end = expected;
+			snprintf(scan->errmsg, sizeof(scan->errmsg),
+					 "record chain breaks at %X/%X: segment %s starts with a record at %X/%X pointing back to %X/%X",
+					 LSN_FORMAT_ARGS(expected), fname,
+					 LSN_FORMAT_ARGS(seg->first_start),
+					 LSN_FORMAT_ARGS(seg->first_prev));
+			ended = true;
+			continue;
+		}
+
+		scan->nrecords += seg->nrecords;
+		seg->in_wal = true;
+		if (seg->stop != WAL_READ_OK)
+		{
+			scan->end = Max(seg->stop_lsn, expected);
+			strlcpy(scan->errmsg, seg->errmsg, sizeof(scan->errmsg));
+			ended = true;
+			continue;
+		}
+		if (seg->nrecords > 0)
+		{
+			expected = seg->next;
+			prev = seg->last_start;
+			joined = true;
+		}
+	}
+
+	if (!ended)
+	{
+		scan->end = expected;
+		snprintf(scan->errmsg, sizeof(scan->errmsg), "no more WAL segments");
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * walscan.h
+ *	  Parallel scan of the WAL from a start point to its end, one segment
+ *	  per task.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+#ifndef WALSCAN_H
+#define WALSCAN_H
+
+#include <pthread.h>
+
+#include "concurrency.h"
+#include "walreader.h"
+
+struct WalScan;
+
+/* A block touched by a record, zero-padded for use as a hash key */
+typedef struct WalBlockTag
+{
+	RelFileLocator rlocator;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+} WalBlockTag;
+
+/*
+ * Called by a worker for every valid record, in LSN order within one
+ * segment but concurrently across segments.
+ */
+typedef void (*walscan_record_fn) (struct WalScan *scan, int worker,
+								   XLogRecPtr lsn, const XLogRecord *record);
+
+/* What the walk over one segment found */
+typedef struct WalScanSegment
+{
+	XLogRecPtr	first_start;	/* first record starting here, or invalid */
+	XLogRecPtr	first_prev;		/* its xl_prev */
+	XLogRecPtr	last_start;		/* last record starting here */
+	XLogRecPtr	next;			/* where the record after that starts */
+	uint64		nrecords;
+	WalReadResult stop;			/* why the walk stopped, or WAL_READ_OK */
+	XLogRecPtr	stop_lsn;
+	char		errmsg[256];
+	bool		in_wal;			/* set by walscan_run(): the records are
+								 * part of the WAL up to end */
+} WalScanSegment;
+
+/*
+ * Optional per-segment callbacks, for scans that remember what they found.
+ * skip_fn may fill in seg from an earlier scan and return true, and the
+ * segment is then not read.  segment_done_fn is called by the worker that
+ * has walked a segment, after all record_fn calls for it.
+ */
+typedef bool (*walscan_skip_fn) (struct WalScan *scan, XLogSegNo segno,
+								 WalScanSegment *seg);
+typedef void (*walscan_segment_fn) (struct WalScan *scan, int worker,
+									XLogSegNo segno,
+									const WalScanSegment *seg);
+
+typedef struct WalScan
+{
+	/* set by the caller */
+	const char *pgdata;
+	const char *archive;		/* NULL if none */
+	int			segsize;
+	TimeLineID	tli;
+	XLogRecPtr	start;			/* usually checkPointCopy.redo */
+	int			nworkers;
+	int			max_segments;	/* 0 = up to the last segment found */
+	int			tail_segments;	/* if > 0, only this many segments up to
+								 * the last one written, starting at the
+								 * first record of the first */
+	ScanIO	   *io;				/* read policy and limits, NULL = buffered */
+	walscan_record_fn record_fn;	/* may be NULL */
+	walscan_skip_fn skip_fn;	/* may be NULL */
+	walscan_segment_fn segment_done_fn; /* may be NULL */
+	void	   *arg;
+
+	/* set by walscan_run() */
+	XLogSegNo	first_segno;
+	int			nsegments;		/* up to the last segment found */
+	WalScanSegment *segments;
+	XLogRecPtr	end;			/* end of the valid WAL */
+	bool		gap;			/* valid WAL exists past a break */
+	char		errmsg[512];	/* why the WAL ends there */
+	uint64		nrecords;
+	uint64		bytes_read;
+
+	/* work queue */
+	pthread_mutex_t lock;
+	int			next_segment;
+	ScanConcurrency cc;			/* used if io->adaptive */
+	struct WalScanWorker *workers;	/* room for nworkers */
+	int			nstarted;		/* protected by lock */
+} WalScan;
+
+extern void walscan_run(WalScan *scan);
+
+#endif							/* WALSCAN_H */
@@ -0,0 +1,323 @@
+/*
+ * watch.c
+ *	  Follow pg_control of many data directories with inotify and publish
+ *	  what changed (--watch).
+ *
+ * pg_control is only re-read when the server closes it after writing or
+ * renames a new copy into place, so an idle cluster costs nothing.  Every
+ * observation prints one NDJSON record with the fields that changed and
+ * the XID/multixact consumption rates and checkpoint interval derived from
+ * the previous observation; optionally the latest values are also kept in
+ * a Prometheus textfile-collector file.
+ *
+ * Portions Copyright (c) 1996-2024, PostgreSQL Global Development Group
+ */
+
+#define FRONTEND 1
+
+#include "postgres.h"
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "common/logging.h"
+#include "lib/stringinfo.h"
+#include "portability/instr_time.h"
+
+#include "pg_control_editor.h"
+#include "pgcontrol.h"
+
+#ifdef __linux__
+
+typedef struct WatchedDir
+{
+	const char *datadir;
+	int			wd;				/* inotify watch descriptor of global/ */
+	bool		valid;			/* prev holds an observation */
+	PgControl	prev;
+	instr_time	prev_seen;
+	double		xid_rate;		/* XIDs per second */
+	double		multi_rate;		/* multixacts per second */
+	int64		checkpoint_interval;	/* seconds, -1 if unknown */
+} WatchedDir;
+
+static void observe(WatchedDir *dir, const char *textfile, WatchedDir *dirs,
+					int ndirs);
+static uint64 field_value(const PgControl *ctl, const char *name);
+static void write_textfile(const char *textfile, WatchedDir *dirs, int ndirs);
+static void append_label_value(StringInfo buf, const char *value);
+
+
+int
+run_watch(char **datadirs, int ndatadirs, const char *textfile)
+{
+	WatchedDir *dirs;
+	int			fd;
+	int			i;
+	char		buf[64 * 1024]
+				pg_attribute_aligned(__alignof__(struct inotify_event));
+
+	if (ndatadirs == 0)
+		pg_fatal("no data directory specified for --watch");
+
+	if ((fd = inotify_init1(IN_CLOEXEC)) < 0)
+		pg_fatal("could not initialize inotify: %m");
+
+	dirs = pg_malloc0(sizeof(WatchedDir) * ndatadirs);
+	for (i = 0; i < ndatadirs; i++)
+	{
+		char		path[MAXPGPATH];
+
+		dirs[i].datadir = datadirs[i];
+		dirs[i].checkpoint_interval = -1;
+		snprintf(path, sizeof(path), "%s/global", datadirs[i]);
+		dirs[i].wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (dirs[i].wd < 0)
+			pg_fatal("could not watch directory \"%s\": %m", path);
+	}
+
+	/* Baseline observation of every directory */
+	for (i = 0; i < ndatadirs; i++)
+		observe(&dirs[i], NULL, dirs, ndatadirs);
+	if (textfile != NULL)
+		write_textfile(textfile, dirs, ndatadirs);
+
+	for (;;)
+	{
+		ssize_t		len = read(fd, buf, sizeof(buf));
+		char	   *p;
+
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			pg_fatal("could not read inotify events: %m");
+		}
+
+		for (p = buf; p < buf + len;)
+		{
+			struct inotify_event *ev = (struct inotify_event *) p;
+
+			p += sizeof(struct inotify_event) + ev->len;
+
+			/* Lost events: re-read everything */
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				for (i = 0; i < ndatadirs; i++)
+					observe(&dirs[i], textfile, dirs, ndatadirs);
+				continue;
+			}
+
+			if (ev->len == 0 || strcmp(ev->name, "pg_control") != 0)
+				continue;
+
+			for (i = 0; i < ndatadirs; i++)
+			{
+				if (dirs[i].wd == ev->wd)
+					observe(&dirs[i], textfile, dirs, ndatadirs);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Re-read one pg_control and print the delta against the previous read.
+ */
+static void
+observe(WatchedDir *dir, const char *textfile, WatchedDir *dirs, int ndirs)
+{
+	PgControl	cur;
+	instr_time	now;
+	StringInfoData out;
+	double		elapsed = 0;
+	int			i;
+
+	memset(&cur, 0, sizeof(cur));
+	if (!pgcontrol_read(&cur, dir->datadir))
+	{
+		pg_log_warning("%s: %s", dir->datadir, cur.errmsg);
+		return;
+	}
+	if (!cur.crc_ok)
+	{
+		pg_log_warning("%s: pg_control has invalid CRC, skipping", dir->datadir);
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	initStringInfo(&out);
+	appendStringInfoString(&out, "{\"datadir\": ");
+	append_json_string(&out, dir->datadir);
+	appendStringInfo(&out, ", \"time\": " INT64_FORMAT, (int64) time(NULL));
+
+	if (dir->valid && dir->prev.layout == cur.layout)
+	{
+		instr_time	diff = now;
+		bool		first = true;
+
+		INSTR_TIME_SUBTRACT(diff, dir->prev_seen);
+		elapsed = INSTR_TIME_GET_DOUBLE(diff);
+
+		appendStringInfoString(&out, ", \"changed\": {");
+		for (i = 0; i < cur.layout->nfields; i++)
+		{
+			const PgControlField *field = &cur.layout->fields[i];
+			char		oldval[128];
+			char		newval[128];
+
+			pgcontrol_format_field(&dir->prev, field, oldval, sizeof(oldval));
+			pgcontrol_format_field(&cur, field, newval, sizeof(newval));
+			if (strcmp(oldval, newval) == 0)
+				continue;
+
+			appendStringInfo(&out, "%s\"%s\": {\"old\": \"%s\", \"new\": \"%s\"}",
+							 first ? "" : ", ", field->name, oldval, newval);
+			first = false;
+		}
+		appendStringInfoChar(&out, '}');
+
+		if (elapsed > 0)
+		{
+			dir->xid_rate =
+				(double) (field_value(&cur, "checkPointCopy.nextXid") -
+						  field_value(&dir->prev, "checkPointCopy.nextXid")) / elapsed;
+			dir->multi_rate =
+				(double) (uint32) (field_value(&cur, "checkPointCopy.nextMulti") -
+								   field_value(&dir->prev, "checkPointCopy.nextMulti")) / elapsed;
+		}
+		if (field_value(&cur, "checkPoint") != field_value(&dir->prev, "checkPoint"))
+			dir->checkpoint_interval =
+				(int64) (field_value(&cur, "checkPointCopy.time") -
+						 field_value(&dir->prev, "checkPointCopy.time"));
+
+		appendStringInfo(&out, ", \"xids_per_sec\": %.3f, \"multis_per_sec\": %.3f",
+						 dir->xid_rate, dir->multi_rate);
+		if (dir->checkpoint_interval >= 0)
+			appendStringInfo(&out, ", \"checkpoint_interval_sec\": " INT64_FORMAT,
+							 dir->checkpoint_interval);
+	}
+	appendStringInfoString(&out, "}\n");
+
+	fwrite(out.data, 1, out.len, stdout);
+	fflush(stdout);
+	pfree(out.data);
+
+	dir->prev = cur;
+	dir->prev_seen = now;
+	dir->valid = true;
+
+	if (textfile != NULL)
+		write_textfile(textfile, dirs, ndirs);
+}
+
+
+static uint64
+field_value(const PgControl *ctl, const char *name)
+{
+	const PgControlField *field = pgcontrol_find_field(ctl->layout, name);
+
+	return field != NULL ? pgcontrol_get_field(ctl, field) : 0;
+}
+
+
+/*
+ * Replace the Prometheus textfile atomically with the latest values.
+ */
+static void
+write_textfile(const char *textfile, WatchedDir *dirs, int ndirs)
+{
+	char		tmp[MAXPGPATH];
+	FILE	   *f;
+	StringInfoData label;
+	int			i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", textfile);
+	if ((f = fopen(tmp, "w")) == NULL)
+		pg_fatal("could not open file \"%s\" for writing: %m", tmp);
+
+	fprintf(f, "# TYPE pg_control_next_xid gauge\n"
+			"# TYPE pg_control_next_multixact gauge\n"
+			"# TYPE pg_control_next_oid gauge\n"
+			"# TYPE pg_control_checkpoint_lsn gauge\n"
+			"# TYPE pg_control_checkpoint_time gauge\n"
+			"# TYPE pg_control_xids_per_second gauge\n"
+			"# TYPE pg_control_multixacts_per_second gauge\n"
+			"# TYPE pg_control_checkpoint_interval_seconds gauge\n");
+	initStringInfo(&label);
+	for (i = 0; i < ndirs; i++)
+	{
+		WatchedDir *d = &dirs[i];
+		const char *datadir;
+
+		if (!d->valid)
+			continue;
+
+		resetStringInfo(&label);
+		append_label_value(&label, d->datadir);
+		datadir = label.data;
+
+		fprintf(f, "pg_control_next_xid{datadir=\"%s\"} " UINT64_FORMAT "\n",
+				datadir, field_value(&d->prev, "checkPointCopy.nextXid"));
+		fprintf(f, "pg_control_next_multixact{datadir=\"%s\"} " UINT64_FORMAT "\n",
+				datadir, field_value(&d->prev, "checkPointCopy.nextMulti"));
+		fprintf(f, "pg_control_next_oid{datadir=\"%s\"} " UINT64_FORMAT "\n",
+				datadir, field_value(&d->prev, "checkPointCopy.nextOid"));
+		fprintf(f, "pg_control_checkpoint_lsn{datadir=\"%s\"} " UINT64_FORMAT "\n",
+				datadir, field_value(&d->prev, "checkPoint"));
+		fprintf(f, "pg_control_checkpoint_time{datadir=\"%s\"} " INT64_FORMAT "\n",
+				datadir, (int64) field_value(&d->prev, "checkPointCopy.time"));
+		fprintf(f, "pg_control_xids_per_second{datadir=\"%s\"} %.3f\n",
+				datadir, d->xid_rate);
+		fprintf(f, "pg_control_multixacts_per_second{datadir=\"%s\"} %.3f\n",
+				datadir, d->multi_rate);
+		if (d->checkpoint_interval >= 0)
+			fprintf(f, "pg_control_checkpoint_interval_seconds{datadir=\"%s\"} " INT64_FORMAT "\n",
+					datadir, d->checkpoint_interval);
+	}
+	pfree(label.data);
+
+	if (fclose(f) != 0)
+		pg_fatal("could not write file \"%s\": %m", tmp);
+	if (rename(tmp, textfile) != 0)
+		pg_fatal("could not rename file \"%s\" to \"%s\": %m", tmp, textfile);
+}
+
+
+/*
+ * Append value as the exposition format wants a label value: backslash,
+ * double quote and newline escaped with a backslash.
+ */
+static void
+append_label_value(StringInfo buf, const char *value)
+{
+	const char *p;
+
+	for (p = value; *p; p++)
+	{
+		if (*p == '\n')
+			appendStringInfoString(buf, "\\n");
+		else
+		{
+			if (*p == '\\' || *p == '"')
+				appendStringInfoChar(buf, '\\');
+			appendStringInfoChar(buf, *p);
+		}
+	}
+}
+
+#else							/* !__linux__ */
+
+int
+run_watch(char **datadirs, int ndatadirs, const char *textfile)
+{
+	pg_fatal("--watch is not supported on this platform");
+	return 1;
+}
+
+#endif							/* __linux__ */